@@ -0,0 +1,257 @@
+/*! \file
+ * Offline analyzer for heap snapshots written by myalloc_dump (see dump.h).
+ * It reads a snapshot in one streaming pass, keeping only fixed-size
+ * totals and the cells of the maps, so a pool of millions of blocks takes no
+ * more memory than a small one, and reports:
+ *      -- the blocks and bytes allocated, in slabs and free
+ *      -- the distribution of free block sizes, by powers of two
+ *      -- the largest request the pool could satisfy without growing, and
+ *         the fragmentation index (the share of free memory outside the
+ *         largest free block, as myheap_fragmentation computes it)
+ *      -- the bytes spent on tags
+ *      -- a coarse ASCII map of the pool, and optionally a PPM image of it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "myalloc.h"
+#include "dump.h"
+
+#define READ_RECORDS 65536
+#define HIST_BUCKETS 64
+#define DEFAULT_COLUMNS 64
+#define DEFAULT_ROWS 16
+#define DEFAULT_IMAGE_SIZE 256
+
+// A map of the pool: cells equal slices of it, with the bytes of each kind
+// of block (DUMP_FREE, DUMP_ALLOC or DUMP_SLAB) falling in each slice.
+typedef struct pool_map {
+  uint64_t cells;
+  uint64_t poolBytes;
+  uint64_t *bytes[3];
+} pool_map;
+
+void usage(char *program) {
+  printf("usage: %s [-c columns] [-r rows] [-p image.ppm] [-s side] "
+         "snapshot\n", program);
+  printf("\tAnalyzes a heap snapshot written by myalloc_dump.\n\n");
+  printf("\t-c columns and -r rows set the size of the ASCII map\n\n");
+  printf("\t-p image.ppm also draws the pool as a square PPM image, -s side\n");
+  printf("\tpixels wide and high (%d by default)\n\n", DEFAULT_IMAGE_SIZE);
+}
+
+void map_init(pool_map *map, uint64_t cells, uint64_t poolBytes) {
+  map->cells = cells;
+  map->poolBytes = poolBytes;
+  for (int k = 0; k < 3; k++) {
+    map->bytes[k] = calloc(cells, sizeof(uint64_t));
+    if (map->bytes[k] == NULL) {
+      fprintf(stderr, "Cannot allocate a map of %lu cells.\n",
+              (unsigned long) cells);
+      exit(1);
+    }
+  }
+}
+
+// Returns the offset in the pool at which cell c starts.
+uint64_t cell_start(pool_map *map, uint64_t c) {
+  return c * map->poolBytes / map->cells;
+}
+
+// Adds the block from start to end to the cells it overlaps. Over a whole
+// snapshot this is linear in the blocks plus the cells.
+void map_add(pool_map *map, uint64_t start, uint64_t end, int kind) {
+  uint64_t first = start * map->cells / map->poolBytes;
+  uint64_t last = (end - 1) * map->cells / map->poolBytes;
+  for (uint64_t c = first; c <= last; c++) {
+    uint64_t from = cell_start(map, c) > start ? cell_start(map, c) : start;
+    uint64_t to = cell_start(map, c + 1) < end ? cell_start(map, c + 1) : end;
+    map->bytes[kind][c] += to - from;
+  }
+}
+
+// Returns the share of cell c taken up by the given kind of block.
+double map_share(pool_map *map, uint64_t c, int kind) {
+  uint64_t cellBytes = cell_start(map, c + 1) - cell_start(map, c);
+  return cellBytes == 0 ? 0.0 : (double) map->bytes[kind][c] / cellBytes;
+}
+
+// Prints the ASCII map: '.' for a free cell, '#' for one in use, 1 to 9 for
+// the tenths of a cell in use, and 'S' for one mostly taken by slabs.
+void print_map(pool_map *map, int columns) {
+  printf("Map (%lu bytes per cell; '.' free, '#' in use, 1-9 tenths in use,"
+         " 'S' slabs):\n", (unsigned long) (map->poolBytes / map->cells));
+  for (uint64_t c = 0; c < map->cells; c++) {
+    double used = 1.0 - map_share(map, c, DUMP_FREE);
+    int tenths = (int) (used * 10 + 0.5);
+    char ch;
+    if (map_share(map, c, DUMP_SLAB) > 0.5)
+      ch = 'S';
+    else if (tenths == 0)
+      ch = '.';
+    else if (tenths == 10)
+      ch = '#';
+    else
+      ch = '0' + tenths;
+    putchar(ch);
+    if ((c + 1) % columns == 0)
+      putchar('\n');
+  }
+  if (map->cells % columns != 0)
+    putchar('\n');
+}
+
+// Writes the map as a binary PPM image, one pixel per cell, blending white
+// for free memory, red for allocated blocks and blue for slabs.
+int write_ppm(pool_map *map, int width, int height, char *path) {
+  static const int colors[3][3] = {{255, 255, 255}, {200, 40, 40},
+                                   {40, 80, 200}};
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return -1;
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (uint64_t c = 0; c < map->cells; c++) {
+    for (int rgb = 0; rgb < 3; rgb++) {
+      double value = 0;
+      for (int k = 0; k < 3; k++)
+        value += map_share(map, c, k) * colors[k][rgb];
+      fputc((int) (value + 0.5), f);
+    }
+  }
+  return fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  int columns = DEFAULT_COLUMNS, rows = DEFAULT_ROWS;
+  int side = DEFAULT_IMAGE_SIZE;
+  char *image = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "c:r:p:s:")) != -1) {
+    switch (c) {
+      case 'c':
+        columns = atoi(optarg);
+        break;
+      case 'r':
+        rows = atoi(optarg);
+        break;
+      case 'p':
+        image = optarg;
+        break;
+      case 's':
+        side = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || columns <= 0 || rows <= 0 || side <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  if (f == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  dump_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || memcmp(header.magic, DUMP_MAGIC, sizeof(header.magic)) != 0
+      || header.version != DUMP_VERSION || header.poolBytes == 0) {
+    fprintf(stderr, "%s is not a heap snapshot.\n", argv[optind]);
+    return 1;
+  }
+
+  pool_map ascii, pixels;
+  map_init(&ascii, (uint64_t) columns * rows, header.poolBytes);
+  if (image != NULL)
+    map_init(&pixels, (uint64_t) side * side, header.poolBytes);
+
+  // one pass over the records, in chunks
+  static uint32_t records[READ_RECORDS];
+  uint64_t blocks[3] = {0, 0, 0}, bytes[3] = {0, 0, 0};
+  uint64_t freeCount[HIST_BUCKETS] = {0}, freeBytes[HIST_BUCKETS] = {0};
+  uint64_t largest = 0, offset = 0;
+  int ended = 0;
+  while (!ended) {
+    size_t n = fread(records, sizeof(records[0]), READ_RECORDS, f);
+    if (n == 0) {
+      fprintf(stderr, "Snapshot is cut short at offset %lu.\n",
+              (unsigned long) offset);
+      return 1;
+    }
+    for (size_t i = 0; i < n && !ended; i++) {
+      uint64_t size = (uint64_t) DUMP_UNITS(records[i]) * header.alignment;
+      int kind = DUMP_KIND(records[i]);
+      if (size == 0) {
+        ended = 1;
+        break;
+      }
+      if (kind > DUMP_SLAB || size > header.poolBytes - offset) {
+        fprintf(stderr, "Bad block record at offset %lu.\n",
+                (unsigned long) offset);
+        return 1;
+      }
+      blocks[kind]++;
+      bytes[kind] += size;
+      if (kind == DUMP_FREE) {
+        int bucket = 63 - __builtin_clzll(size);
+        freeCount[bucket]++;
+        freeBytes[bucket] += size;
+        if (size > largest)
+          largest = size;
+      }
+      map_add(&ascii, offset, offset + size, kind);
+      if (image != NULL)
+        map_add(&pixels, offset, offset + size, kind);
+      offset += size;
+    }
+  }
+  fclose(f);
+  if (offset != header.poolBytes) {
+    fprintf(stderr, "Blocks add up to %lu bytes, not the pool's %lu.\n",
+            (unsigned long) offset, (unsigned long) header.poolBytes);
+    return 1;
+  }
+
+  uint64_t total = blocks[0] + blocks[1] + blocks[2];
+  printf("Pool: %lu bytes in %lu blocks", (unsigned long) header.poolBytes,
+         (unsigned long) total);
+  printf(" (and %lu bytes of large objects outside it)\n",
+         (unsigned long) header.largeBytes);
+  printf("  allocated  %10lu blocks %14lu bytes\n",
+         (unsigned long) blocks[DUMP_ALLOC], (unsigned long) bytes[DUMP_ALLOC]);
+  printf("  slabs      %10lu blocks %14lu bytes\n",
+         (unsigned long) blocks[DUMP_SLAB], (unsigned long) bytes[DUMP_SLAB]);
+  printf("  free       %10lu blocks %14lu bytes\n",
+         (unsigned long) blocks[DUMP_FREE], (unsigned long) bytes[DUMP_FREE]);
+
+  printf("Largest satisfiable request: %lu bytes\n", (unsigned long)
+         (largest > header.tagBytes ? largest - header.tagBytes : 0));
+  printf("Fragmentation index: %.4f\n", bytes[DUMP_FREE] == 0 ? 0.0
+         : 1.0 - (double) largest / bytes[DUMP_FREE]);
+
+  // a header on every block, and a footer on every free one
+  uint64_t tags = (total + blocks[DUMP_FREE]) * header.tagBytes;
+  printf("Tag bytes: %lu (%.2f%% of the pool)\n", (unsigned long) tags,
+         100.0 * tags / header.poolBytes);
+
+  printf("Free block sizes:\n");
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    if (freeCount[b] != 0)
+      printf("  >= %-12lu %10lu blocks %14lu bytes\n", 1UL << b,
+             (unsigned long) freeCount[b], (unsigned long) freeBytes[b]);
+  }
+
+  print_map(&ascii, columns);
+  if (image != NULL && write_ppm(&pixels, side, side, image) != 0) {
+    perror(image);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,526 @@
+/*! \file
+ * Allocator benchmarks, built as benchmyalloc and run by make bench. Each
+ * workload runs on the default heap, in a pool that starts at a megabyte (or
+ * what -M asks for) and grows as it needs to, on small pages or, with -H, on
+ * huge pages (USE_HUGE_PAGES). It is run twice from the same seed: once
+ * untimed, for its throughput, and once with every myalloc, myfree and
+ * myrealloc call timed on its own, for the latency percentiles of each.
+ * Calls are timed with the time stamp counter where there is one (converted
+ * to nanoseconds against the clock at startup) and with clock_gettime
+ * elsewhere, so short calls include a few nanoseconds of timer.
+ *
+ * Workloads:
+ *      uniform     -- a fixed set of 256 byte blocks, one freed at random
+ *                     and allocated again at each step
+ *      random      -- the mix of generate_sequence in testalloc.c: sizes up
+ *                     to a quarter of the live limit, with random live
+ *                     blocks freed until the next one fits
+ *      realloc     -- buffers grown by half again at each step, up to 64 KB
+ *                     before they are freed and started over
+ *      lifo, fifo  -- batches of blocks of random sizes, freed newest first
+ *                     or oldest first
+ *      fragmented  -- churn of blocks too large for any of thousands of
+ *                     small free holes pinned in the pool, so that a search
+ *                     of the free list (findHead with -i list) visits all;
+ *                     being that slow, it runs a twentieth of the operations
+ *
+ * With -p, each workload is run a third time with hardware performance
+ * counters (see perfcount.h) read around every call and around the free
+ * block search inside the allocator, and each row also gets the average
+ * cycles, instructions, cache and TLB misses and branch misses per call,
+ * with a row of its own for the search. Where the counters cannot be opened,
+ * as in most containers, those columns are left empty.
+ *
+ * Results go to standard output as CSV, one row per workload and kind of
+ * call, with a label (make bench uses the commit) so that runs from
+ * different commits can be put side by side, and the page and pool settings,
+ * so that runs with and without huge pages can be too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "myalloc.h"
+#include "perfcount.h"
+
+#define DEFAULT_OPS 1000000
+#define BENCH_POOL_SIZE (1024 * 1024)
+#define BENCH_RESERVE ((size_t) 8 << 30)
+
+#define UNIFORM_SLOTS 4096
+#define UNIFORM_SIZE 256
+#define RANDOM_MAX_LIVE (1024 * 1024)
+#define RANDOM_SLOTS 4096
+#define REALLOC_BUFFERS 256
+#define REALLOC_LIMIT (64 * 1024)
+#define BATCH_BLOCKS 1000
+#define FRAG_HOLES 20000
+#define FRAG_HOLE_SIZE 200
+#define FRAG_PIN_SIZE 128
+#define FRAG_WINDOW 64
+
+#define OP_ALLOC 0
+#define OP_FREE 1
+#define OP_REALLOC 2
+#define OP_KINDS 3
+
+static const char *op_names[OP_KINDS] = {"myalloc", "myfree", "myrealloc"};
+static const int op_regions[OP_KINDS] = {PERF_ALLOC, PERF_FREE, PERF_REALLOC};
+
+// The durations of one kind of call, in ticks.
+typedef struct op_times {
+  uint64_t *ticks;
+  size_t count;
+  size_t slots;
+} op_times;
+
+// The state of a benchmark run: whether calls are timed or counted by the
+// hardware counters, the times, the calls made, and the workload's random
+// numbers.
+typedef struct bench {
+  int timed;
+  int counters;
+  int counting;  // 0 while a workload sets up, so that is left out
+  op_times times[OP_KINDS];
+  long calls[OP_KINDS];
+  uint64_t rng;
+} bench;
+
+typedef struct workload {
+  const char *name;
+  void (*run)(bench *b, long ops);
+  int share;  // runs 1/share of the operations asked for
+} workload;
+
+static double ns_per_tick = 1.0;
+static size_t pool_size = BENCH_POOL_SIZE;  // the pool a workload starts with
+
+void usage(char *program) {
+  printf("usage: %s [-i index] [-w workload] [-n ops] [-s seed] [-l label] "
+         "[-p] [-H] [-M megabytes]\n", program);
+  printf("\tRuns the allocator benchmarks, printing CSV.\n\n");
+  printf("\t-i index selects the free block index: list, tlsf or tree\n");
+  printf("\t(all three by default)\n\n");
+  printf("\t-w workload runs only that workload\n\n");
+  printf("\t-n ops sets the operations per workload (%d by default)\n\n",
+         DEFAULT_OPS);
+  printf("\t-s seed seeds the random number generator of the workloads, so\n");
+  printf("\truns from the same seed do the same operations (non-zero, 1 by\n");
+  printf("\tdefault)\n\n");
+  printf("\t-l label fills the label column, to tell runs apart\n\n");
+  printf("\t-p adds hardware performance counter averages per call\n\n");
+  printf("\t-H backs the pool with huge pages (USE_HUGE_PAGES)\n\n");
+  printf("\t-M megabytes sets the size the pool starts at (%d by default)\n\n",
+         BENCH_POOL_SIZE >> 20);
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+// Works out how long a tick is, against the clock over a few milliseconds.
+void calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ns0 = now_ns(), t0 = ticks();
+  while (now_ns() - ns0 < 20000000)
+    ;
+  ns_per_tick = (double) (now_ns() - ns0) / (ticks() - t0);
+#endif
+}
+
+// xorshift64*, far cheaper than rand() inside a timed loop
+uint64_t next_random(bench *b) {
+  b->rng ^= b->rng >> 12;
+  b->rng ^= b->rng << 25;
+  b->rng ^= b->rng >> 27;
+  return b->rng * 0x2545F4914F6CDD1DULL;
+}
+
+// Returns a random number from 0 to n - 1.
+size_t random_below(bench *b, size_t n) {
+  return (size_t) (next_random(b) % n);
+}
+
+// Leaves the calls that follow out of the results (on 0), or not (on 1).
+void set_counting(bench *b, int on) {
+  b->counting = on;
+  perfPause(!on);
+}
+
+// Starts the hardware counters for a call, if they are being read.
+int counters_begin(bench *b, perf_mark *mark) {
+  return b->counters && b->counting && perfBegin(mark);
+}
+
+void record(bench *b, int kind, uint64_t start) {
+  uint64_t elapsed = ticks() - start;
+  if (!b->counting)
+    return;
+  b->calls[kind]++;
+  if (!b->timed)
+    return;
+  op_times *t = &b->times[kind];
+  if (t->count == t->slots) {
+    t->slots = t->slots == 0 ? 65536 : 2 * t->slots;
+    t->ticks = realloc(t->ticks, t->slots * sizeof(uint64_t));
+    if (t->ticks == NULL) {
+      fprintf(stderr, "Cannot keep %lu timings.\n", (unsigned long) t->slots);
+      exit(1);
+    }
+  }
+  t->ticks[t->count++] = elapsed;
+}
+
+unsigned char *b_alloc(bench *b, size_t size) {
+  perf_mark mark;
+  int counted = counters_begin(b, &mark);
+  uint64_t start = ticks();
+  unsigned char *p = myalloc(size);
+  record(b, OP_ALLOC, start);
+  if (counted)
+    perfEnd(PERF_ALLOC, &mark);
+  if (p == NULL) {
+    fprintf(stderr, "Allocation of %lu bytes failed.\n", (unsigned long) size);
+    exit(1);
+  }
+  return p;
+}
+
+void b_free(bench *b, unsigned char *p) {
+  perf_mark mark;
+  int counted = counters_begin(b, &mark);
+  uint64_t start = ticks();
+  myfree(p);
+  record(b, OP_FREE, start);
+  if (counted)
+    perfEnd(PERF_FREE, &mark);
+}
+
+unsigned char *b_realloc(bench *b, unsigned char *p, size_t size) {
+  perf_mark mark;
+  int counted = counters_begin(b, &mark);
+  uint64_t start = ticks();
+  p = myrealloc(p, size);
+  record(b, OP_REALLOC, start);
+  if (counted)
+    perfEnd(PERF_REALLOC, &mark);
+  if (p == NULL) {
+    fprintf(stderr, "Reallocation to %lu bytes failed.\n",
+            (unsigned long) size);
+    exit(1);
+  }
+  return p;
+}
+
+void run_uniform(bench *b, long ops) {
+  unsigned char *slots[UNIFORM_SLOTS];
+  for (int i = 0; i < UNIFORM_SLOTS; i++)
+    slots[i] = b_alloc(b, UNIFORM_SIZE);
+  for (long op = 0; op < ops; op += 2) {
+    size_t i = random_below(b, UNIFORM_SLOTS);
+    b_free(b, slots[i]);
+    slots[i] = b_alloc(b, UNIFORM_SIZE);
+  }
+  for (int i = 0; i < UNIFORM_SLOTS; i++)
+    b_free(b, slots[i]);
+}
+
+void run_random(bench *b, long ops) {
+  unsigned char *live[RANDOM_SLOTS];
+  size_t sizes[RANDOM_SLOTS];
+  size_t count = 0, used = 0;
+  for (long op = 0; op < ops; op++) {
+    size_t size = 1 + random_below(b, RANDOM_MAX_LIVE / 4);
+    // free random blocks until the new one fits, as generate_sequence does
+    while (count > 0 && (used + size > RANDOM_MAX_LIVE
+                         || count == RANDOM_SLOTS)) {
+      size_t i = random_below(b, count);
+      b_free(b, live[i]);
+      used -= sizes[i];
+      count--;
+      live[i] = live[count];
+      sizes[i] = sizes[count];
+      op++;
+    }
+    live[count] = b_alloc(b, size);
+    sizes[count++] = size;
+    used += size;
+  }
+  while (count > 0)
+    b_free(b, live[--count]);
+}
+
+void run_realloc(bench *b, long ops) {
+  unsigned char *buffers[REALLOC_BUFFERS];
+  size_t sizes[REALLOC_BUFFERS];
+  for (int i = 0; i < REALLOC_BUFFERS; i++) {
+    sizes[i] = 16;
+    buffers[i] = b_alloc(b, sizes[i]);
+  }
+  for (long op = 0; op < ops; op++) {
+    size_t i = random_below(b, REALLOC_BUFFERS);
+    if (sizes[i] >= REALLOC_LIMIT) {
+      b_free(b, buffers[i]);
+      sizes[i] = 16;
+      buffers[i] = b_alloc(b, sizes[i]);
+      op++;
+    }
+    else {
+      sizes[i] += sizes[i] / 2;
+      buffers[i] = b_realloc(b, buffers[i], sizes[i]);
+    }
+  }
+  for (int i = 0; i < REALLOC_BUFFERS; i++)
+    b_free(b, buffers[i]);
+}
+
+void run_batches(bench *b, long ops, int lifo) {
+  unsigned char *blocks[BATCH_BLOCKS];
+  for (long op = 0; op < ops; op += 2 * BATCH_BLOCKS) {
+    for (int i = 0; i < BATCH_BLOCKS; i++)
+      blocks[i] = b_alloc(b, 16 + random_below(b, 1024));
+    for (int i = 0; i < BATCH_BLOCKS; i++)
+      b_free(b, blocks[lifo ? BATCH_BLOCKS - 1 - i : i]);
+  }
+}
+
+void run_lifo(bench *b, long ops) {
+  run_batches(b, ops, 1);
+}
+
+void run_fifo(bench *b, long ops) {
+  run_batches(b, ops, 0);
+}
+
+void run_fragmented(bench *b, long ops) {
+  static unsigned char *holes[FRAG_HOLES], *pins[FRAG_HOLES];
+  unsigned char *window[FRAG_WINDOW];
+
+  // small holes between pinned blocks, which no later request fits
+  set_counting(b, 0);
+  for (int i = 0; i < FRAG_HOLES; i++) {
+    holes[i] = b_alloc(b, FRAG_HOLE_SIZE);
+    pins[i] = b_alloc(b, FRAG_PIN_SIZE);
+  }
+  for (int i = 0; i < FRAG_HOLES; i++)
+    b_free(b, holes[i]);
+  set_counting(b, 1);
+
+  for (int i = 0; i < FRAG_WINDOW; i++)
+    window[i] = b_alloc(b, 300 + random_below(b, 1700));
+  for (long op = 0; op < ops; op += 2) {
+    size_t i = random_below(b, FRAG_WINDOW);
+    b_free(b, window[i]);
+    window[i] = b_alloc(b, 300 + random_below(b, 1700));
+  }
+  for (int i = 0; i < FRAG_WINDOW; i++)
+    b_free(b, window[i]);
+
+  set_counting(b, 0);
+  for (int i = 0; i < FRAG_HOLES; i++)
+    b_free(b, pins[i]);
+  set_counting(b, 1);
+}
+
+static const workload workloads[] = {
+  {"uniform", run_uniform, 1},
+  {"random", run_random, 1},
+  {"realloc", run_realloc, 1},
+  {"lifo", run_lifo, 1},
+  {"fifo", run_fifo, 1},
+  {"fragmented", run_fragmented, 20},  // a list search takes ~100 us here
+};
+
+// Runs w on a fresh default heap, returning the seconds it took.
+double run_workload(bench *b, const workload *w, long ops, uint64_t seed) {
+  MEMORY_SIZE = pool_size;
+  MEMORY_RESERVE = pool_size < BENCH_RESERVE ? BENCH_RESERVE : pool_size;
+  init_myalloc();
+  b->rng = seed;
+  if (b->counters && perfStart() == 0)
+    b->counters = 0;
+  set_counting(b, 1);
+  for (int k = 0; k < OP_KINDS; k++) {
+    b->calls[k] = 0;
+    b->times[k].count = 0;
+  }
+  uint64_t start = now_ns();
+  w->run(b, ops / w->share);
+  double seconds = (now_ns() - start) / 1e9;
+  perfStop();
+  close_myalloc();
+  return seconds;
+}
+
+int compare_ticks(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Returns the p-th quantile of the sorted times, in nanoseconds.
+double percentile(op_times *t, double p) {
+  size_t i = (size_t) (p * t->count);
+  if (i >= t->count)
+    i = t->count - 1;
+  return t->ticks[i] * ns_per_tick;
+}
+
+// Prints the average of each hardware counter over the region's calls, as
+// the last columns of a row, leaving out (but for their commas) any not read.
+void print_counters(perf_totals *totals) {
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (totals != NULL && totals->calls != 0 && totals->counted[e])
+      printf(",%.1f", (double) totals->values[e] / totals->calls);
+    else
+      printf(",");
+  }
+  printf("\n");
+}
+
+void bench_index(const char *index, const char *only, long ops,
+                 uint64_t seed, const char *label, int counters) {
+  perf_totals totals[PERF_REGIONS];
+  bench b;
+  memset(&b, 0, sizeof(b));
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    if (only != NULL && strcmp(only, workloads[w].name) != 0)
+      continue;
+
+    b.timed = 0;
+    double seconds = run_workload(&b, &workloads[w], ops, seed);
+    long calls = b.calls[OP_ALLOC] + b.calls[OP_FREE] + b.calls[OP_REALLOC];
+    b.counters = counters;
+    if (counters) {
+      run_workload(&b, &workloads[w], ops, seed);
+      for (int r = 0; r < PERF_REGIONS; r++)
+        perfTotals(r, &totals[r]);
+    }
+    int counted = b.counters;
+    b.counters = 0;
+    b.timed = 1;
+    run_workload(&b, &workloads[w], ops, seed);
+
+    for (int k = 0; k < OP_KINDS; k++) {
+      op_times *t = &b.times[k];
+      if (t->count == 0)
+        continue;
+      qsort(t->ticks, t->count, sizeof(uint64_t), compare_ticks);
+      printf("%s,%s,%d,%lu,%s,%s,%lu,%.3f,%.1f,%.1f,%.1f,%.1f", label, index,
+             USE_HUGE_PAGES, (unsigned long) (pool_size >> 20),
+             workloads[w].name, op_names[k], (unsigned long) t->count,
+             calls / seconds / 1e6, percentile(t, 0.5), percentile(t, 0.99),
+             percentile(t, 0.999), t->ticks[t->count - 1] * ns_per_tick);
+      print_counters(counted ? &totals[op_regions[k]] : NULL);
+    }
+    if (counted) {
+      printf("%s,%s,%d,%lu,%s,search,%lu,%.3f,,,,", label, index,
+             USE_HUGE_PAGES, (unsigned long) (pool_size >> 20),
+             workloads[w].name, (unsigned long) totals[PERF_SEARCH].calls,
+             calls / seconds / 1e6);
+      print_counters(&totals[PERF_SEARCH]);
+    }
+    fflush(stdout);
+  }
+  for (int k = 0; k < OP_KINDS; k++)
+    free(b.times[k].ticks);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *indexes[] = {"list", "tlsf", "tree"};
+  static const int index_values[] = {INDEX_LIST, INDEX_TLSF, INDEX_TREE};
+  const char *index = NULL, *only = NULL, *label = "";
+  long ops = DEFAULT_OPS;
+  uint64_t seed = 1;
+  int counters = 0;
+  long megabytes = BENCH_POOL_SIZE >> 20;
+  int c;
+
+  while ((c = getopt(argc, argv, "i:w:n:s:l:pHM:h")) != -1) {
+    switch (c) {
+      case 'i':
+        index = optarg;
+        break;
+      case 'w':
+        only = optarg;
+        break;
+      case 'n':
+        ops = atol(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      case 'p':
+        counters = 1;
+        break;
+      case 'H':
+        USE_HUGE_PAGES = 1;
+        break;
+      case 'M':
+        megabytes = atol(optarg);
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (ops <= 0 || seed == 0 || megabytes <= 0
+      || (size_t) megabytes > MAX_POOL_SIZE >> 20) {
+    usage(argv[0]);
+    return 1;
+  }
+  pool_size = (size_t) megabytes << 20;
+  int known = only == NULL;
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    known |= strcmp(only == NULL ? "" : only, workloads[w].name) == 0;
+  if (!known) {
+    fprintf(stderr, "Unknown workload %s.\n", only);
+    return 1;
+  }
+
+  if (counters && perfStart() == 0) {
+    perror("Hardware counters are not available, leaving their columns empty");
+    counters = 0;
+  }
+  perfStop();
+
+  calibrate();
+  printf("label,index,huge_pages,pool_mb,workload,op,count,mops_per_sec,"
+         "p50_ns,p99_ns,p999_ns,max_ns");
+  for (int e = 0; e < PERF_EVENTS; e++)
+    printf(",%s", PERF_EVENT_NAMES[e]);
+  printf("\n");
+  int ran = 0;
+  for (int i = 0; i < 3; i++) {
+    if (index != NULL && strcmp(index, indexes[i]) != 0)
+      continue;
+    FREE_INDEX = index_values[i];
+    bench_index(indexes[i], only, ops, seed, label, counters);
+    ran = 1;
+  }
+  if (!ran) {
+    fprintf(stderr, "Unknown free block index %s.\n", index);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*! \file
+ * Implementation of heap snapshots.
+ *
+ * A snapshot is taken by walking every block through its header tag, the
+ * same walk verification does (see verify.c), and writing a four byte
+ * record for each (see dump.h), so a pool of millions of blocks makes a file
+ * of a few megabytes. Records are gathered in a buffer on the stack and
+ * written out DUMP_BUFFER at a time, so taking a snapshot allocates nothing
+ * and can be done on a heap too fragmented to allocate from.
+ *
+ * The heap must not change during the walk, so with mtalloc it has to be
+ * taken with no other thread using the heap.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "myalloc.h"
+#include "slab.h"
+#include "dump.h"
+
+
+#define DUMP_BUFFER 4096 /* records written at a time */
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Writes all n bytes at buf to fd, however many writes that takes. Returns 0,
+ * or -1 if a write fails.
+ */
+static int writeAll(int fd, const void *buf, size_t n)
+{
+    const unsigned char *at = (const unsigned char *) buf;
+    while (n > 0)
+    {
+        ssize_t written = write(fd, at, n);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        at += written;
+        n -= written;
+    }
+    return 0;
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Snapshot functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Writes a snapshot of the heap's pool to fd. Returns 0, or -1 (with errno
+ * set by write) if it could not all be written.
+ */
+int myheap_dump(myheap *heap, int fd)
+{
+    dump_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+    header.version = DUMP_VERSION;
+    header.alignment = ALIGNMENT;
+    header.tagBytes = sizeof(int);
+    header.poolBytes = heap->size;
+    header.largeBytes = heap->largeBytes;
+    if (writeAll(fd, &header, sizeof(header)) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t records[DUMP_BUFFER];
+    int n = 0;
+    unsigned char *endptr = heap->mem + heap->size;
+    for (unsigned char *dataptr = heap->mem; ; )
+    {
+        if (dataptr == endptr)
+        {
+            records[n++] = DUMP_RECORD(0, DUMP_ALLOC); /* like the end tag */
+            return writeAll(fd, records, n * sizeof(records[0]));
+        }
+
+        unsigned int tag = *((unsigned int *) dataptr);
+        int kind = DUMP_FREE;
+        if (tag & TAG_INUSE)
+        {
+            kind = isSlabObject(heap, dataptr + sizeof(int)) ? DUMP_SLAB
+                                                             : DUMP_ALLOC;
+        }
+        records[n++] = DUMP_RECORD(UNITS_OF(tag), kind);
+        if (n == DUMP_BUFFER)
+        {
+            if (writeAll(fd, records, sizeof(records)) != 0)
+            {
+                return -1;
+            }
+            n = 0;
+        }
+        dataptr += SPACE_OF(tag) + sizeof(int);
+    }
+}
@@ -0,0 +1,34 @@
+/*! \file
+ * Format of heap snapshots, written by myheap_dump (see dump.c) and read by
+ * the analyzer (analyzedump.c). A snapshot is a dump_header followed by one
+ * 32-bit record per block of the pool, in address order, and a record of 0
+ * units to end it. A record holds the block's size in ALIGNMENT units above
+ * two bits saying what the block is (DUMP_FREE, DUMP_ALLOC or DUMP_SLAB);
+ * offsets are not stored, since each block starts where the one before it
+ * ends. Everything is in the byte order of the machine that wrote it.
+ *
+ * Include myalloc.h before this file.
+ */
+
+#include <stdint.h>
+
+
+#define DUMP_MAGIC "MYHD"
+#define DUMP_VERSION 1
+
+#define DUMP_FREE 0
+#define DUMP_ALLOC 1
+#define DUMP_SLAB 2
+#define DUMP_RECORD(units, kind) (((uint32_t) (units) << 2) | (kind))
+#define DUMP_UNITS(record) ((record) >> 2)
+#define DUMP_KIND(record) ((record) & 3)
+
+typedef struct dump_header
+{
+    char magic[4];        /* DUMP_MAGIC, without its terminator */
+    uint32_t version;     /* DUMP_VERSION */
+    uint32_t alignment;   /* bytes in a unit (ALIGNMENT) */
+    uint32_t tagBytes;    /* bytes in a header or footer tag */
+    uint64_t poolBytes;   /* bytes of blocks in the pool */
+    uint64_t largeBytes;  /* bytes mapped for large objects, not dumped */
+} dump_header;
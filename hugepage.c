@@ -0,0 +1,102 @@
+/*! \file
+ * Implementation of huge page backed pools.
+ *
+ * Backing: pools get transparent huge pages by madvise(MADV_HUGEPAGE) on
+ * their reservation, which the kernel honours as memory is committed and
+ * touched, and which costs nothing but the advice where huge pages are
+ * unavailable or turned off. (MAP_HUGETLB would instead need pages set
+ * aside by the administrator, and cannot be reserved first and committed
+ * later as growable pools are.) The kernel only uses a huge page for a
+ * naturally aligned HUGE_PAGE_SIZE range, so the reservation is aligned by
+ * over-reserving and unmapping the excess at either end.
+ *
+ * Reporting: how much of the pool really is on huge pages depends on the
+ * kernel's configuration and on how fragmented physical memory is, so it is
+ * read back from /proc/self/smaps, which gives the AnonHugePages of every
+ * mapping. Scavenging a page (see scavenge.c) splits the huge page around
+ * it, which the count then reflects.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "myalloc.h"
+#include "hugepage.h"
+
+
+
+/* -------------------------------------------------------------------
+ * Huge page functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Reserves the address space as described in the file comment. A failed
+ * madvise only means the pool stays on small pages.
+ */
+unsigned char *hugeReserve(size_t size)
+{
+    size_t mapSize = size + HUGE_PAGE_SIZE;
+    void *map = mmap(NULL, mapSize, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    unsigned char *start = (unsigned char *) map;
+    uintptr_t mask = HUGE_PAGE_SIZE - 1;
+    unsigned char *buf = (unsigned char *) (((uintptr_t) start + mask)
+                                                             & ~mask);
+    if (buf != start)
+    {
+        munmap(start, buf - start);
+    }
+    if (buf + size != start + mapSize)
+    {
+        munmap(buf + size, start + mapSize - (buf + size));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(buf, size, MADV_HUGEPAGE);
+#endif
+    return buf;
+}
+
+
+/*!
+ * Adds up the AnonHugePages of every mapping in /proc/self/smaps overlapping
+ * start to end. Mappings are split wherever their protection changes, so a
+ * pool whose committed part and reserved part differ is two of them, and
+ * both are counted. A pool that is only part of a mapping (one from malloc)
+ * may be credited with huge pages elsewhere in it, so the total is capped at
+ * the pool's size.
+ */
+long hugeBytes(unsigned char *start, unsigned char *end)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL)
+    {
+        return -1;
+    }
+
+    char line[256];
+    unsigned long from, to;
+    long kb;
+    long total = 0;
+    int inPool = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "%lx-%lx", &from, &to) == 2)
+        {
+            inPool = from < (uintptr_t) end && to > (uintptr_t) start;
+        }
+        else if (inPool && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+        {
+            total += kb * 1024;
+        }
+    }
+    fclose(f);
+    return total < end - start ? total : end - start;
+}
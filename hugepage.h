@@ -0,0 +1,24 @@
+/*! \file
+ * Declarations for huge page backed pools. A pool laid out over huge pages
+ * (HUGE_PAGE_SIZE bytes each) needs a fraction of the TLB entries that small
+ * pages would, which matters once a pool is hundreds of megabytes and walks
+ * over its blocks or free lists touch pages all over it.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/*
+ * Reserves size bytes (a multiple of HUGE_PAGE_SIZE) of address space aligned
+ * to HUGE_PAGE_SIZE, with no access, and asks for the memory to be backed by
+ * huge pages once it is committed. Returns NULL if the address space cannot
+ * be had; the request for huge pages may be turned down without that.
+ */
+unsigned char *hugeReserve(size_t size);
+
+
+/*
+ * Returns how many bytes of the memory from start to end the system currently
+ * backs with huge pages, or -1 if it cannot tell.
+ */
+long hugeBytes(unsigned char *start, unsigned char *end);
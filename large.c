@@ -0,0 +1,318 @@
+/*! \file
+ * Implementation of the large object path of a heap.
+ *
+ * Layout: each large object is a mapping of its own, a whole number of pages,
+ * starting with a large header and followed by the payload at
+ * LARGE_HEADER_SIZE bytes (a multiple of ALIGNMENT, so the payload is as
+ * aligned as any other). The header records the size of the mapping.
+ *
+ * Recognition: every large object's header address is kept in a hash set
+ * owned by the heap, an open addressing table of heap->largeSlots slots
+ * (a power of two) with linear probing, kept at most half full so probe
+ * runs stay short. A pointer is a large object of a heap if it lies outside
+ * the heap's pool (slab objects and blocks never do), sits exactly
+ * LARGE_HEADER_SIZE bytes past a page boundary, and its header is in the
+ * set. The set is consulted before anything at the pointer is read, since a
+ * large object already freed is no longer mapped at all, and recognising one
+ * takes expected constant time however many there are. The table is mapped
+ * straight from the system, like the page map, and doubles when it fills;
+ * removals shift the rest of their probe run back, so no tombstones build
+ * up. myheap_destroy unmaps whatever objects are left in it.
+ *
+ * Resizing uses mremap, which moves the pages themselves rather than their
+ * contents, so a large buffer grows at the cost of a system call however big
+ * it is. If the mapping moves, so does its header, and its entry with it.
+ */
+
+#define _GNU_SOURCE /* mremap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "myalloc.h"
+#include "large.h"
+
+
+typedef struct large
+{
+    size_t mapSize;      /* bytes in the mapping, header included */
+} large;
+
+#define LARGE_HEADER_SIZE ((sizeof(large) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/* slots in a heap's first table of large objects (one page of them) */
+#define LARGE_MIN_SLOTS 512
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Returns the size of a mapping with room for size bytes of payload, or 0 if
+ * there could be no such mapping.
+ */
+static size_t mapSizeFor(size_t size)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    if (size > PTRDIFF_MAX)
+    {
+        return 0;
+    }
+    return (size + LARGE_HEADER_SIZE + pageSize - 1) & ~(pageSize - 1);
+}
+
+
+/*!
+ * Returns the header of a large object.
+ */
+static large *largeOf(unsigned char *ptr)
+{
+    return (large *) (ptr - LARGE_HEADER_SIZE);
+}
+
+
+/*!
+ * Returns the slot where the search for a header starts: the top bits of a
+ * Fibonacci hash of its page number. The table must exist.
+ */
+static size_t homeSlot(myheap *heap, large *l)
+{
+    uint64_t page = (uintptr_t) l / sysconf(_SC_PAGESIZE);
+    return (page * 0x9E3779B97F4A7C15ULL)
+                  >> (64 - __builtin_ctzl(heap->largeSlots));
+}
+
+
+/*!
+ * Returns the slot holding a header, or the empty slot ending its probe run
+ * if the header is not in the set. The table must exist.
+ */
+static size_t findSlot(myheap *heap, large *l)
+{
+    size_t mask = heap->largeSlots - 1;
+    size_t i = homeSlot(heap, l);
+    while (heap->largeTable[i] != NULL && heap->largeTable[i] != l)
+    {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+
+/*!
+ * Puts a header into the set, which must have room for it.
+ */
+static void insertLarge(myheap *heap, large *l)
+{
+    heap->largeTable[findSlot(heap, l)] = l;
+    heap->largeCount++;
+}
+
+
+/*!
+ * Makes sure the set has room for one more header without going over half
+ * full, moving every entry to a table twice the size if need be. Returns 0
+ * if the system refuses the memory.
+ */
+static int reserveLarge(myheap *heap)
+{
+    if (2 * (heap->largeCount + 1) <= heap->largeSlots)
+    {
+        return 1;
+    }
+    size_t slots = heap->largeSlots == 0 ? LARGE_MIN_SLOTS
+                                         : 2 * heap->largeSlots;
+    void *map = mmap(NULL, slots * sizeof(large *), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    large **oldTable = heap->largeTable;
+    size_t oldSlots = heap->largeSlots;
+    heap->largeTable = (large **) map;
+    heap->largeSlots = slots;
+    heap->largeCount = 0;
+    for (size_t i = 0; i < oldSlots; i++)
+    {
+        if (oldTable[i] != NULL)
+        {
+            insertLarge(heap, oldTable[i]);
+        }
+    }
+    if (oldTable != NULL)
+    {
+        munmap(oldTable, oldSlots * sizeof(large *));
+    }
+    return 1;
+}
+
+
+/*!
+ * Takes a header out of the set, which must hold it, and moves later entries
+ * of its probe run back into the gap wherever that is still on their way
+ * from their home slot, so that no search stops short at it. Nothing at the
+ * header is read, so it may already be unmapped.
+ */
+static void removeLarge(myheap *heap, large *l)
+{
+    size_t mask = heap->largeSlots - 1;
+    size_t gap = findSlot(heap, l);
+    heap->largeTable[gap] = NULL;
+    heap->largeCount--;
+
+    for (size_t i = (gap + 1) & mask; heap->largeTable[i] != NULL;
+                                      i = (i + 1) & mask)
+    {
+        size_t home = homeSlot(heap, heap->largeTable[i]);
+        /* movable unless its home lies cyclically in (gap, i] */
+        if (((i - home) & mask) >= ((i - gap) & mask))
+        {
+            heap->largeTable[gap] = heap->largeTable[i];
+            heap->largeTable[i] = NULL;
+            gap = i;
+        }
+    }
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Large object functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Recognises a large object as described in the file comment. Pointers into
+ * the pool (or anywhere in a growable pool's reservation), and pointers at
+ * any other offset into their page, are turned away without a lookup.
+ */
+int isLargeObject(myheap *heap, unsigned char *ptr)
+{
+    unsigned char *poolEnd = heap->reserved != 0 ? heap->buf + heap->reserved
+                                                 : heap->mem + heap->size;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    if ((ptr >= heap->buf && ptr < poolEnd)
+        || ((uintptr_t) ptr & (pageSize - 1)) != LARGE_HEADER_SIZE)
+    {
+        return 0;
+    }
+    return heap->largeCount != 0
+           && heap->largeTable[findSlot(heap, largeOf(ptr))] != NULL;
+}
+
+
+/*!
+ * Maps a new large object. Returns NULL if the system refuses, so the caller
+ * can fall back to the pool.
+ */
+unsigned char *largeAlloc(myheap *heap, size_t size)
+{
+    size_t mapSize = mapSizeFor(size);
+    if (mapSize == 0 || !reserveLarge(heap))
+    {
+        return NULL;
+    }
+    void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    large *l = (large *) map;
+    l->mapSize = mapSize;
+    insertLarge(heap, l);
+    heap->largeBytes += mapSize;
+    return (unsigned char *) l + LARGE_HEADER_SIZE;
+}
+
+
+/*!
+ * Unmaps a large object, which must be one (see isLargeObject).
+ */
+void largeFree(myheap *heap, unsigned char *oldptr)
+{
+    large *l = largeOf(oldptr);
+    removeLarge(heap, l);
+    heap->largeBytes -= l->mapSize;
+    munmap(l, l->mapSize);
+}
+
+
+/*!
+ * Resizes a large object with mremap. The object stays large whatever its
+ * new size, just as a block stays in the pool.
+ */
+unsigned char *largeRealloc(myheap *heap, unsigned char *oldptr,
+                                                  size_t size)
+{
+    large *l = largeOf(oldptr);
+    size_t oldMapSize = l->mapSize;
+    size_t newMapSize = mapSizeFor(size);
+    if (newMapSize == oldMapSize)
+    {
+        return oldptr;
+    }
+
+    void *map = newMapSize == 0 ? MAP_FAILED
+                                : mremap(l, oldMapSize, newMapSize,
+                                                        MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+    {
+        if (!heap->quiet)
+        {
+            fprintf(stderr, "myrealloc: cannot remap %p to %zu bytes\n",
+                                                     (void *) oldptr, size);
+        }
+        return NULL;
+    }
+
+    /* the header may have moved with the pages, and its entry has to follow */
+    removeLarge(heap, l);
+    l = (large *) map;
+    l->mapSize = newMapSize;
+    insertLarge(heap, l);
+    heap->largeBytes += newMapSize - oldMapSize;
+    return (unsigned char *) l + LARGE_HEADER_SIZE;
+}
+
+
+/*!
+ * Returns the number of payload bytes in the mapping of a large object.
+ */
+size_t largeObjectSize(unsigned char *ptr)
+{
+    return largeOf(ptr)->mapSize - LARGE_HEADER_SIZE;
+}
+
+
+/*!
+ * Unmaps whatever large objects the heap still has, and the set itself.
+ */
+void largeFini(myheap *heap)
+{
+    for (size_t i = 0; i < heap->largeSlots; i++)
+    {
+        large *l = heap->largeTable[i];
+        if (l != NULL)
+        {
+            heap->largeBytes -= l->mapSize;
+            munmap(l, l->mapSize);
+        }
+    }
+    if (heap->largeTable != NULL)
+    {
+        munmap(heap->largeTable, heap->largeSlots * sizeof(large *));
+    }
+    heap->largeTable = NULL;
+    heap->largeSlots = 0;
+    heap->largeCount = 0;
+}
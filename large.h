@@ -0,0 +1,40 @@
+/*! \file
+ * Declarations for the large object path of a heap. Requests of at least the
+ * heap's largeThreshold bytes bypass the memory pool and get a mapping of
+ * their own straight from the system, with a small header in front of the
+ * payload so that frees and reallocs recognise them. Freeing one unmaps it,
+ * and reallocating one remaps it, so its pages are never copied.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/*
+ * Returns nonzero if ptr is a large object of the heap, without reading
+ * anything at ptr unless it is.
+ */
+int isLargeObject(myheap *heap, unsigned char *ptr);
+
+
+/* Maps a large object with room for size bytes, NULL if the system refuses. */
+unsigned char *largeAlloc(myheap *heap, size_t size);
+
+
+/* Unmaps a large object. */
+void largeFree(myheap *heap, unsigned char *oldptr);
+
+
+/*
+ * Resizes a large object, moving it if need be, and returns its new address
+ * (NULL, leaving it untouched, if the system refuses).
+ */
+unsigned char *largeRealloc(myheap *heap, unsigned char *oldptr,
+                                                  size_t size);
+
+
+/* Returns the usable size of a large object. */
+size_t largeObjectSize(unsigned char *ptr);
+
+
+/* Unmaps every large object still belonging to the heap. */
+void largeFini(myheap *heap);
@@ -0,0 +1,517 @@
+/*! \file
+ * Implementation of the thread-safe front end of the allocator.
+ *
+ * Arenas: all arenas are carved from one region of numArenas * arenaSize
+ * bytes, arena i managing the slice starting at i * arenaSize. Each arena
+ * is a complete heap (free index included) guarded by its own mutex, so
+ * operations on different arenas never touch shared state. Because the
+ * slices are laid out back to back, the arena owning any pointer is found
+ * with a subtraction and a division, with no lookup structure to lock. Large
+ * objects (see large.c) lie outside the region, so they are looked up in
+ * each arena's heap in turn, under its lock, and are always freed under the
+ * lock too, bypassing the thread caches and the remote free stacks.
+ *
+ * Thread assignment: the first time a thread allocates, it is given the next
+ * arena round-robin, and remembers it in a thread-local variable. When it
+ * then finds its arena's lock held by another thread, it tries the other
+ * arenas' locks without blocking, and moves to the first one that is free, so
+ * threads drift apart under contention. Only if every arena is busy does it
+ * wait for its own.
+ *
+ * Frees always go back to the arena the block came from, whichever thread
+ * makes them. A thread freeing into its own arena takes the arena's lock as
+ * usual. Any other thread (a "remote" free) never touches the lock: it pushes
+ * the block onto the arena's remoteFrees stack with a compare-and-swap,
+ * reusing the block's payload for the link. Whichever thread next locks the
+ * arena takes the whole stack with one atomic exchange and frees every block
+ * on it normally, coalescing included. Since pushes only ever add and the
+ * stack is only ever taken whole, there is no ABA problem.
+ *
+ * Thread caches: in front of the arenas, every thread keeps a small stack
+ * (a "magazine") of free blocks for each of MAG_CLASSES size classes, class c
+ * holding blocks with at least (c + 1) * MAG_CLASS_SIZE bytes of space.
+ * Small requests are rounded up to their class size and popped straight off
+ * the magazine, and small frees are pushed onto it, without locking anything
+ * or touching any heap. The blocks in a magazine stay allocated as far as
+ * their heap is concerned. An empty magazine is refilled with half a
+ * magazine of blocks under a single lock, a full one has its older half
+ * flushed back to the arenas, and a thread's magazines are all flushed when
+ * it exits. Remote frees skip the cache, so blocks go home to their arena
+ * rather than piling up in the thread that frees them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "myalloc.h"
+#include "mtalloc.h"
+#include "large.h"
+
+
+/*
+ * An arena is a heap, the lock guarding it, and the stack of blocks other
+ * threads have freed into it without the lock. Arenas are aligned to cache
+ * lines so that locking one never invalidates another's line.
+ */
+typedef struct arena
+{
+    _Alignas(64) pthread_mutex_t lock;
+    _Atomic(unsigned char *) remoteFrees; /* linked through the payloads */
+    myheap heap;
+} arena;
+
+
+static arena *arenas;          /* all the arenas */
+static int numArenas;
+static size_t arenaSize;       /* bytes in each arena's memory pool */
+static unsigned char *region;  /* start of the memory all pools are cut from */
+static atomic_int nextArena;   /* round-robin counter for new threads */
+
+static __thread int threadArena = -1; /* this thread's arena, -1 if none yet */
+
+
+/*
+ * Size classes of the thread caches. Blocks with more space than
+ * MAG_MAX_SPACE are too big to have come from a class request (allowing for
+ * the remainder too small to split off), so they are never cached.
+ */
+#define MAG_CLASS_SIZE 16
+#define MAG_CLASSES 16
+#define MAG_MAX_SIZE (MAG_CLASS_SIZE * MAG_CLASSES)
+#define MAG_MAX_SPACE (MAG_MAX_SIZE + (int) (sizeof(node) + sizeof(int)))
+#define MAG_CAPACITY 32
+
+typedef struct magazine
+{
+    int count;                           /* blocks in the magazine */
+    unsigned char *blocks[MAG_CAPACITY]; /* oldest at the bottom */
+} magazine;
+
+typedef struct tcache
+{
+    int generation; /* the arenas this cache holds blocks from */
+    magazine mags[MAG_CLASSES];
+} tcache;
+
+static __thread tcache cache;   /* this thread's cache */
+static pthread_key_t cacheKey;  /* runs flushCache when a thread exits */
+static int cacheKeyMade;
+static int generation;          /* bumped every init_mtalloc */
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Returns the index of the arena whose memory pool contains ptr, or that ptr
+ * is a large object of, or -1 if ptr is not in any arena, and sets *large to
+ * whether it is a large object. A pointer outside every pool is looked up
+ * among each arena's large objects in turn, starting with the calling
+ * thread's own arena, under that arena's lock; the caller must not hold any.
+ * Each lookup takes constant time (see large.c), so this is bounded by the
+ * number of arenas, not of large objects. Nothing about a large object may be read without
+ * its arena's lock afterwards either, since the arena's owner may be
+ * changing the heap's large objects at any time.
+ */
+static int ownerOf(unsigned char *ptr, int *large)
+{
+    *large = 0;
+    if (ptr < region || ptr >= region + numArenas * arenaSize)
+    {
+        /* most large objects are freed by the thread that allocated them */
+        int first = threadArena >= 0 && threadArena < numArenas ? threadArena
+                                                                 : 0;
+        for (int i = 0; i < numArenas; i++)
+        {
+            int a = (first + i) % numArenas;
+            pthread_mutex_lock(&arenas[a].lock);
+            int found = isLargeObject(&arenas[a].heap, ptr);
+            pthread_mutex_unlock(&arenas[a].lock);
+            if (found)
+            {
+                *large = 1;
+                return a;
+            }
+        }
+        return -1;
+    }
+    return (ptr - region) / arenaSize;
+}
+
+
+/*!
+ * Pushes a block onto its owning arena's remote free stack. Lock-free.
+ */
+static void pushRemote(int owner, unsigned char *block)
+{
+    unsigned char *head = atomic_load_explicit(&arenas[owner].remoteFrees,
+                                               memory_order_relaxed);
+    do
+    {
+        *(unsigned char **) block = head;
+    } while (!atomic_compare_exchange_weak_explicit(&arenas[owner].remoteFrees,
+                     &head, block, memory_order_release, memory_order_relaxed));
+}
+
+
+/*!
+ * Frees every block on an arena's remote free stack into its heap. The caller
+ * must hold the arena's lock.
+ */
+static void drainRemote(int a)
+{
+    if (atomic_load_explicit(&arenas[a].remoteFrees, memory_order_relaxed)
+                                                                      == NULL)
+    {
+        return;
+    }
+    unsigned char *block = atomic_exchange_explicit(&arenas[a].remoteFrees,
+                                                    NULL, memory_order_acquire);
+    while (block != NULL)
+    {
+        unsigned char *next = *(unsigned char **) block;
+        myheap_free(&arenas[a].heap, block);
+        block = next;
+    }
+}
+
+
+/*!
+ * Locks the given arena, and catches up on its remote frees.
+ */
+static void lockArenaIndex(int a)
+{
+    pthread_mutex_lock(&arenas[a].lock);
+    drainRemote(a);
+}
+
+
+/*!
+ * Returns the thread cache of the calling thread, emptying it first if it
+ * holds blocks from arenas that have since been closed.
+ */
+static tcache *myCache()
+{
+    if (cache.generation != generation)
+    {
+        for (int c = 0; c < MAG_CLASSES; c++)
+        {
+            cache.mags[c].count = 0;
+        }
+        cache.generation = generation;
+        pthread_setspecific(cacheKey, &cache);
+    }
+    return &cache;
+}
+
+
+/*!
+ * Returns the size class whose magazine a freed block of the given space can
+ * go into, or -1 if it is too big to be cached (or, being a minimum block,
+ * too small for any class).
+ */
+static int classOfSpace(size_t space)
+{
+    if (space > MAG_MAX_SPACE)
+    {
+        return -1;
+    }
+    int c = (int) (space / MAG_CLASS_SIZE) - 1;
+    return c < MAG_CLASSES ? c : MAG_CLASSES - 1;
+}
+
+
+/*!
+ * Frees the n oldest blocks of a magazine back to their arenas, all of the
+ * thread's own under a single lock, and any others (from an arena the thread
+ * has since moved away from) as remote frees.
+ */
+static void flushMagazine(magazine *mag, int n)
+{
+    int locked = 0;
+    int large;
+    for (int i = 0; i < n; i++)
+    {
+        int owner = ownerOf(mag->blocks[i], &large);
+        if (owner != threadArena)
+        {
+            pushRemote(owner, mag->blocks[i]);
+            continue;
+        }
+        if (!locked)
+        {
+            lockArenaIndex(owner);
+            locked = 1;
+        }
+        myheap_free(&arenas[owner].heap, mag->blocks[i]);
+    }
+    if (locked)
+    {
+        pthread_mutex_unlock(&arenas[threadArena].lock);
+    }
+
+    mag->count -= n;
+    memmove(mag->blocks, mag->blocks + n, mag->count * sizeof(mag->blocks[0]));
+}
+
+
+/*!
+ * Thread exit hook: returns every cached block to the arenas, unless they
+ * have been closed in the meantime.
+ */
+static void flushCache(void *arg)
+{
+    tcache *exiting = (tcache *) arg;
+    if (exiting->generation != generation)
+    {
+        return;
+    }
+    for (int c = 0; c < MAG_CLASSES; c++)
+    {
+        flushMagazine(&exiting->mags[c], exiting->mags[c].count);
+    }
+}
+
+
+/*!
+ * Locks an arena for the calling thread and returns its index, choosing
+ * (and if need be changing) the thread's arena as described in the file
+ * comment.
+ */
+static int lockArena()
+{
+    if (threadArena < 0 || threadArena >= numArenas)
+    {
+        threadArena = atomic_fetch_add(&nextArena, 1) % numArenas;
+    }
+    if (pthread_mutex_trylock(&arenas[threadArena].lock) == 0)
+    {
+        drainRemote(threadArena);
+        return threadArena;
+    }
+
+    /* contended, so look for an arena nobody is using */
+    for (int i = 1; i < numArenas; i++)
+    {
+        int candidate = (threadArena + i) % numArenas;
+        if (pthread_mutex_trylock(&arenas[candidate].lock) == 0)
+        {
+            drainRemote(candidate);
+            threadArena = candidate;
+            return candidate;
+        }
+    }
+    lockArenaIndex(threadArena);
+    return threadArena;
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Allocator functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Sets up the arenas. Must be called before any other thread-safe allocator
+ * function, and before any threads use them.
+ */
+void init_mtalloc(int nArenas, size_t size)
+{
+    if (nArenas <= 0)
+    {
+        nArenas = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nArenas <= 0)
+        {
+            nArenas = 1;
+        }
+    }
+    numArenas = nArenas;
+    arenaSize = size;
+    atomic_store(&nextArena, 0);
+    generation++;
+    if (!cacheKeyMade)
+    {
+        pthread_key_create(&cacheKey, flushCache);
+        cacheKeyMade = 1;
+    }
+
+    arenas = (arena *) aligned_alloc(64, numArenas * sizeof(arena));
+    region = (unsigned char *) malloc(numArenas * arenaSize);
+    if (arenas == NULL || region == NULL)
+    {
+        fprintf(stderr, "init_mtalloc: could not get %d arenas of %zu bytes"
+                        " from the system\n", numArenas, arenaSize);
+        abort();
+    }
+    for (int i = 0; i < numArenas; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        atomic_init(&arenas[i].remoteFrees, NULL);
+        myheap_init(&arenas[i].heap, region + i * arenaSize, arenaSize);
+    }
+}
+
+
+/*!
+ * Allocates from the calling thread's arena. If that arena cannot service
+ * the request, the others are tried in turn before giving up and returning
+ * NULL.
+ *
+ * Small requests are served from the thread cache, refilling its magazine
+ * from the thread's arena when it is empty.
+ */
+unsigned char *mtalloc(size_t size)
+{
+    if (size <= MAG_MAX_SIZE)
+    {
+        int c = size == 0 ? 0 : (size - 1) / MAG_CLASS_SIZE;
+        magazine *mag = &myCache()->mags[c];
+        if (mag->count == 0)
+        {
+            int mine = lockArena();
+            while (mag->count < MAG_CAPACITY / 2)
+            {
+                unsigned char *block = myheap_alloc(&arenas[mine].heap,
+                                                    (c + 1) * MAG_CLASS_SIZE);
+                if (block == NULL)
+                {
+                    break;
+                }
+                mag->blocks[mag->count++] = block;
+            }
+            pthread_mutex_unlock(&arenas[mine].lock);
+        }
+        if (mag->count > 0)
+        {
+            return mag->blocks[--mag->count];
+        }
+        size = (c + 1) * MAG_CLASS_SIZE; /* arena is full, try the others */
+    }
+
+    int mine = lockArena();
+    unsigned char *resultptr = myheap_alloc(&arenas[mine].heap, size);
+    pthread_mutex_unlock(&arenas[mine].lock);
+
+    for (int i = 1; resultptr == NULL && i < numArenas; i++)
+    {
+        int other = (mine + i) % numArenas;
+        lockArenaIndex(other);
+        resultptr = myheap_alloc(&arenas[other].heap, size);
+        pthread_mutex_unlock(&arenas[other].lock);
+    }
+    return resultptr;
+}
+
+
+/*!
+ * Frees a block back into the arena it was allocated from, as a lock-free
+ * remote free if that is not the calling thread's arena. Small blocks of the
+ * thread's own arena go into the thread cache instead, flushing the older
+ * half of their magazine if it is full. Only the block's own header tag is
+ * checked before caching it, so a double free of a block that is still in
+ * some cache goes unnoticed. Large objects are always unmapped straight
+ * away, under their arena's lock, whichever thread frees them.
+ */
+void mtfree(unsigned char *oldptr)
+{
+    int large;
+    int owner = ownerOf(oldptr, &large);
+    if (owner < 0 || (!large && isValid(&arenas[owner].heap, oldptr) == 0))
+    {
+        fprintf(stderr, "Cannot free invalid address %p\n", (void *) oldptr);
+        abort();
+    }
+
+    if (large)
+    {
+        /* checked again under the lock, in case it was freed meanwhile */
+        lockArenaIndex(owner);
+        myheap_free(&arenas[owner].heap, oldptr);
+        pthread_mutex_unlock(&arenas[owner].lock);
+        return;
+    }
+
+    if (owner != threadArena)
+    {
+        pushRemote(owner, oldptr);
+        return;
+    }
+
+    int c = classOfSpace(payloadSize(&arenas[owner].heap, oldptr));
+    if (c >= 0)
+    {
+        magazine *mag = &myCache()->mags[c];
+        if (mag->count == MAG_CAPACITY)
+        {
+            flushMagazine(mag, MAG_CAPACITY / 2);
+        }
+        mag->blocks[mag->count++] = oldptr;
+        return;
+    }
+
+    lockArenaIndex(owner);
+    myheap_free(&arenas[owner].heap, oldptr);
+    pthread_mutex_unlock(&arenas[owner].lock);
+}
+
+
+/*!
+ * Reallocates within the block's own arena when possible. Otherwise the data
+ * moves to a block from any arena, and if there is none, NULL is returned
+ * and the old block is left untouched, just as with myrealloc.
+ */
+unsigned char *mtrealloc(unsigned char *oldptr, size_t size)
+{
+    int large;
+    int owner = ownerOf(oldptr, &large);
+    if (owner < 0)
+    {
+        fprintf(stderr, "Cannot realloc invalid address %p\n", (void *) oldptr);
+        abort();
+    }
+    lockArenaIndex(owner);
+    size_t oldSpace = payloadSize(&arenas[owner].heap, oldptr);
+    unsigned char *newptr = myheap_realloc(&arenas[owner].heap, oldptr, size);
+    pthread_mutex_unlock(&arenas[owner].lock);
+    if (newptr != NULL)
+    {
+        return newptr;
+    }
+
+    newptr = mtalloc(size);
+    if (newptr != NULL)
+    {
+        memcpy(newptr, oldptr, oldSpace < size ? oldSpace : size);
+        mtfree(oldptr);
+    }
+    return newptr;
+}
+
+
+/*!
+ * Cleans up all arenas and the memory they managed. Blocks still sitting in
+ * thread caches are simply forgotten.
+ */
+void close_mtalloc()
+{
+    for (int i = 0; i < numArenas; i++)
+    {
+        pthread_mutex_destroy(&arenas[i].lock);
+        myheap_destroy(&arenas[i].heap);
+    }
+    free(arenas);
+    free(region);
+    arenas = NULL;
+    region = NULL;
+    numArenas = 0;
+}
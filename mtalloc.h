@@ -0,0 +1,31 @@
+/*! \file
+ * Declarations for the thread-safe front end of the allocator. It manages a
+ * number of arenas, each one a heap (see myalloc.h) over its own region of
+ * memory with its own lock, and spreads threads across them so they rarely
+ * contend for the same lock.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/*
+ * Sets up nArenas arenas of arenaSize bytes each (one per online CPU if
+ * nArenas is 0 or less). Aborts if the memory cannot be had.
+ */
+void init_mtalloc(int nArenas, size_t arenaSize);
+
+
+/* Thread-safe myalloc, allocating from the calling thread's arena. */
+unsigned char *mtalloc(size_t size);
+
+
+/* Thread-safe myfree, freeing into whichever arena oldptr came from. */
+void mtfree(unsigned char *oldptr);
+
+
+/* Thread-safe myrealloc, moving to another arena if its own is too full. */
+unsigned char *mtrealloc(unsigned char *oldptr, size_t size);
+
+
+/* Cleans up all arenas. No thread may be using them any more. */
+void close_mtalloc();
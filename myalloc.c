@@ -17,56 +17,139 @@
  * used variables 
  * ------------------------------------------------------------ 
  * Memory block representation:
- *      Free blocks: The metadata for free blocks includes a node struct
- *      (see myalloc.h), which is the "header", as well as a simple int
- *      which is the "footer". The "header" node struct has 3 fields,
- *      which are:
- *          a) space: a positive integer that is the amount of usable bytes
- *              in the block (the payload size), and is also the distance from
- *              the int tag in the header to the footer. *NOTE* -- this
- *              is not the distance from the end of the header struct to
- *              the footer, it is actually the distance from the int tag
- *              in the header (offset of 4 bytes from header start) to footer.
- *          b) prev: This is a pointer to another header struct (a node *).
- *              The allocator has an explicit free list, implemented as a 
- *              doubly linked list. This field links each free block to the
- *              previous free block. Note that the first block in the free list
- *              would have NULL for this field
- *          c) next: Again, pointer to another header to implement the free
- *              list. Note that the last block in the free list would have NULL.
- *      The "footer", which is just an int, has the same value as the space 
- *      field of the header struct. Thus, there is an int tag on both ends
- *      of free blocks giving the amount of bytes between the two int tags.
- * 
- *      Allocated blocks: The metadata for allocated blocks is more limited
- *      -- there is just an int tag on both end, no header struct. This tag
- *      is very similar to the tags in free blocks, except it is negative
- *      , to denote the memory is in use. Thus, it is the negation of the space
- *      field in the header for the freed version of the same block.      
+ *      Headers: every block starts with an unsigned int header tag holding
+ *      the block's total size (header included) in units of ALIGNMENT bytes,
+ *      shifted left past two flag bits (see myalloc.h):
+ *          a) TAG_INUSE: set while the block is allocated.
+ *          b) TAG_PREV_INUSE: set while the block just before it is
+ *              allocated, and in the first block. As in dlmalloc, this is
+ *              what lets allocated blocks do without a footer: a footer is
+ *              only ever read by the block after it, to coalesce backward,
+ *              and that block's own header says whether there is one.
+ *      The amount of usable bytes in the block (the payload size, or
+ *      "space") is SPACE_OF(tag), the block's size less its header, and the
+ *      payload starts right after the header.
+ *
+ *      Free blocks: the header tag is the first field of a node struct (see
+ *      myalloc.h), and the block ends with an int "footer" holding the same
+ *      size, with no flags. The node struct's other fields are:
+ *          a) prev: The allocator has an explicit free list, implemented as
+ *              a doubly linked list. This field links each free block to the
+ *              previous free block. Rather than a pointer, it is a 32 bit
+ *              offset from heap->mem in ALIGNMENT units, plus one so that 0
+ *              can stand for NULL: NODE_AT turns it into a node *, and
+ *              LINK_TO makes one from a node *. The first block in the free
+ *              list has 0 for this field.
+ *          b) next: Again, a link to another header to implement the free
+ *              list. Note that the last block in the free list has 0.
+ *      (The struct also has a level field, which only the tree index uses.)
+ *      With 32 bit links the node struct is 16 bytes, one ALIGNMENT unit,
+ *      which is the minimum block; in a minimum block, level is the footer.
+ *
+ *      Allocated blocks: just the header tag, with TAG_INUSE set. The payload
+ *      runs to the end of the block, over what is the footer while the block
+ *      is free, so the header is all the overhead an allocation has.
+ *
+ *      End tag: one more header tag sits right after the last block, with
+ *      TAG_INUSE set and a size of 0. It carries the last block's
+ *      TAG_PREV_INUSE, so every block has a next header to keep up to date,
+ *      and since it never looks free, forward coalescing stops there.
+ *      heap->size covers the blocks but not the end tag.
+ *
+ *      Sizes: counting tags in ALIGNMENT units rather than bytes lets the
+ *      30 bits of size in a tag describe blocks of up to MAX_BLOCK_SIZE
+ *      bytes, some 16 GB, where byte counts would stop at 1 GB. A pool can
+ *      be larger than any block: it is laid out as a run of blocks of at
+ *      most that size (see addFreeRun), and two free neighbours only
+ *      coalesce while the result still fits in a tag. What caps a pool is
+ *      the links, which count 32 bits of units from heap->mem, to
+ *      MAX_POOL_SIZE bytes, some 64 GB. Sizes are size_t everywhere else
+ *      (requests larger than any block can still be large objects).
  *  
+ *      Alignment: payloads are ALIGNMENT-aligned (16 bytes). Rather than pad
+ *      each block, the pool is laid out so this always holds: the first
+ *      block starts sizeof(int) bytes before an aligned address, and every
+ *      block's total size (space plus its header) is a multiple of
+ *      ALIGNMENT, so every block starts sizeof(int) bytes before an aligned
+ *      address too. Requests are rounded up accordingly (see roundSpace),
+ *      and any block split off another keeps the property. heap->mem is
+ *      thus the first block, which may be a few bytes into the heap's buffer,
+ *      and heap->size covers whole blocks only. It also means that blocks
+ *      are whole ALIGNMENT units from heap->mem, which the links count in.
+ *
+ *      Free index: free blocks are found through one of two structures,
+ *      selected by FREE_INDEX when the heap is set up:
+ *          a) INDEX_LIST: the single explicit free list described above,
+ *              searched with best-fit.
+ *          b) INDEX_TLSF: two-level segregated-fit bins (see tlsf.c), each
+ *              bin being a free list of blocks of similar size, located with
+ *              bitmaps. The prev/next fields then link blocks within a bin.
+ *          c) INDEX_TREE: a balanced tree ordered by space and address (see
+ *              sizetree.c), searched with best-fit in logarithmic time. The
+ *              prev/next fields are then the left/right children.
+ *      Either way, the index is keyed on the size in the tag field, so a
+ *      block's size is never changed while it is in the index: it is removed
+ *      first, resized, and added back. (Its TAG_PREV_INUSE may change.)
+ *
+ * Heaps: all of the state above lives in a myheap struct (see myalloc.h):
+ *      the pool itself (mem and size) and the free index built over it.
+ *      Every allocator operation works against one heap, so any number of
+ *      independent pools can coexist. init_myalloc(), myalloc(), myfree(),
+ *      myrealloc() and close_myalloc() work against a default heap that
+ *      init_myalloc() sets up with MEMORY_SIZE bytes.
+ *
+ * Slabs: in pools of at least SLAB_MIN_PAGES pages, requests of up to
+ *      SLAB_MAX_SIZE bytes are served from page-sized slabs (see slab.c)
+ *      instead of getting blocks of their own, saving the header tags and
+ *      the rounding to whole ALIGNMENT units. Each slab is itself just an
+ *      allocated block covering one aligned page. myheap_free and
+ *      myheap_realloc tell slab objects apart from blocks by the page they
+ *      are in.
+ *
+ * Scavenging: in the same pools, whole pages inside free blocks that have
+ *      stayed free for a while are given back to the system (see
+ *      scavenge.c), leaving the blocks' node headers and footers in place. The
+ *      page map records which pages are given back, and useBlock clears that
+ *      as blocks are allocated over them.
+ *
+ * Huge pages: with USE_HUGE_PAGES, pools the allocator gets from the system
+ *      are reserved HUGE_PAGE_SIZE aligned (see hugepage.c), and committed
+ *      (and grown) in whole huge pages, so the system can back them with
+ *      huge pages and walks over a large pool need far fewer TLB entries.
+ *      Even a fixed pool is then reserved like a growable one, just with
+ *      nothing more to grow into.
+ *
+ * Large objects: requests of at least heap->largeThreshold bytes do not come
+ *      from the pool at all, but get a mapping of their own (see large.c),
+ *      which myheap_free unmaps and myheap_realloc resizes with mremap. If
+ *      the system refuses one, the request falls back to the pool.
+ *
  * Commonly used variables:
- *      freeList -- a global node * (static memory) that points to the header
- *          for the first free block in the explicit free list.
+ *      heap -- a myheap * for the heap being operated on.
+ *      heap->freeList -- a node * that points to the header for the first
+ *          free block in the explicit free list.
  *      dataptr -- an unsigned char * that is always used to be the exact 
  *          address of the start of a block
  *      headptr -- a node * that has the same value as dataptr, 
  *          (meaning it points to the start of a block), but can be used to
  *          do linked list operations/look at fields of the header for a free
  *          block.
- *      footptr -- an int * that points to the footer of a block (the int tag)
- *      space -- an int that is always the size of the payload of a block.
- *          In other words, it is the value saved in headptr->space, as well
- *          as footptr, for a free block, and it is the negation of the value
- *          in (int *) dataptr, as well as footptr, for an allocated block. 
- *          Thus, to find a footer address from a dataptr, one can say
- *          dataptr + sizeof(int) + space, and to find the next block's address
- *          (a new dataptr), one can say dataptr + space + 2 * sizeof(int)
+ *      footptr -- an unsigned int * that points to the footer of a free block
+ *      space -- a size_t that is always the size of the payload of a block.
+ *          In other words, it is SPACE_OF the value saved in headptr->tag,
+ *          whether the block is free or allocated. Thus, to find a free
+ *          block's footer address from a dataptr, one can say
+ *          dataptr + space, and to find the next block's address (a new
+ *          dataptr), one can say dataptr + space + sizeof(int)
  *
  * Implementation features:
- *      -- explicit free list
+ *      -- explicit free list, or TLSF bins for constant time allocation, or a
+ *         size-ordered tree for logarithmic time best fit
  *      -- constant time deallocation
- *      -- best fit instead of next-fit or first-fit
+ *      -- header-less slabs for tiny objects
+ *      -- best fit instead of next-fit or first-fit (TLSF uses good fit)
  *      -- realloc function, fun stuff XD, made it on a whim.
+ *         It resizes blocks in place when their neighbours allow.
  *
  * Things minimizing fragmentation:
  *      -- best fit ensures that smallest block that can accomodate a request
@@ -82,20 +165,59 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "myalloc.h"
+#include "tlsf.h"
+#include "sizetree.h"
+#include "slab.h"
+#include "verify.h"
+#include "perfcount.h"
+#include "scavenge.h"
+#include "large.h"
+#include "hugepage.h"
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y)) /* used in myalloc */
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define GROW_SIZE (1024 * 1024) /* least a growable heap grows by at once */
 
 /*!
- * These variables are used to specify the size and address of the memory pool
- * that the simple allocator works against.  The memory pool is allocated within
- * init_myalloc(), and then myalloc() and free() work against this pool of
- * memory that mem points to.
+ * These variables are used to specify the size of the memory pool and the
+ * free index for the default heap. The memory pool is allocated within
+ * init_myalloc() (growing up to MEMORY_RESERVE bytes, if that is larger),
+ * and then myalloc() and myfree() work against the default heap built on it.
+ * FREE_INDEX, USE_SLABS, USE_HUGE_PAGES, LARGE_THRESHOLD, VERIFY_LEVEL and
+ * QUIET_FAILURES are also read when other heaps are set up.
  */
-int MEMORY_SIZE;
-unsigned char *mem;
-node *freeList; /* Pointer to start of explicit free list */
+size_t MEMORY_SIZE;
+size_t MEMORY_RESERVE = 0;
+int USE_HUGE_PAGES = 0;
+int FREE_INDEX = INDEX_TLSF;
+int USE_SLABS = 1;
+size_t LARGE_THRESHOLD = 1024 * 1024;
+int VERIFY_LEVEL = VERIFY_FAST;
+int QUIET_FAILURES = 0;
+static myheap defaultHeap;
+
+static unsigned char *useBlock(myheap *heap, node *headptr, size_t size);
+static size_t roundSpace(size_t size);
+static void setFree(unsigned char *dataptr, size_t space);
+static void setUsed(unsigned char *dataptr, size_t space);
+static void setPrevInUse(unsigned char *dataptr, int inUse);
+static unsigned int loadTag(unsigned char *dataptr);
+static void coalesceForward(myheap *heap, node *headptr);
+static node *addFreeRun(myheap *heap, unsigned char *dataptr, size_t space);
+static node *freeBlock(myheap *heap, unsigned char *dataptr, size_t space,
+                                                     int blocks);
+static void countRealloc(myheap *heap, unsigned char *oldptr,
+                                       unsigned char *newptr);
+static node *findBlock(myheap *heap, size_t size);
+static int growHeap(myheap *heap, size_t size);
+static void initHeap(myheap *heap, unsigned char *buf, size_t size,
+                                                       size_t reserved);
+static unsigned char *nextAligned(unsigned char *ptr, size_t alignment);
 
 
 
@@ -109,94 +231,385 @@ node *freeList; /* Pointer to start of explicit free list */
 
 
 /*!
- * This function initializes both the allocator state, and the memory pool.  It
- * must be called before myalloc() or myfree() will work at all.
+ * This function initializes a heap to manage the size bytes at buf, which the
+ * caller provides (along with the heap struct itself) and keeps ownership of.
+ * size must be at least sizeof(node) + sizeof(int) + 2 * ALIGNMENT, since up
+ * to ALIGNMENT bytes at either end may be given up to align the blocks, and
+ * the end tag takes an int. Only the first MAX_POOL_SIZE bytes of a larger
+ * buffer are used.
+ * myheap_destroy() should be called when the heap is no longer needed, to
+ * release its slab metadata.
+ */
+void myheap_init(myheap *heap, unsigned char *buf, size_t size)
+{
+    initHeap(heap, buf, size, 0);
+}
+
+
+/*!
+ * Sets up a heap over the size bytes at buf, which are the start of reserved
+ * bytes of address space the heap may grow into (0 for a fixed pool).
+ */
+static void initHeap(myheap *heap, unsigned char *buf, size_t size,
+                                                       size_t reserved)
+{
+    unsigned char *first = nextAligned(buf + sizeof(int), ALIGNMENT)
+                                                          - sizeof(int);
+    heap->buf = buf;
+    heap->mem = first;
+    heap->size = MIN((size - (first - buf) - sizeof(int))
+                                & ~(size_t) (ALIGNMENT - 1), MAX_POOL_SIZE);
+    heap->reserved = reserved;
+    heap->committed = size;
+    heap->owned = 0;
+    heap->hugePages = 0;
+    heap->freeIndex = FREE_INDEX;
+    heap->largeThreshold = LARGE_THRESHOLD;
+    heap->largeTable = NULL;
+    heap->largeSlots = 0;
+    heap->largeCount = 0;
+    heap->largeBytes = 0;
+    heap->freedBytes = 0;
+    heap->purgedBytes = 0;
+    heap->quiet = QUIET_FAILURES;
+
+    heap->freeList = NULL; /* No blocks in free list */
+    tlsfReset(heap);
+    treeReset(heap);
+    heap->allocBytes = 0;
+    heap->freeBytes = 0;
+    memset(&heap->stats, 0, sizeof(heap->stats));
+    verifyInit(heap);
+    
+    /*
+     * entire memory is one giant block, which is the only free block (or,
+     * in a pool larger than any block, a few), and is followed by the end
+     * tag.
+     */
+    node *headptr = (node *) heap->mem;
+    size_t space = heap->size - sizeof(int); /* subtract the header tag */
+    headptr->tag = TAG_PREV_INUSE; /* there is no block before it */
+    *((unsigned int *) (heap->mem + heap->size)) = TAG_INUSE;
+    addFreeRun(heap, heap->mem, space);
+
+    slabInit(heap);
+}
+
+
+/*!
+ * Creates a heap with a memory pool of size bytes, both allocated from the
+ * system. Returns NULL if the memory cannot be had. The heap should be
+ * cleaned up with myheap_destroy(). With USE_HUGE_PAGES, the pool is a
+ * growable one that cannot grow, so that it is reserved for huge pages.
+ */
+myheap *myheap_create(size_t size)
+{
+    if (USE_HUGE_PAGES)
+    {
+        return myheap_create_growable(size, size);
+    }
+
+    myheap *heap = (myheap *) malloc(sizeof(myheap));
+    unsigned char *buf = (unsigned char *) malloc(size);
+    if (heap == NULL || buf == NULL)
+    {
+        free(heap);
+        free(buf);
+        return NULL;
+    }
+    myheap_init(heap, buf, size);
+    heap->owned = 1;
+    return heap;
+}
+
+
+/*!
+ * Sets up a growable heap in the given struct: maxSize bytes of address space
+ * are reserved (with no access, so they cost nothing), and the first size
+ * bytes of it committed for the pool, which grows into the rest whenever it
+ * runs out of room (see growHeap). Both are rounded up to whole pages, which
+ * are huge pages with USE_HUGE_PAGES. Returns 0 if the address space cannot
+ * be had.
+ */
+static int initGrowable(myheap *heap, size_t size, size_t maxSize)
+{
+    size_t pageSize = USE_HUGE_PAGES ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+    maxSize = (maxSize + pageSize - 1) & ~(pageSize - 1);
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+
+    void *buf;
+    if (USE_HUGE_PAGES)
+    {
+        buf = hugeReserve(maxSize);
+    }
+    else
+    {
+        buf = mmap(NULL, maxSize, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (buf == MAP_FAILED || buf == NULL)
+    {
+        return 0;
+    }
+    if (mprotect(buf, size, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(buf, maxSize);
+        return 0;
+    }
+    initHeap(heap, (unsigned char *) buf, size, maxSize);
+    heap->hugePages = USE_HUGE_PAGES;
+    return 1;
+}
+
+
+/*!
+ * Creates a heap whose pool starts out with size bytes and grows on demand
+ * up to maxSize bytes, so memory is only taken from the system as it is
+ * used. Returns NULL if the memory cannot be had. The heap should be cleaned
+ * up with myheap_destroy().
+ */
+myheap *myheap_create_growable(size_t size, size_t maxSize)
+{
+    myheap *heap = (myheap *) malloc(sizeof(myheap));
+    if (heap == NULL)
+    {
+        return NULL;
+    }
+    if (!initGrowable(heap, size, MAX(size, maxSize)))
+    {
+        free(heap);
+        return NULL;
+    }
+    heap->owned = 1;
+    return heap;
+}
+
+
+/*!
+ * Gives a heap's memory pool back to the system, however it was had.
+ */
+static void releasePool(myheap *heap)
+{
+    if (heap->reserved != 0)
+    {
+        munmap(heap->buf, heap->reserved);
+    }
+    else
+    {
+        free(heap->buf);
+    }
+}
+
+
+/*!
+ * Cleans up a heap. For a heap made by myheap_create() or
+ * myheap_create_growable(), this frees its memory pool and the heap itself.
+ * For one set up by myheap_init(), the caller owns both, so only the slab
+ * metadata is released. Either way, any large objects left are unmapped.
+ */
+void myheap_destroy(myheap *heap)
+{
+    largeFini(heap);
+    slabFini(heap);
+    if (heap->owned)
+    {
+        releasePool(heap);
+        free(heap);
+    }
+}
+
+
+/*!
+ * This function initializes both the allocator state, and the memory pool, of
+ * the default heap. It must be called before myalloc() or myfree() will work
+ * at all. If MEMORY_RESERVE is larger than MEMORY_SIZE, the pool is growable
+ * up to MEMORY_RESERVE bytes. With USE_HUGE_PAGES, it is reserved for huge
+ * pages like any growable pool, even if it cannot grow.
  */
 void init_myalloc() 
 {
+    if (MEMORY_RESERVE > MEMORY_SIZE || USE_HUGE_PAGES)
+    {
+        size_t reserve = MAX(MEMORY_SIZE, MEMORY_RESERVE);
+        if (!initGrowable(&defaultHeap, MEMORY_SIZE, reserve))
+        {
+            fprintf(stderr, "init_myalloc: could not reserve %zu bytes from"
+                                         " the system\n", reserve);
+            abort();
+        }
+        return;
+    }
+
     /*
      * Allocate the entire memory pool, from which our simple allocator will
      * serve allocation requests.
      */
-    mem = (unsigned char *) malloc(MEMORY_SIZE);
+    unsigned char *mem = (unsigned char *) malloc(MEMORY_SIZE);
     if (mem == 0) 
     {
-        fprintf(stderr, "init_myalloc: could not get %d bytes from the" \
+        fprintf(stderr, "init_myalloc: could not get %zu bytes from the" \
                                                      " system\n", MEMORY_SIZE);
         abort();
     }
-
-    freeList = NULL; /* No blocks in free list */
-    
-    /*
-     * entire memory is one giant block, whose header freeList points to.
-     */
-    node *headptr = (node *) mem;
-    int space = MEMORY_SIZE - 2 * sizeof(int); /* subtract int tags on end */
-    headptr->space = space;
-    addNode(headptr);
-    int *footptr = (int *) ((unsigned char *) (headptr) + sizeof(int) + space);
-    *footptr = space;
+    myheap_init(&defaultHeap, mem, MEMORY_SIZE);
 }
 
 
 /*!
- * Attempt to allocate a chunk of memory of "size" bytes.  Return NULL if
- * allocation fails. See findHead for time complexity analysis.
+ * Attempt to allocate a chunk of memory of "size" bytes from heap.  Return
+ * NULL if allocation fails. See findHead for time complexity analysis.
+ * Tiny requests go to a slab when there is room for one, and large ones to a
+ * mapping of their own when the system has one to give.
  */
-unsigned char *myalloc(int size) 
+unsigned char *myheap_alloc(myheap *heap, size_t size) 
 {
+    heap->stats.requests[STATS_BUCKET(size)]++;
+    if (heap->largeThreshold > 0 && size >= heap->largeThreshold)
+    {
+        unsigned char *resultptr = largeAlloc(heap, size);
+        if (resultptr != NULL)
+        {
+            verifyHeap(heap, NULL);
+            return resultptr;
+        }
+    }
+    if (heap->useSlabs && size <= SLAB_MAX_SIZE)
+    {
+        unsigned char *resultptr = slabAlloc(heap, size);
+        if (resultptr != NULL)
+        {
+            verifyHeap(heap, NULL);
+            return resultptr;
+        }
+    }
+
+    /*
+     * have to allocate atleast enough memory to fit the whole node struct
+     * (footer included) when the block is freed. Thus, cannot make block
+     * less than sizeof(node) size, meaning space must be at least
+     * sizeof(node) - sizeof(int) size. It is then rounded up to keep the
+     * block sizes multiples of ALIGNMENT.
+     */
+    size_t request = size;
+    node *headptr = NULL;
+
     /*
      * find a suitable block for the allocation request, and if not found, 
-     * return NULL
+     * return NULL (as for a request no block could hold)
      */
-    node *headptr = findHead(size); 
+    if (size <= MAX_SPACE)
+    {
+        size = roundSpace(size);
+        headptr = findBlock(heap, size);
+    }
     if (headptr == NULL)
     {
-        fprintf(stderr, "myalloc: cannot service request of size %d\n", size);
+        if (!heap->quiet)
+        {
+            fprintf(stderr, "myalloc: cannot service request of size %zu\n",
+                                                                      request);
+        }
+        heap->stats.failedRequests++;
         return NULL;
     }
-    int space = headptr->space;
+    removeNode(heap, headptr);
+    unsigned char *resultptr = useBlock(heap, headptr, size);
+    verifyHeap(heap, headptr);
+    return resultptr;
+}
 
-    /*
-     * have to allocate atleast enough memory to fit the whole header and 
-     * footer when the block is freed. Thus, cannot make block less than
-     * sizeof(node) + sizeof(int) size, meaning space must be at least
-     * sizeof(node) + sizeof(int) - 2 * sizeof(int) size 
-     */
-    size = MAX(size, sizeof(node) - sizeof(int)); 
+
+/*!
+ * Attempt to allocate a chunk of memory of "size" bytes from heap, with the
+ * payload aligned to alignment bytes (a power of two). Any alignment up to
+ * ALIGNMENT is what myheap_alloc gives anyway; for larger ones the slack in
+ * front of the aligned payload goes back to the free index (see
+ * allocAligned). Returns NULL if allocation fails or alignment is not a power
+ * of two. The result is freed and reallocated as usual, though a reallocated
+ * block only keeps the default alignment.
+ */
+unsigned char *myheap_alloc_aligned(myheap *heap, size_t alignment,
+                                                   size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        if (!heap->quiet)
+        {
+            fprintf(stderr, "myalloc_aligned: alignment %zu is not a power"
+                                              " of 2\n", alignment);
+        }
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+    {
+        return myheap_alloc(heap, size);
+    }
+
+    heap->stats.requests[STATS_BUCKET(size)]++;
+    unsigned char *resultptr = NULL;
+    if (alignment <= MAX_POOL_SIZE && size <= MAX_SPACE)
+    {
+        resultptr = allocAligned(heap, alignment, size);
+    }
+    if (resultptr == NULL)
+    {
+        if (!heap->quiet)
+        {
+            fprintf(stderr, "myalloc_aligned: cannot service request of size"
+                                " %zu aligned to %zu\n", size, alignment);
+        }
+        heap->stats.failedRequests++;
+        return NULL;
+    }
+    verifyHeap(heap, (node *) (resultptr - sizeof(int)));
+    return resultptr;
+}
+
+
+/*!
+ * Turns a free block that has already been taken out of the free index into
+ * an allocated block with a payload of size bytes (which must be at least the
+ * minimum space), and returns the payload.
+ */
+static unsigned char *useBlock(myheap *heap, node *headptr, size_t size)
+{
+    size_t space = SPACE_OF(headptr->tag);
     
     /* 
-     * Either swap the old block in the free list for a smaller split-off,
-     * if the old block is big enough to split, or remove the old block 
-     * altogether.
+     * If the block is big enough to split (the remainder would be at least a
+     * node struct), put the split-off remainder back in the free index.
      */
-    if (space > size + sizeof(int) + sizeof(node))
+    if (space >= size + sizeof(node))
     {
         node *newHeadptr = splitBlock(headptr, size);
-        addNode(newHeadptr);
+        addNode(heap, newHeadptr);
+        heap->stats.splits++;
     }
-    removeNode(headptr);
     
     /*
-     * Now that a block has been found, split, and the free list is up to date,
+     * Now that a block has been found, split, and the free index is up to date,
      * have to mark the found block (which has just been removed from free list)
      * as allocated, and return a pointer to the address of the payload (offset
-     * sizeof(int) from beginning of block)
+     * sizeof(int) from beginning of block). Its footer is now payload.
      */
-    space = headptr->space;
+    space = SPACE_OF(headptr->tag);
     unsigned char *resultptr = (unsigned char *) (headptr) + sizeof(int);
-    int *footptr = (int *) (resultptr + space);
-    headptr->space = -space;
-    *footptr = -space;
-    assert(checkMem() == MEMORY_SIZE); 
+    setUsed((unsigned char *) headptr, space);
+    heap->allocBytes += space + sizeof(int);
+    heap->stats.allocBlocks++;
+
+    /* the block, and the header of any tail split off, are in use now */
+    unsigned char *usedEnd = resultptr + space + sizeof(node);
+    scavengeUse(heap, (unsigned char *) headptr,
+                usedEnd < heap->mem + heap->size ? usedEnd
+                                                 : heap->mem + heap->size);
     return resultptr;
 }
 
 
 /*!
  * Free a previously allocated pointer.  oldptr should be an address returned by
- * myalloc().
+ * myheap_alloc() (or myheap_realloc()) for the same heap.
  *
  * Time complexity of deallocation/block coalescing: constant time
  * ------------------------------------------------------------ 
@@ -205,7 +618,8 @@ unsigned char *myalloc(int size)
  * trivial pointer arithmetic, and the addNode function is constant time since 
  * the node is added to the beginning of free list, so no iteration through
  * the free list is required. The coalesce backward logic involves
- * just using the footer of the previous block to find the block head, so
+ * just using the footer of the previous block to find the block head (there
+ * is one exactly when the block's TAG_PREV_INUSE is clear), so
  * no iteration through blocks is required, while the coalesce forward
  * logic is also pointer arithmetic. The lack of iteration through the
  * list means that both versions of coalescing are constant time, since
@@ -213,210 +627,510 @@ unsigned char *myalloc(int size)
  * Hence, myfree has a fixed number of stages, all that occur in constant time, 
  * and so, is O(1) with respect to number of blocks in the memory pool overall. 
  */
-void myfree(unsigned char *oldptr) 
+void myheap_free(myheap *heap, unsigned char *oldptr) 
 {
-    if (isValid(oldptr) == 0)
+    if (isValid(heap, oldptr) == 0)
     {
         fprintf(stderr, "Cannot free invalid address %p\n", (void *) oldptr);
         abort();
     }
+    if (isLargeObject(heap, oldptr))
+    {
+        largeFree(heap, oldptr);
+        verifyHeap(heap, NULL);
+        return;
+    }
+    if (isSlabObject(heap, oldptr))
+    {
+        slabFree(heap, oldptr);
+        verifyHeap(heap, NULL);
+        return;
+    }
     
     /* Some basic values and addresses */
     unsigned char *dataptr = oldptr - sizeof(int);
+    size_t space = SPACE_OF(((node *) dataptr)->tag);
+    node *headptr = freeBlock(heap, dataptr, space, 1);
+    scavengeFreed(heap, space + sizeof(int));
+    verifyHeap(heap, headptr);
+}
+
+
+/*!
+ * Turns the allocated memory at dataptr, space bytes after a header tag, into
+ * a free block in the free index, coalesced with its neighbours if they are
+ * free. The memory is normally one block, but may be a run of adjacent ones
+ * (see myheap_free_batch), whose inner headers simply become free space;
+ * blocks says how many. Returns the header of the resulting free block.
+ */
+static node *freeBlock(myheap *heap, unsigned char *dataptr, size_t space,
+                                                     int blocks)
+{
     node *headptr = (node *) dataptr;
-    int space = -headptr->space;
-    int *footptr = (int *) (oldptr + space);
-    
+
     /*
-     * make int tags positive to show block is free, and add new free block
-     * to free list
+     * clear TAG_INUSE (here and in the next block's header) and write the
+     * footer to show block is free, and add new free block to free list
      */
-    headptr->space = space;
-    *footptr = space;
-    addNode(headptr);
+    setFree(dataptr, space);
+    heap->allocBytes -= space + sizeof(int);
+    heap->stats.allocBlocks -= blocks;
+    addNode(heap, headptr);
 
     /* Coealesce backward logic. */
-    if (dataptr != mem) /* make sure it is not first block */
+    if (!(headptr->tag & TAG_PREV_INUSE)) /* if the previous block is free */
     {
-        int *prevFootptr = (int *) (dataptr) - 1;
-        int prevSpace = *prevFootptr;
-        if (prevSpace > 0) /* if the previous block is also free, coalesce */
+        /* then it has a footer, which says where it starts: coalesce */
+        unsigned int *prevFootptr = (unsigned int *) (dataptr) - 1;
+        unsigned int prevTag = *prevFootptr;
+        node *prevHeadptr = (node *) (dataptr - SPACE_OF(prevTag)
+                                              - sizeof(int));
+        /*
+         * refer to the new, coalesced block (if they did) before checking
+         * for forward coalescing
+         */
+        headptr = coalesce(heap, prevHeadptr, headptr);
+    }
+
+    /* Coalesce forward logic */
+    coalesceForward(heap, headptr);
+    return headptr;
+}
+
+
+/*!
+ * Counts a realloc in the heap's statistics, as failed, in place or moved.
+ * Reallocs that move through myheap_alloc are counted there if they fail.
+ */
+static void countRealloc(myheap *heap, unsigned char *oldptr,
+                                       unsigned char *newptr)
+{
+    if (newptr == NULL)
+    {
+        heap->stats.failedRequests++;
+    }
+    else if (newptr == oldptr)
+    {
+        heap->stats.reallocInPlace++;
+    }
+    else
+    {
+        heap->stats.reallocMoved++;
+    }
+}
+
+
+/*!
+ * Orders pointers by address, for qsort.
+ */
+static int compareAddresses(const void *a, const void *b)
+{
+    unsigned char *ptrA = *(unsigned char * const *) a;
+    unsigned char *ptrB = *(unsigned char * const *) b;
+    return (ptrA > ptrB) - (ptrA < ptrB);
+}
+
+
+/*!
+ * Allocates count blocks of size bytes each from heap, storing their payloads
+ * in out[0] to out[count - 1], and returns how many it allocated (count,
+ * unless the heap runs out first).
+ *
+ * When one free block can hold them all, they are carved from it back to
+ * back: one free index lookup, at most one split (of whatever is left over),
+ * and a header written for each block, instead of a lookup and a split per
+ * block. Failing that, and for sizes that go to slabs or large objects,
+ * which have quick paths of their own, the blocks are allocated one by one.
+ */
+int myheap_alloc_batch(myheap *heap, size_t size, int count,
+                                     unsigned char **out)
+{
+    size_t space = roundSpace(MIN(size, MAX_SPACE));
+    size_t blockSize = space + sizeof(int);
+    node *headptr = NULL;
+    if (count > 1 && (heap->largeThreshold == 0 || size < heap->largeThreshold)
+                  && !(heap->useSlabs && size <= SLAB_MAX_SIZE)
+                  && size <= MAX_SPACE
+                  && (size_t) count <= MAX_POOL_SIZE / blockSize)
+    {
+        headptr = findBlock(heap, count * blockSize - sizeof(int));
+    }
+    if (headptr == NULL)
+    {
+        int n = 0;
+        while (n < count && (out[n] = myheap_alloc(heap, size)) != NULL)
         {
-            node *prevHeadptr = (node *) (dataptr - prevSpace - 2 * sizeof(int));
-            coalesce(prevHeadptr, headptr);
-            /*
-             * reset the variables to refer to new, coalesced block before
-             * checking for forward coalescing
-             */
-            headptr = prevHeadptr;
-            dataptr = (unsigned char *) headptr;
-            space = headptr->space;
+            n++;
         }
+        return n;
     }
 
-    /* Coalesce forward logic */
-    unsigned char *endptr = dataptr + space + 2 * sizeof(int);
-    if (endptr != mem + MEMORY_SIZE) /* if block is not the last block */
+    /* split off what is left, if it is big enough to be a block */
+    removeNode(heap, headptr);
+    if (SPACE_OF(headptr->tag) >= count * blockSize + sizeof(node)
+                                                    - sizeof(int))
     {
-        node *nextHeadptr = (node *) endptr;
-        if (nextHeadptr->space > 0) /* if the next block is also free */
+        addNode(heap, splitBlock(headptr, count * blockSize - sizeof(int)));
+        heap->stats.splits++;
+    }
+    size_t total = SPACE_OF(headptr->tag) + sizeof(int);
+    heap->allocBytes += total;
+    heap->stats.allocBlocks += count;
+    heap->stats.requests[STATS_BUCKET(size)] += count;
+
+    /*
+     * Write each block's header; all but the first follow a block in use, and
+     * the last takes up any remainder too small to split off.
+     */
+    unsigned char *dataptr = (unsigned char *) headptr;
+    unsigned int prevInUse = headptr->tag & TAG_PREV_INUSE;
+    for (int i = 0; i < count; i++)
+    {
+        size_t blockSpace = i < count - 1 ? space
+                          : total - (count - 1) * blockSize - sizeof(int);
+        *((unsigned int *) dataptr) = TAG_OF(blockSpace) | TAG_INUSE
+                                                         | prevInUse;
+        out[i] = dataptr + sizeof(int);
+        dataptr += blockSpace + sizeof(int);
+        prevInUse = TAG_PREV_INUSE;
+    }
+    setPrevInUse(dataptr, 1);
+
+    /* as in useBlock, the header of any tail split off is in use too */
+    unsigned char *usedEnd = dataptr + sizeof(node);
+    scavengeUse(heap, (unsigned char *) headptr,
+                usedEnd < heap->mem + heap->size ? usedEnd
+                                                 : heap->mem + heap->size);
+    verifyHeap(heap, (node *) (out[count - 1] - sizeof(int)));
+    return count;
+}
+
+
+/*!
+ * Frees the count pointers in ptrs, which are sorted by address in place.
+ * Each is checked as myheap_free would, and the same pointer twice aborts
+ * too. A run of blocks lying next to each other in the pool is then freed
+ * as one block, coalescing with its neighbours once, rather than block by
+ * block with a coalesce for each pair.
+ */
+void myheap_free_batch(myheap *heap, unsigned char **ptrs, int count)
+{
+    qsort(ptrs, count, sizeof(ptrs[0]), compareAddresses);
+    for (int i = 0; i < count; i++)
+    {
+        if (isValid(heap, ptrs[i]) == 0 || (i > 0 && ptrs[i] == ptrs[i - 1]))
         {
-            coalesce(headptr, nextHeadptr);
+            fprintf(stderr, "Cannot free invalid address %p\n",
+                                               (void *) ptrs[i]);
+            abort();
         }
     }
-    assert(checkMem() == MEMORY_SIZE); 
+
+    node *headptr = NULL;
+    size_t freed = 0;
+    int i = 0;
+    while (i < count)
+    {
+        unsigned char *oldptr = ptrs[i++];
+        if (isLargeObject(heap, oldptr))
+        {
+            largeFree(heap, oldptr);
+            continue;
+        }
+        if (isSlabObject(heap, oldptr))
+        {
+            slabFree(heap, oldptr);
+            continue;
+        }
+
+        /*
+         * extend the run over blocks whose header is where it ends, as long
+         * as the run still fits in one block
+         */
+        unsigned char *dataptr = oldptr - sizeof(int);
+        unsigned char *endptr = oldptr + SPACE_OF(((node *) dataptr)->tag);
+        int blocks = 1;
+        while (i < count && ptrs[i] == endptr + sizeof(int)
+                         && !isSlabObject(heap, ptrs[i])
+                         && (size_t) (ptrs[i] - dataptr) - sizeof(int)
+                            + SPACE_OF(((node *) endptr)->tag) <= MAX_SPACE)
+        {
+            endptr = ptrs[i++] + SPACE_OF(((node *) endptr)->tag);
+            blocks++;
+        }
+        size_t space = endptr - dataptr - sizeof(int);
+        headptr = freeBlock(heap, dataptr, space, blocks);
+        freed += space + sizeof(int);
+    }
+    scavengeFreed(heap, freed);
+    verifyHeap(heap, headptr);
 }
 
      
 /*!
  * This is a cool function similar to realloc that, given a pointer previously
- * returned by myalloc, as well as a new size, will try to shift all the
+ * returned by myheap_alloc, as well as a new size, will try to shift all the
  * data in the old location to a new location of the specified new size.
  * If it works, a pointer to the new payload will be returned. If not, 
  * the old data will remain unaffected, and NULL will be returned.
+ *
+ * The block is resized in place whenever its neighbours allow, so that only
+ * a block with no room around it is ever copied:
+ *      -- shrinking splits the tail off as a free block (if it is big enough
+ *         to be one), which coalesces with a free block after it
+ *      -- growing absorbs the next block if it is free and big enough
+ *      -- failing that, it absorbs the previous block (and the next one, if
+ *         free) and moves the payload down with memmove
+ *      -- otherwise the data is copied to a new block, and the old block is
+ *         freed only once that has worked, so failure needs no undoing
+ * All but the last are constant time, like myfree. The last goes through
+ * myheap_alloc, so a block that grows past the large threshold moves to a
+ * mapping of its own, and from then on is resized with mremap, which moves
+ * its pages rather than copying them.
  */
-unsigned char *myrealloc(unsigned char *oldptr, int size)
+unsigned char *myheap_realloc(myheap *heap, unsigned char *oldptr,
+                                                   size_t size)
 {
-    /*
-     * Save some addresses and values from the old location.
-     */
-    unsigned char *oldDataptr = oldptr - sizeof(int);
-    node *oldHeadptr = (node *) oldDataptr;
-    int oldSpace = -oldHeadptr->space;
-    int *oldFootptr = (int *) (oldptr + oldSpace);
-    unsigned char *endptr = (unsigned char *) (oldFootptr + 1);
-    
-    /*
-     * Only the data within the size of the node struct is modified by
-     * free'ing (have to put in new addresses), so here we abuse notation
-     * to save the data stored in what will become the next and prev fields
-     * when oldptr is freed. The rest of the data in the oldptr location is
-     * untouched.
-     */
-    node *tempA = oldHeadptr->next;
-    node *tempB = oldHeadptr->prev; 
-
-    /*
-     * These are pointers to the headers for the previous and next blocks
-     * in memory. They will remain none unless there is in fact a free block
-     * contiguous with the old data.
-     */
-    node *prevHeadptr = NULL;
-    node *nextHeadptr = NULL;
-    int prevSpace = 0;
+    if (isLargeObject(heap, oldptr))
+    {
+        unsigned char *newptr = largeRealloc(heap, oldptr, size);
+        countRealloc(heap, oldptr, newptr);
+        verifyHeap(heap, NULL);
+        return newptr;
+    }
 
     /*
-     * This block updates prevHeadptr to point to the previous block iff
-     * the previous block is free. Thus, after this block, if prevHeadptr
-     * is not NULL, then myfree will coallesce the old block with this 
-     * previous block.
+     * A slab object can stay put if the new size still fits its slab's
+     * object size, and otherwise moves to a new allocation.
      */
-    if (oldDataptr != mem)
+    if (isSlabObject(heap, oldptr))
     {
-        int *prevFootptr = (int *) (oldDataptr) - 1;
-        prevSpace = *prevFootptr;
-        if (prevSpace > 0)
+        size_t objSize = slabObjectSize(oldptr);
+        if (size <= objSize)
+        {
+            countRealloc(heap, oldptr, oldptr);
+            return oldptr;
+        }
+        unsigned char *newptr = myheap_alloc(heap, size);
+        if (newptr != NULL)
         {
-            prevHeadptr = (node *) (oldDataptr - prevSpace - 2 * sizeof(int));
+            memcpy(newptr, oldptr, objSize);
+            slabFree(heap, oldptr);
+            heap->stats.reallocMoved++;
         }
-    } 
+        return newptr;
+    }
+
+    /* Some basic values and addresses */
+    unsigned char *dataptr = oldptr - sizeof(int);
+    node *headptr = (node *) dataptr;
+    size_t space = SPACE_OF(headptr->tag);
+    unsigned char *endptr = oldptr + space; /* the next header */
+    /* a size no block can hold gets a space none has, so the block moves */
+    size_t newSpace = size <= MAX_SPACE ? roundSpace(size) : SIZE_MAX;
 
     /*
-     * Same thing as previous block, after this block, if nextHeadptr
-     * is not NULL, then the old block will coalesce with the block
-     * after it.
+     * Shrinking (or staying the same): useBlock splits off any tail big
+     * enough to be a block, and it is then coalesced with the next block.
+     * In this and the other in-place cases, useBlock counts the block as
+     * allocated again with its new size.
      */
-    if (endptr != mem + MEMORY_SIZE)
+    if (newSpace <= space)
     {
-        int nextSpace = *((int *) endptr);
-        if (nextSpace > 0)
+        heap->allocBytes -= space + sizeof(int);
+        heap->stats.allocBlocks--;
+        useBlock(heap, headptr, newSpace);
+        if (SPACE_OF(headptr->tag) != space)
         {
-            nextHeadptr = (node *) endptr;
+            coalesceForward(heap, (node *) (oldptr + newSpace));
         }
+        countRealloc(heap, oldptr, oldptr);
+        verifyHeap(heap, headptr);
+        return oldptr;
     }
 
-    /* We free the old block (all important/modifiable data has been saved) */
-    myfree(oldptr);
-    /* Then, we find the new best free block for our purpse */
-    unsigned char *newptr = myalloc(size);
-    
-    /* 
-     * This large block handles the case where reallocating is not possible.
-     * It will uncoalesce any coalesced blocks, update the freeList to be
-     * in the state before myfree was called, and put back all old data
-     * before returning NULL.
+    /* The free neighbours, if any, and the space they would add */
+    node *nextHeadptr = NULL;
+    node *prevHeadptr = NULL;
+    size_t nextGain = 0;
+    size_t prevGain = 0;
+    if (!(((node *) endptr)->tag & TAG_INUSE)) /* never the end tag */
+    {
+        nextHeadptr = (node *) endptr;
+        nextGain = SPACE_OF(nextHeadptr->tag) + sizeof(int);
+    }
+    if (!(headptr->tag & TAG_PREV_INUSE))
+    {
+        unsigned int prevTag = *((unsigned int *) (dataptr) - 1);
+        prevGain = SPACE_OF(prevTag) + sizeof(int);
+        prevHeadptr = (node *) (dataptr - prevGain);
+    }
+
+    /*
+     * Growing into the next block leaves the payload where it is. Here and
+     * below, neighbours that would make a block too large for its tag are
+     * left alone, so such a block moves instead.
      */
-    if (newptr == NULL)
+    if (nextHeadptr != NULL && space + nextGain >= newSpace
+                            && space + nextGain <= MAX_SPACE)
     {
-        /* forward and back coalescing */
-        if (prevHeadptr != NULL && nextHeadptr != NULL) 
-        {
-            splitBlock(prevHeadptr, prevSpace);
-            splitBlock(oldHeadptr, oldSpace);
-            addNode(nextHeadptr);
-        }
-        else if (prevHeadptr != NULL) /* just back coalescing */
-        {
-            splitBlock(prevHeadptr, prevSpace);
-        }
-        else if (nextHeadptr != NULL) /* just forward */
-        {
-            splitBlock(oldHeadptr, oldSpace);
-            addNode(nextHeadptr);
-            removeNode(oldHeadptr);
-        }
-        else /* no coalescing */
+        removeNode(heap, nextHeadptr);
+        headptr->tag = TAG_OF(space + nextGain)
+                     | (headptr->tag & TAG_PREV_INUSE);
+        heap->allocBytes -= space + sizeof(int);
+        heap->stats.allocBlocks--;
+        useBlock(heap, headptr, newSpace);
+        countRealloc(heap, oldptr, oldptr);
+        verifyHeap(heap, headptr);
+        return oldptr;
+    }
+
+    /* Growing into the previous block (and the next) moves it down */
+    if (prevHeadptr != NULL && prevGain + space + nextGain >= newSpace
+                            && prevGain + space + nextGain <= MAX_SPACE)
+    {
+        removeNode(heap, prevHeadptr);
+        if (nextHeadptr != NULL)
         {
-            removeNode(oldHeadptr);
+            removeNode(heap, nextHeadptr);
         }
-        
-        /* Restore all data, make int tags negative again */
-        oldHeadptr->space = -oldSpace;
-        oldHeadptr->next = tempA;
-        oldHeadptr->prev = tempB;
-        *oldFootptr = -oldSpace;
-        return NULL;
+        unsigned char *newptr = (unsigned char *) prevHeadptr + sizeof(int);
+        memmove(newptr, oldptr, space);
+        prevHeadptr->tag = TAG_OF(prevGain + space + nextGain)
+                         | (prevHeadptr->tag & TAG_PREV_INUSE);
+        heap->allocBytes -= space + sizeof(int);
+        heap->stats.allocBlocks--;
+        useBlock(heap, prevHeadptr, newSpace);
+        countRealloc(heap, oldptr, newptr);
+        verifyHeap(heap, prevHeadptr);
+        return newptr;
     }
 
-    /* Some addresses/values from the new place */
-    unsigned char *newDataptr = newptr - sizeof(int);
-    node *newHeadptr = (node *) newDataptr;
-    int nSpace = -newHeadptr->space;
-
-    /* 
-     * This copies the initial data from the old location to the new.
-     * In particular, the "padding" after the int tag in the header
-     * struct of the old location is not modified in the freeing process,
-     * so this can be directly copied, while data from other areas of the
-     * struct is modified, hence why we saved it as tempA and temp B 
-     */
-    *((int *) newptr) = *((int *) oldptr);
-    newHeadptr->next = tempA;
-    newHeadptr->prev = tempB;
-    
-    /* 
-     * This loop goes through the old location, copies values into the
-     * new location one byte at a time. i is the offset from the
-     * start of the payload (so since some initial data has already been
-     * copied, i is more than 0 to begin with.
-     */
-    for (int i = sizeof(node) - sizeof(int); i < nSpace && i < size; i++)
+    /* No room around the block, so the data has to go elsewhere */
+    unsigned char *newptr = myheap_alloc(heap, size);
+    if (newptr != NULL)
     {
-        *(newptr + i) = *(oldptr + i);
+        memcpy(newptr, oldptr, space);
+        myheap_free(heap, oldptr);
+        heap->stats.reallocMoved++;
     }
     return newptr; 
 }
 
 
 /*!
- * Clean up the allocator state.
+ * Gives the memory inside every free block back to the system right away,
+ * rather than waiting for the scavenger to decide it has been idle long
+ * enough (see scavenge.c). The blocks stay free, and their memory comes back
+ * as it is allocated again. Returns the number of bytes given back, which is
+ * always 0 for heaps too small to have a page map.
+ */
+size_t myheap_trim(myheap *heap)
+{
+    size_t purged = scavenge(heap, 1);
+    verifyHeap(heap, NULL);
+    return purged;
+}
+
+
+/*!
+ * Reports how much of the pool the system has backed with huge pages, which
+ * may be anything from none to all of it (see hugepage.c), whether or not
+ * the heap asked for them.
+ */
+long myheap_huge_bytes(myheap *heap)
+{
+    size_t poolSize = heap->reserved != 0 ? heap->reserved : heap->committed;
+    return hugeBytes(heap->buf, heap->buf + poolSize);
+}
+
+
+/*!
+ * Clean up the allocator state of the default heap.
  * All this really has to do is free the user memory pool. This function mostly
  * ensures that the test program doesn't leak memory, so it's easy to check
  * if the allocator does.
  */
 void close_myalloc() 
 {
-    free(mem);
+    largeFini(&defaultHeap);
+    slabFini(&defaultHeap);
+    releasePool(&defaultHeap);
+}
+
+
+/*!
+ * The original single-pool interface, which works against the default heap.
+ */
+unsigned char *myalloc(size_t size)
+{
+    return myheap_alloc(&defaultHeap, size);
+}
+
+
+unsigned char *myalloc_aligned(size_t alignment, size_t size)
+{
+    return myheap_alloc_aligned(&defaultHeap, alignment, size);
+}
+
+
+size_t myalloc_trim()
+{
+    return myheap_trim(&defaultHeap);
+}
+
+
+long myalloc_huge_bytes()
+{
+    return myheap_huge_bytes(&defaultHeap);
+}
+
+
+size_t myalloc_usable_size(unsigned char *ptr)
+{
+    return payloadSize(&defaultHeap, ptr);
+}
+
+
+void myfree(unsigned char *oldptr)
+{
+    myheap_free(&defaultHeap, oldptr);
+}
+
+
+unsigned char *myrealloc(unsigned char *oldptr, size_t size)
+{
+    return myheap_realloc(&defaultHeap, oldptr, size);
+}
+
+
+int myalloc_batch(size_t size, int count, unsigned char **out)
+{
+    return myheap_alloc_batch(&defaultHeap, size, count, out);
+}
+
+
+void myfree_batch(unsigned char **ptrs, int count)
+{
+    myheap_free_batch(&defaultHeap, ptrs, count);
+}
+
+
+void myalloc_stats(heap_stats *stats)
+{
+    myheap_stats(&defaultHeap, stats);
+}
+
+
+double myalloc_fragmentation()
+{
+    return myheap_fragmentation(&defaultHeap);
+}
+
+
+int myalloc_dump(int fd)
+{
+    return myheap_dump(&defaultHeap, fd);
 }
 
 
@@ -432,35 +1146,34 @@ void close_myalloc()
 
 /*!
  * Sanity check function, sums up total free and allocated memory. Compare the
- * return to MEMORY_SIZE to make sure there are no logic errors. Will infinite
- * loop if the last block does not end at the end of the memory pool.
+ * return to heap->size to make sure there are no logic errors. The totals are
+ * kept up to date as blocks change hands, so this is constant time; the walk
+ * over every block that checks them against the blocks themselves is in
+ * verify.c.
  */
-int checkMem()
+size_t checkMem(myheap *heap)
 {
-    int freeMem = 0;        /* counts free memory */
-    int allocMem = 0;       /* counts allocated memory */
-    unsigned char *dataptr; /* pointer to start of every block */
-    int blockSize;
+    return heap->allocBytes + heap->freeBytes;
+}
 
-    /* 
-     * iterate through all blocks, compute block size, and add block size
-     * to appropriate counter variable
-     */
-    for (dataptr = mem; dataptr != mem + MEMORY_SIZE; dataptr += blockSize)
+
+/*!
+ * Returns the number of usable bytes in the allocation at ptr, which is at
+ * least the size that was asked for. For a block this is just the space in
+ * the header tag in front of the payload, for a slab object its slab's object
+ * size, and for a large object the rest of its mapping.
+ */
+size_t payloadSize(myheap *heap, unsigned char *ptr)
+{
+    if (isLargeObject(heap, ptr))
     {
-        node *headptr = (node *) dataptr;
-        int space = headptr->space;
-        blockSize = abs(space) + 2 * sizeof(int);
-        if (space < 0)
-        {
-            allocMem += blockSize;
-        }
-        else
-        {
-            freeMem += blockSize;
-        }
+        return largeObjectSize(ptr);
+    }
+    if (isSlabObject(heap, ptr))
+    {
+        return slabObjectSize(ptr);
     }
-    return allocMem + freeMem;
+    return SPACE_OF(loadTag(ptr - sizeof(int)));
 }
 
 
@@ -469,72 +1182,340 @@ int checkMem()
  * , but does not guarantee validity. This will never reject a valid address,
  * , but it might accept an invalid address. 
  */
-int isValid(unsigned char *oldptr)
+int isValid(myheap *heap, unsigned char *oldptr)
 {
-    /* Ensure that oldptr is within acceptable addresses of the memory pool */
-    if (mem + sizeof(int) > oldptr || mem + MEMORY_SIZE - sizeof(int) < oldptr)
+    unsigned char *mem = heap->mem;
+    unsigned char *endptr = heap->mem + heap->size;
+
+    /* Large objects have no tags either, just their header */
+    if (isLargeObject(heap, oldptr))
+    {
+        return 1;
+    }
+
+    /* Slab objects have no tags, their slab knows whether they are in use */
+    if (isSlabObject(heap, oldptr))
+    {
+        return slabValid(oldptr);
+    }
+
+    /*
+     * Ensure that oldptr is within acceptable addresses of the memory pool,
+     * and aligned like every payload is
+     */
+    if (mem + sizeof(int) > oldptr || endptr < oldptr
+                         || ((uintptr_t) oldptr & (ALIGNMENT - 1)) != 0)
     {
         return 0;
     }
-    int space = - *((int *) (oldptr) - 1);
 
     /*
      * Ensure that block is not already free, and oldptr's specified block is
-     * fully within memory pool.
+     * fully within memory pool. Allocated blocks have no footer to check the
+     * header against, and the next block's header is not looked at either,
+     * since mtfree calls this without the heap's lock (see setPrevInUse):
+     * the verification after the free goes on to check the neighbours.
      */
-    if (space < 0 || oldptr + space > mem + MEMORY_SIZE - sizeof(int))
+    unsigned int tag = loadTag(oldptr - sizeof(int));
+    if (!(tag & TAG_INUSE) || SPACE_OF(tag) > (size_t) (endptr - oldptr))
     {
         return 0;
     }
+    return 1;
+}
+
+
+/*!
+ * Returns the space a block needs to hold size bytes, which must be at most
+ * MAX_SPACE: at least enough for the node struct once the block is freed,
+ * and rounded up so that the whole block (space and its header tag) is a
+ * multiple of ALIGNMENT. Callers turn larger requests down themselves, since
+ * no block could hold them.
+ */
+static size_t roundSpace(size_t size)
+{
+    size = MAX(size, sizeof(node) - sizeof(int));
+    size_t blockSize = (size + sizeof(int) + ALIGNMENT - 1)
+                                         & ~(size_t) (ALIGNMENT - 1);
+    return blockSize - sizeof(int);
+}
+
+
+/*!
+ * Marks the block at dataptr, which has space bytes of payload, as free: its
+ * header tag gets the block's size and keeps its TAG_PREV_INUSE, its footer
+ * gets the size, and the next block's header loses its TAG_PREV_INUSE.
+ */
+static void setFree(unsigned char *dataptr, size_t space)
+{
+    unsigned int *headTag = (unsigned int *) dataptr;
+    *headTag = TAG_OF(space) | (*headTag & TAG_PREV_INUSE);
+    *((unsigned int *) (dataptr + space)) = TAG_OF(space);
+    setPrevInUse(dataptr + space + sizeof(int), 0);
+}
+
+
+/*!
+ * Marks the block at dataptr, which has space bytes of payload, as allocated,
+ * like setFree but with no footer, which is now part of the payload.
+ */
+static void setUsed(unsigned char *dataptr, size_t space)
+{
+    unsigned int *headTag = (unsigned int *) dataptr;
+    *headTag = TAG_OF(space) | TAG_INUSE | (*headTag & TAG_PREV_INUSE);
+    setPrevInUse(dataptr + space + sizeof(int), 1);
+}
+
+
+/*!
+ * Sets or clears TAG_PREV_INUSE in the header tag at dataptr. That block may
+ * be allocated, and mtfree reads the header of an allocated block without
+ * holding whatever lock guards the heap (through isValid and payloadSize), so
+ * the tag is only ever written whole here, with a relaxed atomic store. The
+ * rest of an allocated block's header does not change until it is freed.
+ */
+static void setPrevInUse(unsigned char *dataptr, int inUse)
+{
+    unsigned int tag = *((unsigned int *) dataptr);
+    tag = inUse ? tag | TAG_PREV_INUSE : tag & ~TAG_PREV_INUSE;
+    __atomic_store_n((unsigned int *) dataptr, tag, __ATOMIC_RELAXED);
+}
+
+
+/*!
+ * Reads the header tag at dataptr, with a relaxed atomic load so that it may
+ * be done without the heap's lock (see setPrevInUse).
+ */
+static unsigned int loadTag(unsigned char *dataptr)
+{
+    return __atomic_load_n((unsigned int *) dataptr, __ATOMIC_RELAXED);
+}
+
+
+/*!
+ * Returns the first address at or after ptr that is a multiple of alignment
+ * (a power of two).
+ */
+static unsigned char *nextAligned(unsigned char *ptr, size_t alignment)
+{
+    uintptr_t mask = alignment - 1;
+    return (unsigned char *) (((uintptr_t) ptr + mask) & ~mask);
+}
+
+
+/*!
+ * Helper function that allocates a block whose payload address is a multiple
+ * of alignment (a power of two of at least ALIGNMENT). A free block with room
+ * for size bytes after any such address it could contain is found, and split
+ * in up to three: the leading slack before the aligned payload (which goes
+ * back to the free index as a block of its own, so it must be at least a
+ * minimum block), the aligned block itself, and any remainder after it.
+ * Since all payloads are ALIGNMENT-aligned, the slack is always a whole
+ * number of ALIGNMENT units. The slack's footer is written in what was the
+ * middle of a free block, so its page is taken off the scavenger's books like
+ * the pages of the aligned block. Returns NULL if there is no such free block.
+ */
+unsigned char *allocAligned(myheap *heap, size_t alignment, size_t size)
+{
+    size_t minBlock = roundSpace(0) + sizeof(int);
+    size = roundSpace(size);
+
+    node *headptr = findBlock(heap, size + alignment + minBlock);
+    if (headptr == NULL)
+    {
+        return NULL;
+    }
+    removeNode(heap, headptr);
 
     /*
-     * Partially ensure that oldptr did point to a block, not a random location
-     * in memory pool. footptr should have same value for space as original in
-     * header; however, this is a necessary, not sufficient condition.
+     * The payload would start at resultptr. If that leaves slack before the
+     * block, but too little to form a free block, skip to the next multiple.
      */
-    if (*((int *) (oldptr + space)) != -space)
+    unsigned char *firstptr = (unsigned char *) headptr + sizeof(int);
+    unsigned char *resultptr = nextAligned(firstptr, alignment);
+    if (resultptr != firstptr && (size_t) (resultptr - firstptr) < minBlock)
+    {
+        resultptr = nextAligned(firstptr + minBlock, alignment);
+    }
+
+    if (resultptr != firstptr)
+    {
+        size_t leadSpace = resultptr - firstptr - sizeof(int);
+        node *alignedHeadptr = splitBlock(headptr, leadSpace);
+        setFree((unsigned char *) headptr, leadSpace);
+        /* the slack's new footer may land on a page given back earlier */
+        unsigned char *footerptr = (unsigned char *) headptr + leadSpace;
+        scavengeUse(heap, footerptr, footerptr + sizeof(int));
+        addNode(heap, headptr);
+        heap->stats.splits++;
+        headptr = alignedHeadptr;
+    }
+    return useBlock(heap, headptr, size);
+}
+
+
+/*!
+ * Finds a suitable free block like findHead, but if there is none and the
+ * heap is growable, grows the heap to make one. This is the search that
+ * hardware counters single out (see perfcount.h).
+ */
+static node *findBlock(myheap *heap, size_t size)
+{
+    perf_mark mark;
+    int counting = perfActive && perfBegin(&mark);
+    node *headptr = findHead(heap, size);
+    if (headptr == NULL && growHeap(heap, size))
+    {
+        headptr = findHead(heap, size);
+    }
+    if (counting)
+    {
+        perfEnd(PERF_SEARCH, &mark);
+    }
+    return headptr;
+}
+
+
+/*!
+ * Commits more of a growable heap's reserved address space: enough for a
+ * free block of size bytes (and at least GROW_SIZE bytes), or as much as is
+ * left. The new memory becomes a free block at the end of the pool, which
+ * coalesces with the last block if that is free (and the two fit in a tag). Since the pool only ever
+ * grows at its end, it stays one contiguous range, and all the checks
+ * against heap->mem + heap->size keep working. Committed memory that is never
+ * touched takes up no physical memory, so the heap's resident size follows
+ * what is actually used. Returns 0 if the heap could not grow.
+ */
+static int growHeap(myheap *heap, size_t size)
+{
+    if (heap->reserved == 0 || size > MAX_POOL_SIZE)
     {
         return 0;
     }
+    size_t pageSize = heap->hugePages ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+    size_t offset = heap->mem - heap->buf;
+    size_t want = offset + heap->size + sizeof(int) /* the end tag */
+                + MAX(size + sizeof(int) + ALIGNMENT, GROW_SIZE);
+    want = (want + pageSize - 1) & ~(pageSize - 1);
+    if (want > heap->reserved)
+    {
+        want = heap->reserved;
+    }
+    size_t newSize = MIN((want - offset - sizeof(int))
+                                   & ~(size_t) (ALIGNMENT - 1), MAX_POOL_SIZE);
+    if (newSize <= heap->size)
+    {
+        return 0;
+    }
+    if (mprotect(heap->buf + heap->committed, want - heap->committed,
+                                              PROT_READ | PROT_WRITE) != 0)
+    {
+        return 0;
+    }
+    heap->committed = want;
+
+    /*
+     * the new memory is one free block (or a few, see addFreeRun) at the end
+     * of the pool, starting at the old end tag (so it keeps the last block's
+     * TAG_PREV_INUSE), and followed by a new one
+     */
+    unsigned char *dataptr = heap->mem + heap->size;
+    size_t space = newSize - heap->size - sizeof(int);
+    *((unsigned int *) (heap->mem + newSize)) = TAG_INUSE;
+    heap->size = newSize;
+    node *headptr = addFreeRun(heap, dataptr, space);
+
+    if (!(headptr->tag & TAG_PREV_INUSE))
+    {
+        unsigned int prevTag = *((unsigned int *) (dataptr) - 1);
+        coalesce(heap, (node *) (dataptr - SPACE_OF(prevTag)
+                                         - sizeof(int)), headptr);
+    }
     return 1;
 }
 
 
 /*!
- * Helper function that will take a free block and break it off into two
- * smaller free blocks, the first having a payload as large as the size 
- * argument, the second being the rest of the original block. Returns a 
- * node pointer to the newly made block.
+ * Turns the space bytes after a header tag at dataptr, whose TAG_PREV_INUSE
+ * the caller has already set as it should be, into free blocks in the free
+ * index: a single block, or, if that would be too large for a tag, as many
+ * of the largest blocks as it takes and a last one with the rest. Returns
+ * the header of the first block.
+ */
+static node *addFreeRun(myheap *heap, unsigned char *dataptr, size_t space)
+{
+    node *headptr = (node *) dataptr;
+    while (space > MAX_SPACE)
+    {
+        setFree(dataptr, MAX_SPACE);
+        addNode(heap, (node *) dataptr);
+        dataptr += MAX_BLOCK_SIZE;
+        space -= MAX_BLOCK_SIZE;
+    }
+    setFree(dataptr, space);
+    addNode(heap, (node *) dataptr);
+    return headptr;
+}
+
+
+/*!
+ * Coalesces the free block at headptr with the block after it, if there is
+ * one and it is free too (and the two fit in a tag, see coalesce).
  */
-node *splitBlock(node *headptr, int size)
+static void coalesceForward(myheap *heap, node *headptr)
+{
+    unsigned char *endptr = (unsigned char *) headptr
+                          + SPACE_OF(headptr->tag) + sizeof(int);
+    node *nextHeadptr = (node *) endptr;
+
+    /* if the next block is also free (the end tag never looks free) */
+    if (!(nextHeadptr->tag & TAG_INUSE))
+    {
+        coalesce(heap, headptr, nextHeadptr);
+    }
+}
+
+
+/*!
+ * Helper function that will take a block and break it off into two smaller
+ * blocks, the first having a payload as large as the size argument, the
+ * second being the rest of the original block, which is free. Returns a 
+ * node pointer to the newly made block. The first block keeps its flags,
+ * and gets no footer here: it is either about to be allocated (see useBlock)
+ * or marked free by the caller.
+ */
+node *splitBlock(node *headptr, size_t size)
 {
     unsigned char *dataptr = (unsigned char *) headptr;
-    int space = headptr->space;
+    size_t space = SPACE_OF(headptr->tag);
 
-    /* establish all the header and footer pointers */
-    int *footptr = (int *) (dataptr + sizeof(int) + space);
-    int *newFootptr = (int *) (dataptr + sizeof(int) + size);
-    node *newHeadptr = (node *) (newFootptr + 1);
+    /* the second block starts right after the first block's payload */
+    node *newHeadptr = (node *) (dataptr + size + sizeof(int));
 
     /* 
      * The space in second block is the remainder of space minus the size
-     * of the first block's footer and the second block's int tag in the
-     * header.
+     * of the second block's int tag in the header.
      */
-    int newSpace = space - size - 2 * sizeof(int);  
+    size_t newSpace = space - size - sizeof(int);  
 
-    /* update the int tags for both blocks */
-    headptr->space = size;
-    *newFootptr = size;
-    newHeadptr->space = newSpace;
-    *footptr = newSpace;
+    /*
+     * update the tags for both blocks; the second one follows a block that
+     * is not (yet) in use
+     */
+    headptr->tag = TAG_OF(size) | (headptr->tag & (TAG_INUSE | TAG_PREV_INUSE));
+    newHeadptr->tag = 0;
+    setFree((unsigned char *) newHeadptr, newSpace);
     return newHeadptr;
 }
 
 
 /*!
- * Helper function that will scan through free list and find a suitable block
- * to be allocated for size amount of bytes. Uses best-fit to find a block
+ * Helper function that will find a suitable block to be allocated for size
+ * amount of bytes. With INDEX_TLSF, this is a constant time lookup in the
+ * segregated bins (see tlsf.c), and with INDEX_TREE a logarithmic time
+ * lookup in the size-ordered tree (see sizetree.c) that picks the same size
+ * of block as the scan below would. With INDEX_LIST, it scans through the free
+ * list, and the rest of this comment applies. Uses best-fit to find a block
  * (see function comments for reason this is best-fit). This strategy will be
  * good for smaller amounts of blocks, as it ensures better memory utilization
  * than first fit or next fit, but is bad for situations where there are a
@@ -552,29 +1533,45 @@ node *splitBlock(node *headptr, int size)
  * which is O(n) for n = number of blocks in the memory pool. Thus, the entire
  * operation is linear in the number of blocks there are in the memory pool.
  */
-node *findHead(int size)
+node *findHead(myheap *heap, size_t size)
 {
+    if (size > MAX_SPACE)
+    {
+        return NULL; /* no block is that large */
+    }
+    /* the index works on block sizes in units */
+    unsigned int units = UNITS_OF(TAG_OF(roundSpace(size)));
+    if (heap->freeIndex == INDEX_TLSF)
+    {
+        return tlsfFind(heap, units);
+    }
+    else if (heap->freeIndex == INDEX_TREE)
+    {
+        return treeFind(heap, units);
+    }
+
     node *resultptr = NULL; 
-    int lowest; /* keep track of smallest block size accomodating request */
+    unsigned int lowest; /* keep track of smallest block fitting request */
 
     /* iterate through all free blocks */
-    for (node *headptr = freeList; headptr != NULL; headptr = headptr->next)
+    for (node *headptr = heap->freeList; headptr != NULL;
+                                 headptr = NODE_AT(heap, headptr->next))
     {
-        int space = headptr->space;
-        if (space == size) /* Perfect fit! */
+        unsigned int blockUnits = UNITS_OF(headptr->tag);
+        if (blockUnits == units) /* Perfect fit! */
         {
             resultptr = headptr;
             break;
         }
-        else if (space > size)
+        else if (blockUnits > units)
         {
             /* 
              * if it's the first block that accomodates the request, or it
              * is a working block smaller than the current best option
              */
-            if (resultptr == NULL || space < lowest)
+            if (resultptr == NULL || blockUnits < lowest)
             {
-                lowest = space;
+                lowest = blockUnits;
                 resultptr = headptr;
             }
         }
@@ -583,6 +1580,34 @@ node *findHead(int size)
 }
 
 
+/*!
+ * Finds the largest free block, for the statistics. The TLSF and tree indexes
+ * find it quickly (see tlsfLargest and treeLargest), and the list is scanned.
+ */
+node *findLargest(myheap *heap)
+{
+    if (heap->freeIndex == INDEX_TLSF)
+    {
+        return tlsfLargest(heap);
+    }
+    else if (heap->freeIndex == INDEX_TREE)
+    {
+        return treeLargest(heap);
+    }
+
+    node *resultptr = heap->freeList;
+    for (node *headptr = heap->freeList; headptr != NULL;
+                                 headptr = NODE_AT(heap, headptr->next))
+    {
+        if (UNITS_OF(headptr->tag) > UNITS_OF(resultptr->tag))
+        {
+            resultptr = headptr;
+        }
+    }
+    return resultptr;
+}
+
+
 
 /* ------------------------------------------------------------------- 
  * ------------------------------------------------------------------- 
@@ -595,60 +1620,100 @@ node *findHead(int size)
 
 /*!
  * Will take a node out of the free list and repair the links in the list,
- * useful in both allocating and coalescing free blocks.
+ * useful in both allocating and coalescing free blocks. With INDEX_TLSF the
+ * node is taken out of its bin instead, and with INDEX_TREE out of the tree.
+ * Either way the block's bytes stop counting as free.
  */
-void removeNode(node *badNode)
+void removeNode(myheap *heap, node *badNode)
 {
-    node *prevNode = badNode->prev;
-    node *nextNode = badNode->next;
+    heap->freeBytes -= SPACE_OF(badNode->tag) + sizeof(int);
+    heap->stats.freeBlocks--;
+    if (heap->freeIndex == INDEX_TLSF)
+    {
+        tlsfRemove(heap, badNode);
+        return;
+    }
+    else if (heap->freeIndex == INDEX_TREE)
+    {
+        treeRemove(heap, badNode);
+        return;
+    }
+    node *prevNode = NODE_AT(heap, badNode->prev);
+    node *nextNode = NODE_AT(heap, badNode->next);
     if (prevNode == NULL)
     {
-        freeList = nextNode; /* One would never remove the first/only node */
+        heap->freeList = nextNode; /* first node, so list starts after it */
     }
     else
     {
-        prevNode->next = nextNode;
+        prevNode->next = badNode->next;
     }
     if (nextNode != NULL)
     {
-        nextNode->prev = prevNode;
+        nextNode->prev = badNode->prev;
     }
 }
 
 
 /*!
  * Adds a new node to the beginning of the free list, which is thus constant
- * time.
+ * time. With INDEX_TLSF the node goes to the front of its bin instead, and
+ * with INDEX_TREE into its place in the tree. Either way the block's bytes
+ * start counting as free.
  */
-void addNode(node *newNode)
+void addNode(myheap *heap, node *newNode)
 {
-    node *oldFirstNode = freeList;
-    newNode->next = oldFirstNode;
-    newNode->prev = NULL;
-    freeList = newNode;
+    heap->freeBytes += SPACE_OF(newNode->tag) + sizeof(int);
+    heap->stats.freeBlocks++;
+    if (heap->freeIndex == INDEX_TLSF)
+    {
+        tlsfInsert(heap, newNode);
+        return;
+    }
+    else if (heap->freeIndex == INDEX_TREE)
+    {
+        treeInsert(heap, newNode);
+        return;
+    }
+    node *oldFirstNode = heap->freeList;
+    newNode->next = LINK_TO(heap, oldFirstNode);
+    newNode->prev = 0;
+    heap->freeList = newNode;
     if (oldFirstNode != NULL)
     {
-        oldFirstNode->prev = newNode;
+        oldFirstNode->prev = LINK_TO(heap, newNode);
     }
 }
 
 
 /*!
  * This function, given pointers to two headers for free blocks, will combine
- * the blocks and update the free list to have one bigger free block
+ * the blocks and update the free index to have one bigger free block. Blocks
+ * that together are larger than a tag can describe (in a pool larger than
+ * MAX_BLOCK_SIZE) are left as they are. Returns the header of the block
+ * headptrB ends up in.
  */
-void coalesce(node *headptrA, node *headptrB)
+node *coalesce(myheap *heap, node *headptrA, node *headptrB)
 {
+    size_t newSpace = SPACE_OF(headptrA->tag) + SPACE_OF(headptrB->tag)
+                                              + sizeof(int);
+    if (newSpace > MAX_SPACE)
+    {
+        return headptrB;
+    }
+
+    /* take both blocks out while their tags still identify them */
+    removeNode(heap, headptrA);
+    removeNode(heap, headptrB);
+    heap->stats.coalesces++;
+
     /*
      * Make a single header and footer for the aggregate block with the new
      * space
      */
-    int newSpace = headptrA->space + headptrB->space + 2 * sizeof(int);
-    headptrA->space = newSpace;
-    int *footptr = (int *) ((unsigned char *) (headptrA) + newSpace 
-                                                         + sizeof(int));
-    *footptr = newSpace;
-    removeNode(headptrB); /* update the free list */
+    setFree((unsigned char *) headptrA, newSpace);
+    addNode(heap, headptrA); /* update the free index */
+    return headptrA;
 }
 
     
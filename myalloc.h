@@ -8,23 +8,368 @@
  * All rights reserved.
  */
 
+#include <stddef.h>
 
-/*! Specifies the size of the memory pool the allocator has to work with. */
-extern int MEMORY_SIZE;
+
+/*!
+ * Specifies the size of the memory pool the default heap (used by myalloc(),
+ * myfree() and myrealloc()) has to work with.
+ */
+extern size_t MEMORY_SIZE;
+
+
+/*!
+ * If larger than MEMORY_SIZE, the default heap's pool is growable: it starts
+ * out with MEMORY_SIZE bytes and grows on demand up to MEMORY_RESERVE bytes.
+ */
+extern size_t MEMORY_RESERVE;
+
+
+/*!
+ * Whether heaps that get their pool from the system (all but those set up by
+ * myheap_init()) ask for it to be backed by huge pages of HUGE_PAGE_SIZE
+ * bytes (see hugepage.c), read whenever such a heap is set up. The pool is
+ * then HUGE_PAGE_SIZE aligned and committed in whole huge pages.
+ * myheap_huge_bytes() tells how much of it the system actually backed.
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+extern int USE_HUGE_PAGES;
 extern int counter;
 
 
-/* Struct for doubly linked list that explicit free list is implemented as */
+/*!
+ * Selects the structure used to index free blocks, read whenever a heap is set
+ * up (by init_myalloc(), myheap_init() or myheap_create()).
+ *      INDEX_LIST -- a single explicit free list searched with best-fit
+ *      INDEX_TLSF -- two-level segregated-fit bins located with bitmaps
+ *      INDEX_TREE -- a balanced tree ordered by size, searched with best-fit
+ */
+#define INDEX_LIST 0
+#define INDEX_TLSF 1
+#define INDEX_TREE 2
+extern int FREE_INDEX;
+
+
+/*!
+ * Whether heaps serve tiny requests from slabs (see slab.c), read whenever a
+ * heap is set up. Pools smaller than SLAB_MIN_PAGES pages never use slabs.
+ */
+extern int USE_SLABS;
+
+
+/*!
+ * Requests of at least LARGE_THRESHOLD bytes get a mapping of their own from
+ * the system instead of a block in the pool (see large.c), read whenever a
+ * heap is set up; 0 turns this off. A heap's threshold can be changed at any
+ * time through its largeThreshold field.
+ */
+extern size_t LARGE_THRESHOLD;
+
+
+/*!
+ * Every payload handed out is aligned to ALIGNMENT bytes, enough for any
+ * object type (the alignment of max_align_t). Blocks are laid out so that
+ * this holds without per-block padding: see myalloc.c.
+ */
+#define ALIGNMENT 16
+
+
+/*!
+ * How much checking every heap operation does (see verify.c), read whenever
+ * a heap is set up; the MYALLOC_VERIFY environment variable (off, fast,
+ * sampled or full) overrides it. A heap's level can be changed at any time
+ * through its verifyLevel field. A failed check reports the corruption and
+ * aborts.
+ *      VERIFY_OFF -- no checking
+ *      VERIFY_FAST -- constant time checks of the byte counters and of the
+ *          block operated on and its neighbours (the default)
+ *      VERIFY_SAMPLED -- VERIFY_FAST, plus a walk of every block once every
+ *          VERIFY_INTERVAL operations
+ *      VERIFY_FULL -- a walk of every block after every operation
+ */
+#define VERIFY_OFF 0
+#define VERIFY_FAST 1
+#define VERIFY_SAMPLED 2
+#define VERIFY_FULL 3
+#define VERIFY_INTERVAL 1024
+extern int VERIFY_LEVEL;
+
+
+/*!
+ * Whether heaps set up from now on turn requests down without a word: a
+ * request a heap cannot serve just returns NULL (as it always does), with no
+ * diagnostic on stderr. Read whenever a heap is set up, and changeable
+ * afterwards through a heap's quiet field. Off by default; libmyalloc.so
+ * turns it on, since a drop-in malloc must fail quietly.
+ */
+extern int QUIET_FAILURES;
+
+
+/*
+ * Block tags: each block starts with an unsigned int header tag holding the
+ * block's total size (header included) in ALIGNMENT units, above two flag
+ * bits: TAG_INUSE while the block is allocated, and TAG_PREV_INUSE while the
+ * block before it is (or there is none). Free blocks repeat their size, with
+ * no flags, in a footer tag in their last four bytes; allocated blocks have
+ * no footer (see myalloc.c). TAG_OF gives the flagless tag of a block with a
+ * payload of space bytes, UNITS_OF the size in units a tag holds, and
+ * SPACE_OF the payload size of a block with the given tag. Counting in units
+ * lets the 30 bits left describe a block of up to MAX_BLOCK_SIZE bytes. A
+ * pool is not bounded by that, being a run of blocks, but by the 32 bit free
+ * links, which count units from its start, to MAX_POOL_SIZE bytes.
+ */
+#define TAG_INUSE 1
+#define TAG_PREV_INUSE 2
+#define TAG_OF(space) \
+        ((unsigned int) (((space) + sizeof(int)) / ALIGNMENT) << 2)
+#define UNITS_OF(tag) ((tag) >> 2)
+#define SPACE_OF(tag) ((size_t) UNITS_OF(tag) * ALIGNMENT - sizeof(int))
+#define MAX_BLOCK_SIZE ((size_t) 0x3fffffff * ALIGNMENT)   /* about 16 GB */
+#define MAX_SPACE (MAX_BLOCK_SIZE - sizeof(int))  /* the most a block holds */
+#define MAX_POOL_SIZE ((size_t) 0xffffffff * ALIGNMENT)    /* about 64 GB */
+
+
+/*
+ * Struct for doubly linked list that explicit free list is implemented as
+ * (with INDEX_TREE, next and prev are the right and left children instead).
+ * The links are 32 bit offsets from the start of the pool, in ALIGNMENT
+ * units and off by one so that 0 is NULL: NODE_AT and LINK_TO convert them
+ * (evaluating their last argument twice).
+ * The whole struct is a minimum block, so level overlaps the footer of one
+ * and is only there in blocks the tree holds, which are all larger.
+ */
 typedef struct node
 {
-    int space;
-    struct node *next;
-    struct node *prev;
+    unsigned int tag;  /* the block's header tag */
+    unsigned int next;
+    unsigned int prev;
+    int level;         /* AA tree level, only used by INDEX_TREE */
 } node;
 
+#define NODE_AT(heap, link) ((link) == 0 ? NULL \
+        : (node *) ((heap)->mem + (size_t) ((link) - 1) * ALIGNMENT))
+#define LINK_TO(heap, n) ((n) == NULL ? 0 : (unsigned int) \
+        (((unsigned char *) (n) - (heap)->mem) / ALIGNMENT + 1))
+
+
+/*
+ * Bin geometry of the TLSF index (see tlsf.c), which bins blocks by their size
+ * in units: the first level splits sizes by powers of two, the second level
+ * splits each power of two range into TLSF_SL_COUNT equal pieces. Sizes below
+ * TLSF_SL_COUNT units all land in first level 0, one bin per size.
+ */
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT (32 - TLSF_SL_LOG2) /* enough for any size in units */
+#define TLSF_SCAN_LIMIT 8 /* most blocks of its own bin a request looks at */
+
+
+/*
+ * Slab geometry (see slab.c): requests of up to SLAB_MAX_SIZE bytes are
+ * served from SLAB_SIZE byte slabs, in one of SLAB_CLASSES object sizes.
+ */
+#define SLAB_SIZE 4096
+#define SLAB_CLASSES 4
+#define SLAB_MAX_SIZE 64
+#define SLAB_MIN_PAGES 64
+
+
+/*
+ * Page map flags. Pools of at least SLAB_MIN_PAGES pages keep a byte of these
+ * for each SLAB_SIZE page, for the slabs and for the scavenger (scavenge.c).
+ */
+#define PAGE_SLAB 1     /* the page is a slab */
+#define PAGE_AGED 2     /* free already at the last scavenger pass */
+#define PAGE_PURGED 4   /* contents given back to the system */
+
+
+/*
+ * Statistics of a heap (see stats.c). The event counters and block counts
+ * are kept up to date by every operation; the rest are filled in when the
+ * statistics are taken. requests is a histogram of request sizes: bucket 0
+ * counts requests for 0 bytes, and bucket i the sizes from 2^(i-1) up to
+ * (not including) 2^i, which STATS_BUCKET computes.
+ */
+#define STATS_BUCKETS 65
+#define STATS_BUCKET(size) ((size) == 0 ? 0 \
+        : (int) (sizeof(long) * 8) - __builtin_clzl(size))
+#define STATS_TEXT 0
+#define STATS_JSON 1
+
+typedef struct heap_stats
+{
+    /* the pool, as of when the statistics are taken (headers included) */
+    size_t poolBytes;
+    size_t allocBytes;
+    size_t allocBlocks;  /* kept up to date (slabs count as one block each) */
+    size_t freeBytes;
+    size_t freeBlocks;   /* kept up to date: the length of the free index */
+    size_t largestFree;  /* bytes in the largest free block */
+    size_t largeBytes;   /* mapped for large objects */
+    double fragmentation; /* see myheap_fragmentation */
+
+    /* events since the heap was set up */
+    size_t splits;
+    size_t coalesces;
+    size_t failedRequests;
+    size_t reallocInPlace;
+    size_t reallocMoved;
+    size_t requests[STATS_BUCKETS];
+} heap_stats;
+
+
+/*
+ * A heap: one memory pool, and the free index over it. Every allocator
+ * operation works against a heap, so independent pools never share state.
+ */
+typedef struct myheap
+{
+    unsigned char *buf;  /* the buffer the heap was set up over */
+    unsigned char *mem;  /* start of the memory pool (first block) */
+    size_t size;         /* bytes of blocks in the pool (end tag aside) */
+    size_t reserved;     /* growable: address space reserved at buf, else 0 */
+    size_t committed;    /* bytes at buf usable so far */
+    int owned;           /* made by myheap_create, so destroy frees it */
+    int hugePages;       /* pool asked for huge pages (see hugepage.c) */
+    int freeIndex;       /* which index is in use, one of INDEX_* */
+
+    /* running totals of block bytes (headers included), and verification */
+    size_t allocBytes;   /* in allocated blocks */
+    size_t freeBytes;    /* in blocks in the free index */
+    int verifyLevel;     /* one of VERIFY_* */
+    int quiet;           /* no diagnostics for requests turned down */
+    unsigned int opCount; /* operations since set up, for VERIFY_SAMPLED */
+
+    node *freeList;      /* INDEX_LIST: start of explicit free list */
+    node *treeRoot;      /* INDEX_TREE: root of size-ordered tree */
+    node *treeSmall;     /* INDEX_TREE: minimum blocks, kept on a list */
+
+    /* INDEX_TLSF: heads of the bin lists, and which bins are non-empty */
+    node *bins[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    unsigned int flBitmap;
+    unsigned int slBitmap[TLSF_FL_COUNT];
+
+    /* flags for each page of the pool, NULL if the pool is too small */
+    unsigned char *pageMap;
+    unsigned char *firstPage;  /* page containing mem */
+    size_t numPages;
+
+    /* slabs, which need the page map */
+    int useSlabs;
+    struct slab *partialSlabs[SLAB_CLASSES]; /* slabs with free objects */
+
+    /* scavenger, which needs the page map too */
+    size_t purgedBytes;  /* bytes of free blocks given back to the system */
+    size_t freedBytes;   /* bytes freed since the last scavenger pass */
+
+    /* large objects, each mapped on its own (see large.c) */
+    size_t largeThreshold; /* least request mapped directly, 0 for none */
+    struct large **largeTable; /* hash set of their headers, or NULL */
+    size_t largeSlots;   /* slots in largeTable, a power of two or 0 */
+    size_t largeCount;   /* large objects, i.e. headers in largeTable */
+    size_t largeBytes;   /* bytes mapped for them, headers included */
+
+    heap_stats stats;    /* counters, see heap_stats */
+} myheap;
+
+
+/* ------------------------------------------------------------------- 
+ * Heap functions
+ * ------------------------------------------------------------------- 
+ */
+
+/* Sets up a heap over a caller-provided struct and buffer of size bytes. */
+void myheap_init(myheap *heap, unsigned char *buf, size_t size);
+
+
+/* Creates a heap with its own pool of size bytes, NULL if out of memory. */
+myheap *myheap_create(size_t size);
+
+
+/*
+ * Creates a heap whose pool starts at size bytes and grows on demand up to
+ * maxSize bytes, NULL if out of memory.
+ */
+myheap *myheap_create_growable(size_t size, size_t maxSize);
+
+
+/* Cleans up a heap, freeing its pool too if it made it. */
+void myheap_destroy(myheap *heap);
+
+
+/* Attempt to allocate a chunk of memory of "size" bytes from heap. */
+unsigned char *myheap_alloc(myheap *heap, size_t size);
+
+
+/* Free a pointer previously allocated from heap. */
+void myheap_free(myheap *heap, unsigned char *oldptr);
+
+
+/*
+ * Gives the memory of heap's free blocks back to the system, returning how
+ * many bytes that released.
+ */
+size_t myheap_trim(myheap *heap);
+
+
+/*
+ * Returns how many bytes of heap's pool are backed by huge pages, or -1 if
+ * the system does not say.
+ */
+long myheap_huge_bytes(myheap *heap);
+
+
+/* Reallocate a pointer previously allocated from heap, as myrealloc does. */
+unsigned char *myheap_realloc(myheap *heap, unsigned char *oldptr,
+                                                   size_t size);
+
+
+/* Allocate from heap with a payload aligned to alignment (a power of two). */
+unsigned char *myheap_alloc_aligned(myheap *heap, size_t alignment,
+                                                   size_t size);
+
+
+/*
+ * Allocates count blocks of size bytes from heap into out, returning how many
+ * it could.
+ */
+int myheap_alloc_batch(myheap *heap, size_t size, int count,
+                                     unsigned char **out);
+
+
+/* Frees count pointers from heap, sorting ptrs by address in place. */
+void myheap_free_batch(myheap *heap, unsigned char **ptrs, int count);
+
+
+/* Takes a snapshot of heap's statistics. */
+void myheap_stats(myheap *heap, heap_stats *stats);
+
+
+/*
+ * Returns how fragmented heap's free memory is, from 0 (all in one block) to
+ * nearly 1 (scattered over many small blocks).
+ */
+double myheap_fragmentation(myheap *heap);
+
+
+/*
+ * Writes statistics into buf as text or JSON (STATS_TEXT or STATS_JSON),
+ * snprintf style: returns the length of the whole report, which is cut short
+ * if that is size bytes or more.
+ */
+int myheap_format_stats(const heap_stats *stats, int format, char *buf,
+                                                 size_t size);
+
+
+/*
+ * Writes a binary snapshot of heap's blocks to the file descriptor fd (see
+ * dump.h), returning 0, or -1 if it could not be written.
+ */
+int myheap_dump(myheap *heap, int fd);
+
 
 /* ------------------------------------------------------------------- 
- * Allocator functions
+ * Allocator functions (all work against the default heap)
  * ------------------------------------------------------------------- 
  */
 
@@ -33,7 +378,11 @@ void init_myalloc();
 
 
 /* Attempt to allocate a chunk of memory of "size" bytes. */
-unsigned char * myalloc(int size);
+unsigned char * myalloc(size_t size);
+
+
+/* Attempt to allocate "size" bytes aligned to alignment (a power of two). */
+unsigned char *myalloc_aligned(size_t alignment, size_t size);
 
 
 /* Free a previously allocated pointer. */
@@ -45,7 +394,39 @@ void myfree(unsigned char *oldptr);
  * and leaves data unchanged. If it works, returns a pointer to the new
  * location of the data
  */
-unsigned char *myrealloc(unsigned char *oldptr, int size);
+unsigned char *myrealloc(unsigned char *oldptr, size_t size);
+
+
+/* Allocate count blocks of "size" bytes into out, returns how many it could. */
+int myalloc_batch(size_t size, int count, unsigned char **out);
+
+
+/* Free count previously allocated pointers, sorting ptrs in place. */
+void myfree_batch(unsigned char **ptrs, int count);
+
+
+/* Takes a snapshot of the default heap's statistics, as myheap_stats. */
+void myalloc_stats(heap_stats *stats);
+
+
+/* Returns the default heap's fragmentation index, as myheap_fragmentation. */
+double myalloc_fragmentation();
+
+
+/* Writes a snapshot of the default heap to fd, as myheap_dump. */
+int myalloc_dump(int fd);
+
+
+/* Gives free memory of the default heap back to the system, as myheap_trim. */
+size_t myalloc_trim();
+
+
+/* Returns how much of the default heap is on huge pages (myheap_huge_bytes) */
+long myalloc_huge_bytes();
+
+
+/* Returns the usable size of an allocation from the default heap. */
+size_t myalloc_usable_size(unsigned char *ptr);
 
 
 /* Clean up the allocator and memory pool state. */
@@ -58,23 +439,41 @@ void close_myalloc();
  */
 
 /* 
- * Sanity check -- Return the sum of allocated and free memory (infinite loop if
- * last block doesn't end where memory pool ends)
+ * Sanity check -- Return the sum of allocated and free memory, from the
+ * running totals
+ */
+size_t checkMem(myheap *heap);
+
+
+/*
+ * Returns the usable size of the allocation at ptr (a block, slab object or
+ * large object)
  */
-int checkMem();
+size_t payloadSize(myheap *heap, unsigned char *ptr);
 
 
 /*
  * Validity check for an address to myfree. Will return 0 for many invalid
  * addresses, will return 1 for (most likely) valid addresses
  */
-int isValid(unsigned char *oldptr);
+int isValid(myheap *heap, unsigned char *oldptr);
 
 
 /*
- * Scans through the free list to find a suitable block using best-fit
+ * Finds a suitable free block using the index selected by FREE_INDEX
  */
-node *findHead(int size);
+node *findHead(myheap *heap, size_t size);
+
+
+/* Finds the largest free block in the free index, or NULL if there is none. */
+node *findLargest(myheap *heap);
+
+
+/*
+ * Allocates a block whose payload is aligned to alignment (a power of two of
+ * at least ALIGNMENT), returning the leading slack to the free index
+ */
+unsigned char *allocAligned(myheap *heap, size_t alignment, size_t size);
 
 
 /*
@@ -82,7 +481,7 @@ node *findHead(int size);
  * will cut the block, set the header and footer tags, and
  * return a node pointer to the new block made
  */
-node *splitBlock(node *headptr, int size);
+node *splitBlock(node *headptr, size_t size);
 
 
 /* ------------------------------------------------------------------- 
@@ -91,16 +490,19 @@ node *splitBlock(node *headptr, int size);
  */
 
 /*
- * Removes a node in the free list (links the nodes before and
- * after together)
+ * Removes a node from the free index (for the list, links the nodes before
+ * and after together)
  */
-void removeNode(node *badNode);
+void removeNode(myheap *heap, node *badNode);
 
 
-/* Adds a node to the beginning of the free list */
-void addNode(node *newNode);
+/* Adds a node to the free index (for the list, to its beginning) */
+void addNode(myheap *heap, node *newNode);
 
 
-/* Coalesces two nodes and update free list */
-void coalesce(node *headptrA, node *headptrB);
+/*
+ * Coalesces two nodes and updates the free index, unless the result would be
+ * too large for a tag; returns the header of the block headptrB is now in
+ */
+node *coalesce(myheap *heap, node *headptrA, node *headptrB);
 
@@ -0,0 +1,287 @@
+/*! \file
+ * Implementation of hardware performance counters, on Linux's
+ * perf_event_open.
+ *
+ * The events are opened as one group, counting user space only (so that
+ * they work at the default perf_event_paranoid setting, and the read system
+ * calls do not count against the region), and all read by a single read of
+ * the group's leader. Events the machine has no counter for are left out,
+ * and so are any the processor cannot count at the same time as the rest,
+ * found by checking that the group actually got to run. Containers and
+ * virtual machines often have no counters at all, in which case perfStart
+ * opens nothing and returns 0, and every region is skipped.
+ *
+ * A read costs a system call, so counted regions take far longer than they
+ * otherwise would; the counts themselves, being of user space only, are
+ * hardly disturbed.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfcount.h"
+
+
+#define CACHE_EVENT(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+                            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+const char *PERF_EVENT_NAMES[PERF_EVENTS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses",
+    "branch_misses"
+};
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} events[PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+int perfActive;
+
+static int started;            /* whether counters are open */
+static int leader = -1;        /* the group's leader, -1 if none */
+static int fds[PERF_EVENTS];   /* -1 for events left out */
+static int slots[PERF_EVENTS]; /* where each event comes in a group read */
+static int counted;            /* events in the group */
+static pthread_t owner;        /* the thread counted */
+static perf_totals totals[PERF_REGIONS];
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+static int openEvent(int e, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[e].type;
+    attr.config = events[e].config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                     | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+
+static void closeAll()
+{
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        if (fds[e] >= 0 && fds[e] != leader)
+        {
+            close(fds[e]);
+        }
+        fds[e] = -1;
+    }
+    if (leader >= 0)
+    {
+        close(leader);
+    }
+    leader = -1;
+    counted = 0;
+}
+
+
+/*!
+ * Reads the group into values, indexed by event (events left out read 0).
+ * Returns 0, or -1 if the read failed or the group has not been running.
+ */
+static int readGroup(uint64_t *values)
+{
+    uint64_t buf[3 + PERF_EVENTS]; /* count, time enabled, time running */
+    ssize_t want = (3 + counted) * sizeof(uint64_t);
+    if (read(leader, buf, want) != want || buf[2] == 0)
+    {
+        return -1;
+    }
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        values[e] = fds[e] >= 0 ? buf[3 + slots[e]] : 0;
+    }
+    return 0;
+}
+
+
+/*!
+ * Opens the group with the events flagged in want, checking that it runs.
+ * Returns 0, or -1 with everything closed again if it does not.
+ */
+static int openGroup(const int *want)
+{
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        fds[e] = -1;
+    }
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        if (!want[e])
+        {
+            continue;
+        }
+        fds[e] = openEvent(e, leader);
+        if (fds[e] < 0)
+        {
+            closeAll();
+            return -1;
+        }
+        if (leader < 0)
+        {
+            leader = fds[e];
+        }
+        slots[e] = counted++;
+    }
+    if (leader < 0)
+    {
+        return -1;
+    }
+
+    /* a group the processor cannot fit never runs */
+    uint64_t values[PERF_EVENTS];
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    for (volatile int spin = 0; spin < 100000; spin++)
+        ;
+    if (readGroup(values) != 0)
+    {
+        closeAll();
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Counter functions
+ * -------------------------------------------------------------------
+ */
+
+
+int perfStart()
+{
+    if (started)
+    {
+        perfStop();
+    }
+
+    /* first find the events the machine has at all */
+    int want[PERF_EVENTS], any = 0, err = ENOENT;
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        int fd = openEvent(e, -1);
+        want[e] = fd >= 0;
+        if (fd >= 0)
+        {
+            close(fd);
+            any = 1;
+        }
+        else
+        {
+            err = errno;
+        }
+    }
+
+    /* then drop events from the end until the rest fit together */
+    while (any && openGroup(want) != 0)
+    {
+        any = 0;
+        for (int e = PERF_EVENTS - 1; e >= 0; e--)
+        {
+            if (want[e])
+            {
+                want[e] = 0;
+                break;
+            }
+        }
+        for (int e = 0; e < PERF_EVENTS; e++)
+        {
+            any |= want[e];
+        }
+    }
+    if (!any)
+    {
+        errno = err;
+        return 0;
+    }
+
+    memset(totals, 0, sizeof(totals));
+    for (int r = 0; r < PERF_REGIONS; r++)
+    {
+        for (int e = 0; e < PERF_EVENTS; e++)
+        {
+            totals[r].counted[e] = fds[e] >= 0;
+        }
+    }
+    owner = pthread_self();
+    started = 1;
+    perfActive = 1;
+    return counted;
+}
+
+
+void perfStop()
+{
+    if (started)
+    {
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        closeAll();
+    }
+    started = 0;
+    perfActive = 0;
+}
+
+
+void perfPause(int paused)
+{
+    perfActive = started && !paused;
+}
+
+
+int perfBegin(perf_mark *mark)
+{
+    if (!perfActive || !pthread_equal(pthread_self(), owner))
+    {
+        return 0;
+    }
+    return readGroup(mark->values) == 0;
+}
+
+
+void perfEnd(int region, perf_mark *mark)
+{
+    uint64_t values[PERF_EVENTS];
+    if (readGroup(values) != 0)
+    {
+        return;
+    }
+    totals[region].calls++;
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        totals[region].values[e] += values[e] - mark->values[e];
+    }
+}
+
+
+void perfTotals(int region, perf_totals *out)
+{
+    *out = totals[region];
+}
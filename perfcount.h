@@ -0,0 +1,78 @@
+/*! \file
+ * Declarations for hardware performance counters around the allocator's hot
+ * paths. Once perfStart has opened the counters, each counted region (a
+ * myalloc, myfree or myrealloc call timed by the caller, or the free block
+ * search inside the allocator) reads them before and after, and adds what
+ * they moved by to the totals of its kind, so that the costs of an operation
+ * can be averaged over many. Only the thread that called perfStart is
+ * counted, and nothing is counted at all until it does, which costs the
+ * allocator a test of perfActive.
+ */
+
+#include <stdint.h>
+
+
+#define PERF_ALLOC 0
+#define PERF_FREE 1
+#define PERF_REALLOC 2
+#define PERF_SEARCH 3  /* findBlock, including growing the heap */
+#define PERF_REGIONS 4
+
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_L1D_MISSES 2
+#define PERF_LLC_MISSES 3
+#define PERF_DTLB_MISSES 4
+#define PERF_BRANCH_MISSES 5
+#define PERF_EVENTS 6
+
+/* Names of the events, as column headings. */
+extern const char *PERF_EVENT_NAMES[PERF_EVENTS];
+
+/* Nonzero while counters are open and counting; see perfBegin. */
+extern int perfActive;
+
+typedef struct perf_mark
+{
+    uint64_t values[PERF_EVENTS];
+} perf_mark;
+
+typedef struct perf_totals
+{
+    uint64_t calls;
+    uint64_t values[PERF_EVENTS];
+    int counted[PERF_EVENTS];  /* 0 for events this machine cannot count */
+} perf_totals;
+
+
+/*
+ * Opens the counters for the calling thread, as many of the events as the
+ * machine (or container) allows, and starts counting with zeroed totals.
+ * Returns the number of events counted, 0 if there are none, in which case
+ * nothing is counted and errno says why.
+ */
+int perfStart();
+
+
+/* Stops counting and closes the counters. */
+void perfStop();
+
+
+/* Stops counting for a while (paused nonzero), or starts again. */
+void perfPause(int paused);
+
+
+/*
+ * Marks the start of a region, returning 0 if it is not to be counted
+ * (counters closed or paused, or another thread). Callers test perfActive
+ * first, so that this is not even called otherwise.
+ */
+int perfBegin(perf_mark *mark);
+
+
+/* Adds what the counters moved by since perfBegin to the region's totals. */
+void perfEnd(int region, perf_mark *mark);
+
+
+/* Copies the totals of a region, PERF_ALLOC to PERF_SEARCH. */
+void perfTotals(int region, perf_totals *totals);
@@ -0,0 +1,412 @@
+/*! \file
+ * A drop-in replacement for the C library's allocator, built as
+ * libmyalloc.so, so that unmodified programs can be run on this allocator
+ * with LD_PRELOAD=./libmyalloc.so.
+ *
+ * Heap: every call goes to the default heap (myalloc, myfree, myrealloc),
+ * under one lock, since a single heap is not thread-safe. The heap is set
+ * up by the first call, as a growable pool reserving PRELOAD_RESERVE bytes
+ * of address space, so a program only takes the memory it uses. Large
+ * requests get mappings of their own as usual. The heap is quiet
+ * (QUIET_FAILURES): a request it cannot serve fails with errno set to
+ * ENOMEM, as the C library's would, and writes nothing to the program's
+ * stderr.
+ *
+ * Bootstrap: setting up the heap, or reporting an error, may itself call
+ * malloc (the C library does so for its own bookkeeping). Such a call comes
+ * from the thread already holding the lock, which is why the lock is a
+ * recursive one, and is served from a small static buffer instead of the
+ * heap, which is in the middle of an operation. Bootstrap memory is never
+ * reused: freeing it does nothing, and reallocating it moves it to the heap.
+ *
+ * Nested calls: any call made from inside another (by the C library, as
+ * above, or by a signal handler) leaves the heap alone. Allocations come from
+ * the bootstrap buffer, so they fail only once it runs out. Freeing a block
+ * of the heap is deferred: the block goes on a list, linked through its
+ * payload, and is freed when the outermost call finishes. Reallocating one
+ * moves it to the bootstrap buffer and defers freeing the old block. Its
+ * size, for that and for malloc_usable_size, is read from the block itself,
+ * which nothing else changes while the block is allocated.
+ *
+ * Fork: the lock is taken around fork, so that the child never inherits a
+ * heap half way through an operation of another thread. The child, whose
+ * only thread is not the lock's recorded owner, starts a fresh lock.
+ *
+ * Alignment: everything handed out, whatever the function and however small,
+ * is aligned to at least ALIGNMENT (16 bytes), as the C library's malloc is
+ * for max_align_t. Every allocating function goes through allocate() to make
+ * sure of it.
+ *
+ * Only the allocation functions are exported from the library; everything
+ * else is built with hidden visibility, so that nothing a program defines
+ * can take the place of the allocator's own globals. The exported functions
+ * never call each other by name either, since such calls could bind to
+ * another library's allocator.
+ */
+
+#define _GNU_SOURCE /* PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP */
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "myalloc.h"
+
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define PRELOAD_POOL_SIZE (1024 * 1024)      /* pool committed at first */
+#define PRELOAD_RESERVE ((size_t) 8 << 30)   /* most the pool grows to */
+#define BOOT_SIZE (64 * 1024)                /* bootstrap buffer */
+
+/* the C library promises memory aligned for any type, max_align_t included */
+_Static_assert(ALIGNMENT >= _Alignof(max_align_t),
+               "ALIGNMENT is less than max_align_t needs");
+
+static pthread_mutex_t lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int ready;  /* whether the default heap has been set up */
+static int depth;  /* calls under way in the thread holding the lock */
+static void *deferred;  /* heap blocks freed by nested calls, linked */
+
+static _Alignas(ALIGNMENT) unsigned char bootBuf[BOOT_SIZE];
+static size_t bootUsed;  /* bytes of bootBuf handed out */
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+static void forkPrepare()
+{
+    pthread_mutex_lock(&lock);
+}
+
+
+static void forkParent()
+{
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void forkChild()
+{
+    pthread_mutex_t fresh = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+    lock = fresh;
+}
+
+
+/*!
+ * Takes the lock, setting up the heap on the very first call. Returns 1 if
+ * the caller may use the heap, or 0 for a call made from inside another one
+ * (see the file comment), which has to make do with bootstrap memory. Either
+ * way, leave() must be called afterwards.
+ */
+static int enter()
+{
+    pthread_mutex_lock(&lock);
+    if (depth++ > 0)
+    {
+        return 0;
+    }
+    if (!ready)
+    {
+        MEMORY_SIZE = PRELOAD_POOL_SIZE;
+        MEMORY_RESERVE = PRELOAD_RESERVE;
+        QUIET_FAILURES = 1;
+        init_myalloc();
+        pthread_atfork(forkPrepare, forkParent, forkChild);
+        ready = 1;
+    }
+    return 1;
+}
+
+
+static void leave()
+{
+    /* the outermost call frees what the calls inside it could not */
+    while (depth == 1 && deferred != NULL)
+    {
+        void *ptr = deferred;
+        deferred = *(void **) ptr;
+        myfree((unsigned char *) ptr);
+    }
+    depth--;
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*!
+ * Hands out size bytes of the bootstrap buffer, aligned to alignment (at
+ * least ALIGNMENT), with the size kept in the word in front of them. Returns
+ * NULL once the buffer runs out. The caller must hold the lock.
+ */
+static void *bootAlloc(size_t alignment, size_t size)
+{
+    if (size > BOOT_SIZE || alignment > BOOT_SIZE)
+    {
+        return NULL;
+    }
+    uintptr_t start = (uintptr_t) bootBuf + bootUsed + sizeof(size_t);
+    start = (start + alignment - 1) & ~(alignment - 1);
+    size_t used = start - (uintptr_t) bootBuf + size;
+    if (used > BOOT_SIZE)
+    {
+        return NULL;
+    }
+    ((size_t *) start)[-1] = size;
+    bootUsed = used;
+    return (void *) start;
+}
+
+
+static int isBoot(void *ptr)
+{
+    return (unsigned char *) ptr >= bootBuf
+        && (unsigned char *) ptr < bootBuf + BOOT_SIZE;
+}
+
+
+static size_t bootSize(void *ptr)
+{
+    return ((size_t *) ptr)[-1];
+}
+
+
+/*!
+ * Allocates size bytes aligned to alignment (a power of two), and never to
+ * less than ALIGNMENT, from the heap or, inside another call, from the
+ * bootstrap buffer. Every allocating function comes through here. Sets errno
+ * and returns NULL if there is no memory to be had.
+ */
+static void *allocate(size_t alignment, size_t size)
+{
+    void *resultptr;
+    if (alignment < ALIGNMENT)
+    {
+        alignment = ALIGNMENT;
+    }
+    if (enter())
+    {
+        resultptr = myalloc_aligned(alignment, size);
+    }
+    else
+    {
+        resultptr = bootAlloc(alignment, size);
+    }
+    leave();
+    if (resultptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return resultptr;
+}
+
+
+static int isPowerOf2(size_t alignment)
+{
+    return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
+
+
+/*!
+ * Puts a block of the heap on the deferred list, for a nested call. Every
+ * payload has room for the link. The caller must hold the lock.
+ */
+static void defer(void *ptr)
+{
+    *(void **) ptr = deferred;
+    deferred = ptr;
+}
+
+
+/*!
+ * Frees a block of the heap, or does nothing for NULL or bootstrap memory.
+ */
+static void release(void *ptr)
+{
+    if (ptr == NULL || isBoot(ptr))
+    {
+        return;
+    }
+    if (enter())
+    {
+        myfree((unsigned char *) ptr);
+    }
+    else
+    {
+        defer(ptr);
+    }
+    leave();
+}
+
+
+
+/* -------------------------------------------------------------------
+ * The C library's allocation functions
+ * -------------------------------------------------------------------
+ */
+
+
+EXPORT void *malloc(size_t size)
+{
+    return allocate(ALIGNMENT, size);
+}
+
+
+EXPORT void free(void *ptr)
+{
+    release(ptr);
+}
+
+
+EXPORT void *calloc(size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *resultptr = allocate(ALIGNMENT, total);
+    if (resultptr != NULL)
+    {
+        memset(resultptr, 0, total);
+    }
+    return resultptr;
+}
+
+
+/*!
+ * Like the C library's, a realloc to 0 bytes frees the block and returns
+ * NULL. Bootstrap memory moves to the heap whatever the new size, and a
+ * nested call moves a heap block to the bootstrap buffer.
+ */
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return allocate(ALIGNMENT, size);
+    }
+    if (isBoot(ptr))
+    {
+        void *newptr = allocate(ALIGNMENT, size);
+        if (newptr != NULL)
+        {
+            size_t oldSize = bootSize(ptr);
+            memcpy(newptr, ptr, oldSize < size ? oldSize : size);
+        }
+        return newptr;
+    }
+    if (size == 0)
+    {
+        release(ptr);
+        return NULL;
+    }
+
+    void *newptr;
+    if (enter())
+    {
+        newptr = myrealloc((unsigned char *) ptr, size);
+    }
+    else
+    {
+        newptr = bootAlloc(ALIGNMENT, size);
+        if (newptr != NULL)
+        {
+            size_t oldSize = myalloc_usable_size((unsigned char *) ptr);
+            memcpy(newptr, ptr, oldSize < size ? oldSize : size);
+            defer(ptr);
+        }
+    }
+    leave();
+    if (newptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return newptr;
+}
+
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (!isPowerOf2(alignment) || alignment % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+    void *resultptr = allocate(alignment, size);
+    if (resultptr == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = resultptr;
+    return 0;
+}
+
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!isPowerOf2(alignment))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(alignment, size);
+}
+
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    if (!isPowerOf2(alignment))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(alignment, size);
+}
+
+
+/*!
+ * valloc and pvalloc are not asked for by new code, but the C library's own
+ * would hand out memory that free could not take back, so they are here too.
+ */
+EXPORT void *valloc(size_t size)
+{
+    return allocate(sysconf(_SC_PAGESIZE), size);
+}
+
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - pageSize)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return allocate(pageSize, (size + pageSize - 1) & ~(pageSize - 1));
+}
+
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    if (isBoot(ptr))
+    {
+        return bootSize(ptr);
+    }
+    /* reading the size is safe even inside another call */
+    enter();
+    size_t size = myalloc_usable_size((unsigned char *) ptr);
+    leave();
+    return size;
+}
@@ -0,0 +1,493 @@
+/*! \file
+ * An allocation recorder, built as librecord.so: running a program with
+ * LD_PRELOAD=./librecord.so writes every malloc, free and realloc it makes
+ * to a trace (see trace.h), named by MYALLOC_TRACE or else myalloc.trace,
+ * which testmyalloc -t can replay against this allocator. A %p in the name
+ * becomes the process id, which keeps the programs a recorded one runs from
+ * overwriting its trace. The program still runs on the C library's
+ * allocator, reached through its __libc_ entry points, so recording changes
+ * nothing but speed.
+ *
+ * Ids: each live pointer is given an id, kept in a hash table from pointer
+ * to id, and freed ids are handed out again last-freed first, so ids never
+ * exceed the most blocks live at once. Replay can then keep its blocks in an
+ * array indexed by id. The table and the list of free ids are mapped with
+ * mmap, never malloc'ed, so the recorder never calls back into itself.
+ *
+ * calloc is recorded as an allocation of the whole array, and the aligned
+ * allocation functions as plain allocations; pointers the recorder has not
+ * seen (from valloc, or from before it was loaded) are passed through
+ * unrecorded. Every call is recorded under one lock, held across the C
+ * library's free and realloc so that an address is never handed out again
+ * before the recorder has forgotten it. Records are gathered in a buffer
+ * written out when full and when the program exits; a child of fork stops
+ * recording, since it would write into its parent's trace.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define RECORD_BUFFER (64 * 1024)  /* bytes of records written at a time */
+#define TABLE_MIN 4096             /* slots in the first hash table */
+
+/* The C library's allocator, under the names it exports for this purpose. */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+typedef struct slot
+{
+    uintptr_t ptr;  /* 0 for an empty slot */
+    uint64_t id;
+} slot;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int started;      /* whether the trace has been opened */
+static int traceFd = -1; /* -1 when not recording */
+
+static unsigned char buffer[RECORD_BUFFER];
+static size_t buffered;
+static uint64_t lastThread;  /* thread of the last record */
+
+static slot *table;
+static size_t tableSlots;  /* a power of two */
+static size_t tableUsed;
+
+static uint64_t *freeIds;
+static size_t freeIdCount, freeIdSlots;
+static uint64_t nextId;
+
+static uint64_t threadCount;
+static __thread uint64_t threadNumber __attribute__((tls_model("initial-exec")));
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+static void *mapMemory(size_t bytes)
+{
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+
+/*!
+ * Writes out the buffered records. The caller must hold the lock.
+ */
+static void flush()
+{
+    unsigned char *at = buffer;
+    while (traceFd >= 0 && buffered > 0)
+    {
+        ssize_t written = write(traceFd, at, buffered);
+        if (written < 0 && errno != EINTR)
+        {
+            close(traceFd);
+            traceFd = -1;
+        }
+        else if (written > 0)
+        {
+            at += written;
+            buffered -= written;
+        }
+    }
+    buffered = 0;
+}
+
+
+/*!
+ * Opens the trace on the first call. The caller must hold the lock.
+ */
+static void start()
+{
+    if (started)
+    {
+        return;
+    }
+    started = 1;
+    const char *name = getenv("MYALLOC_TRACE");
+    if (name == NULL)
+    {
+        name = "myalloc.trace";
+    }
+
+    /* copy the name, putting the process id in place of a %p */
+    char path[4096], digits[24];
+    size_t n = 0;
+    for (const char *c = name; *c != '\0' && n < sizeof(path) - 24; c++)
+    {
+        if (c[0] == '%' && c[1] == 'p')
+        {
+            int d = 0;
+            for (long pid = getpid(); pid > 0 || d == 0; pid /= 10)
+            {
+                digits[d++] = (char) ('0' + pid % 10);
+            }
+            while (d > 0)
+            {
+                path[n++] = digits[--d];
+            }
+            c++;
+        }
+        else
+        {
+            path[n++] = *c;
+        }
+    }
+    path[n] = '\0';
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (traceFd >= 0)
+    {
+        traceHeader(buffer);
+        buffered = TRACE_HEADER_SIZE;
+    }
+}
+
+
+static void forkPrepare()
+{
+    pthread_mutex_lock(&lock);
+}
+
+
+static void forkParent()
+{
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void forkChild()
+{
+    if (traceFd >= 0)
+    {
+        close(traceFd);
+    }
+    traceFd = -1;
+    buffered = 0;
+    pthread_mutex_t fresh = PTHREAD_MUTEX_INITIALIZER;
+    lock = fresh;
+}
+
+
+__attribute__((constructor)) static void recordStart()
+{
+    pthread_mutex_lock(&lock);
+    start();
+    pthread_mutex_unlock(&lock);
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+
+__attribute__((destructor)) static void recordEnd()
+{
+    pthread_mutex_lock(&lock);
+    flush();
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*!
+ * Returns the slot of the table at which ptr would be if nothing were in the
+ * way.
+ */
+static size_t homeSlot(uintptr_t ptr)
+{
+    uint64_t hash = ((uint64_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (hash ^ (hash >> 32)) & (tableSlots - 1);
+}
+
+
+/*!
+ * Returns the slot of the table at which ptr is, or the empty one at which
+ * it would go.
+ */
+static size_t findSlot(uintptr_t ptr)
+{
+    size_t i;
+    for (i = homeSlot(ptr); table[i].ptr != 0 && table[i].ptr != ptr;
+         i = (i + 1) & (tableSlots - 1))
+        ;
+    return i;
+}
+
+
+/*!
+ * Doubles the hash table (or makes the first one). Returns 0, or -1 if no
+ * memory could be mapped.
+ */
+static int growTable()
+{
+    size_t oldSlots = tableSlots;
+    slot *old = table;
+    size_t slots = oldSlots == 0 ? TABLE_MIN : 2 * oldSlots;
+    slot *fresh = (slot *) mapMemory(slots * sizeof(slot));
+    if (fresh == NULL)
+    {
+        return -1;
+    }
+    table = fresh;
+    tableSlots = slots;
+    for (size_t i = 0; i < oldSlots; i++)
+    {
+        if (old[i].ptr != 0)
+        {
+            table[findSlot(old[i].ptr)] = old[i];
+        }
+    }
+    if (old != NULL)
+    {
+        munmap(old, oldSlots * sizeof(slot));
+    }
+    return 0;
+}
+
+
+/*!
+ * Removes the entry at slot i, moving back the entries after it that would
+ * otherwise no longer be found (linear probing needs no tombstones then).
+ */
+static void removeSlot(size_t i)
+{
+    size_t mask = tableSlots - 1;
+    table[i].ptr = 0;
+    for (size_t j = (i + 1) & mask; table[j].ptr != 0; j = (j + 1) & mask)
+    {
+        size_t home = homeSlot(table[j].ptr);
+        /* j's entry may fill the hole at i unless its home lies in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            table[i] = table[j];
+            table[j].ptr = 0;
+            i = j;
+        }
+    }
+    tableUsed--;
+}
+
+
+/*!
+ * Gives ptr an id, the last one freed if there is one. Returns 0, or -1 if
+ * the table could not grow.
+ */
+static int addPointer(void *ptr, uint64_t *id)
+{
+    if (2 * (tableUsed + 1) > tableSlots && growTable() != 0)
+    {
+        return -1;
+    }
+    *id = freeIdCount > 0 ? freeIds[--freeIdCount] : nextId++;
+    size_t i = findSlot((uintptr_t) ptr);
+    table[i].ptr = (uintptr_t) ptr;
+    table[i].id = *id;
+    tableUsed++;
+    return 0;
+}
+
+
+/*!
+ * Forgets ptr, putting its id in *id and, if keepId is 0, on the list of
+ * ids to reuse. Returns 0, or -1 if ptr is not known.
+ */
+static int removePointer(void *ptr, uint64_t *id, int keepId)
+{
+    if (tableSlots == 0)
+    {
+        return -1;
+    }
+    size_t i = findSlot((uintptr_t) ptr);
+    if (table[i].ptr == 0)
+    {
+        return -1;
+    }
+    *id = table[i].id;
+    removeSlot(i);
+    if (keepId)
+    {
+        return 0;
+    }
+    if (freeIdCount == freeIdSlots)
+    {
+        size_t slots = freeIdSlots == 0 ? TABLE_MIN : 2 * freeIdSlots;
+        uint64_t *fresh = (uint64_t *) mapMemory(slots * sizeof(uint64_t));
+        if (fresh == NULL)
+        {
+            return 0;  /* the id is just not reused */
+        }
+        if (freeIds != NULL)
+        {
+            memcpy(fresh, freeIds, freeIdCount * sizeof(uint64_t));
+            munmap(freeIds, freeIdSlots * sizeof(uint64_t));
+        }
+        freeIds = fresh;
+        freeIdSlots = slots;
+    }
+    freeIds[freeIdCount++] = *id;
+    return 0;
+}
+
+
+/*!
+ * Appends a record to the trace. The caller must hold the lock.
+ */
+static void record(int op, uint64_t id, uint64_t size)
+{
+    if (threadNumber == 0)
+    {
+        threadNumber = ++threadCount;
+    }
+    trace_op rec = { op, id, size, threadNumber };
+    buffered += traceEncode(buffer + buffered, &rec, &lastThread);
+    if (buffered > RECORD_BUFFER - TRACE_MAX_RECORD)
+    {
+        flush();
+    }
+}
+
+
+/*!
+ * Records the allocation of a new block at ptr, of size bytes.
+ */
+static void recordAlloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    start();
+    uint64_t id;
+    if (traceFd >= 0 && addPointer(ptr, &id) == 0)
+    {
+        record(TRACE_ALLOC, id, size);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Recorded allocation functions
+ * -------------------------------------------------------------------
+ */
+
+
+EXPORT void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+    recordAlloc(ptr, size);
+    return ptr;
+}
+
+
+EXPORT void *calloc(size_t count, size_t size)
+{
+    void *ptr = __libc_calloc(count, size);
+    recordAlloc(ptr, count * size);  /* calloc checked for overflow */
+    return ptr;
+}
+
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    uint64_t id;
+    if (traceFd >= 0 && removePointer(ptr, &id, 0) == 0)
+    {
+        record(TRACE_FREE, id, 0);
+    }
+    __libc_free(ptr);
+    pthread_mutex_unlock(&lock);
+}
+
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return malloc(size);
+    }
+    pthread_mutex_lock(&lock);
+    void *moved = __libc_realloc(ptr, size);
+    uint64_t id;
+    if (moved == NULL && size != 0)
+    {
+        /* failed, and ptr is left as it was */
+    }
+    else if (traceFd < 0 || removePointer(ptr, &id, moved != NULL) != 0)
+    {
+        /* not a pointer the recorder knows: record the new block afresh */
+        if (traceFd >= 0 && moved != NULL && addPointer(moved, &id) == 0)
+        {
+            record(TRACE_ALLOC, id, size);
+        }
+    }
+    else if (moved == NULL)
+    {
+        record(TRACE_FREE, id, 0);  /* realloc(ptr, 0) freed it */
+    }
+    else
+    {
+        size_t i = findSlot((uintptr_t) moved);
+        table[i].ptr = (uintptr_t) moved;
+        table[i].id = id;
+        tableUsed++;
+        record(TRACE_REALLOC, id, size);
+    }
+    pthread_mutex_unlock(&lock);
+    return moved;
+}
+
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    recordAlloc(ptr, size);
+    *memptr = ptr;
+    return 0;
+}
+
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *ptr = __libc_memalign(alignment, size);
+    recordAlloc(ptr, size);
+    return ptr;
+}
+
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    void *ptr = __libc_memalign(alignment, size);
+    recordAlloc(ptr, size);
+    return ptr;
+}
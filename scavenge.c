@@ -0,0 +1,194 @@
+/*! \file
+ * Implementation of the scavenger.
+ *
+ * Purging: the pages strictly inside a free block, past its node header and
+ * before its footer, hold nothing the allocator needs, so they can be handed
+ * back to the system with madvise(MADV_DONTNEED) while the block stays in the
+ * free index with its tags intact. They come back (zero filled) the next time
+ * they are touched. Each purged page is flagged PAGE_PURGED in the page map,
+ * so it is neither purged nor counted twice, and scavengeUse clears the flag
+ * (and takes the page off heap->purgedBytes) as soon as a block that covers
+ * it is allocated.
+ *
+ * Decay: purging memory that is about to be allocated again only costs page
+ * faults, so memory is given back only after it has stayed free for a while.
+ * Every SCAVENGE_INTERVAL bytes freed, a pass over the free blocks flags
+ * their pages PAGE_AGED, and purges the pages that already were, i.e. that
+ * have been free since the previous pass. A steady workload thus keeps its
+ * working set, while memory freed after a peak goes back within two
+ * intervals of further frees. myheap_trim purges everything at once.
+ *
+ * Huge pages: giving back part of a huge page splits it into small pages for
+ * good, so in pools backed by huge pages (see hugepage.c) only whole huge
+ * pages are given back, all of whose small pages are due.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "myalloc.h"
+#include "slab.h"
+#include "scavenge.h"
+
+
+/* bytes freed between two scavenger passes */
+#define SCAVENGE_INTERVAL (4 * 1024 * 1024)
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Rounds ptr down to a multiple of grain (a power of two).
+ */
+static unsigned char *alignDown(unsigned char *ptr, int grain)
+{
+    return (unsigned char *) ((uintptr_t) ptr & ~(uintptr_t) (grain - 1));
+}
+
+
+/*!
+ * Rounds ptr down to the start of its page.
+ */
+static unsigned char *pageDown(unsigned char *ptr)
+{
+    return alignDown(ptr, SLAB_SIZE);
+}
+
+
+/*!
+ * Gives the whole pages from start to end back to the system. Returns the
+ * number of bytes given back.
+ */
+static size_t purgeRun(myheap *heap, unsigned char *start,
+                                   unsigned char *end)
+{
+    if (start >= end || madvise(start, end - start, MADV_DONTNEED) != 0)
+    {
+        return 0;
+    }
+    for (unsigned char *page = start; page < end; page += SLAB_SIZE)
+    {
+        int flags = pageFlags(heap, page);
+        setPageFlags(heap, page, (flags & ~PAGE_AGED) | PAGE_PURGED);
+    }
+    heap->purgedBytes += end - start;
+    return end - start;
+}
+
+
+/*!
+ * Purges the pages inside the free block at dataptr that are due (all of
+ * them with force), and ages the rest. Consecutive due pages are purged
+ * with a single madvise, trimmed to whole huge pages in a huge page pool.
+ */
+static size_t purgeBlock(myheap *heap, unsigned char *dataptr,
+                                       size_t space, int force)
+{
+    int grain = heap->hugePages ? HUGE_PAGE_SIZE : SLAB_SIZE;
+    unsigned char *start = pageDown(dataptr + sizeof(node) + SLAB_SIZE - 1);
+    unsigned char *end = pageDown(dataptr + space); /* the footer's page */
+    unsigned char *runStart = start;
+    size_t purged = 0;
+
+    for (unsigned char *page = start; page < end; page += SLAB_SIZE)
+    {
+        int flags = pageFlags(heap, page);
+        if ((flags & PAGE_PURGED) || (!force && !(flags & PAGE_AGED)))
+        {
+            if (!(flags & PAGE_PURGED))
+            {
+                setPageFlags(heap, page, flags | PAGE_AGED);
+            }
+            purged += purgeRun(heap, alignDown(runStart + grain - 1, grain),
+                                     alignDown(page, grain));
+            runStart = page + SLAB_SIZE;
+        }
+    }
+    return purged + purgeRun(heap, alignDown(runStart + grain - 1, grain),
+                                   alignDown(end, grain));
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Scavenger functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Counts freed bytes towards the next pass. Constant time, except for the
+ * pass itself once every SCAVENGE_INTERVAL bytes.
+ */
+void scavengeFreed(myheap *heap, size_t bytes)
+{
+    if (heap->pageMap == NULL)
+    {
+        return;
+    }
+    heap->freedBytes += bytes;
+    if (heap->freedBytes >= SCAVENGE_INTERVAL)
+    {
+        scavenge(heap, 0);
+    }
+}
+
+
+/*!
+ * Clears the scavenger's flags for every page overlapping start to end, which
+ * must be within the pool.
+ */
+void scavengeUse(myheap *heap, unsigned char *start, unsigned char *end)
+{
+    if (heap->pageMap == NULL)
+    {
+        return;
+    }
+    for (unsigned char *page = pageDown(start); page < end; page += SLAB_SIZE)
+    {
+        int flags = pageFlags(heap, page);
+        if (flags & (PAGE_AGED | PAGE_PURGED))
+        {
+            if (flags & PAGE_PURGED)
+            {
+                heap->purgedBytes -= SLAB_SIZE;
+            }
+            setPageFlags(heap, page, flags & ~(PAGE_AGED | PAGE_PURGED));
+        }
+    }
+}
+
+
+/*!
+ * Walks every block, purging or aging the pages of the free ones. Linear in
+ * the number of blocks, which the SCAVENGE_INTERVAL bytes of frees between
+ * passes pay for.
+ */
+size_t scavenge(myheap *heap, int force)
+{
+    if (heap->pageMap == NULL)
+    {
+        return 0;
+    }
+    heap->freedBytes = 0;
+
+    size_t purged = 0;
+    unsigned char *endptr = heap->mem + heap->size;
+    unsigned char *dataptr = heap->mem;
+    while (dataptr != endptr)
+    {
+        unsigned int tag = *((unsigned int *) dataptr);
+        if (!(tag & TAG_INUSE))
+        {
+            purged += purgeBlock(heap, dataptr, SPACE_OF(tag), force);
+        }
+        dataptr += SPACE_OF(tag) + sizeof(int);
+    }
+    return purged;
+}
@@ -0,0 +1,30 @@
+/*! \file
+ * Declarations for the scavenger, which gives the memory inside large free
+ * blocks back to the system once it has gone unused for a while, so that a
+ * heap's resident size comes down after a peak. Only heaps with a page map
+ * (see slab.c) are scavenged.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/*
+ * Notes that bytes of block memory were freed, running a scavenger pass once
+ * enough have been since the last one.
+ */
+void scavengeFreed(myheap *heap, size_t bytes);
+
+
+/*
+ * Notes that the memory from start to end is about to be used, so none of its
+ * pages count as free or given back any more.
+ */
+void scavengeUse(myheap *heap, unsigned char *start, unsigned char *end);
+
+
+/*
+ * Runs a scavenger pass over every free block. With force, every free page
+ * is given back at once; otherwise only those already free at the previous
+ * pass. Returns the number of bytes given back.
+ */
+size_t scavenge(myheap *heap, int force);
@@ -10,166 +10,180 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "sequence.h"
 
-SEQLIST *seq_add_front(int size, unsigned char *ref_block, SEQLIST *next) {
-  SEQLIST *result = (SEQLIST *) malloc(sizeof(SEQLIST));
+// grow an array of slots elements of size bytes to hold at least one more
+static void *grow(void *array, size_t *slots, size_t size) {
+  size_t more = *slots ? *slots * 2 : 1024;
+  void *result = realloc(array, more * size);
 
-  if (result == (SEQLIST *) 0) {
+  if (result == NULL) {
     fprintf(stderr, "real memory exhausted.\n");
     abort();
   }
 
-  result->alloc = 1;
-  result->freed = 0;
-  result->size = size;
-  result->ref_block = ref_block;
-  result->myalloc_block = (unsigned char *) 0;
-  result->tofree = (SEQLIST *) 0;
-  result->next = next;
+  *slots = more;
   return result;
 }
 
-SEQLIST *seq_set_next_allocate(int size, unsigned char *ref_block,
-                               SEQLIST *prev) {
-
-  SEQLIST *result = (SEQLIST *) malloc(sizeof(SEQLIST));
+SEQLIST *seq_create(uint64_t seed) {
+  SEQLIST *result = (SEQLIST *) calloc(1, sizeof(SEQLIST));
 
   if (result == (SEQLIST *) 0) {
     fprintf(stderr, "real memory exhausted.\n");
     abort();
   }
 
-  result->alloc = 1;
-  result->freed = 0;
-  result->size = size;
-  result->ref_block = ref_block;
-  result->myalloc_block = (unsigned char *) 0;
-  result->tofree = (SEQLIST *) 0;
-  result->next = (SEQLIST *) 0;
-  prev->next = result;
-
+  result->seed = seed;
   return result;
 }
 
+// append an op, returning it
+static seq_op *seq_append(SEQLIST *seq) {
+  // indices of allocates are kept in 32 bits
+  if (seq->length == UINT32_MAX) {
+    fprintf(stderr, "sequence too long.\n");
+    abort();
+  }
+  if (seq->length == seq->ops_slots)
+    seq->ops = grow(seq->ops, &seq->ops_slots, sizeof(seq_op));
+  return &seq->ops[seq->length++];
+}
+
+size_t seq_add_allocate(SEQLIST *seq, int size) {
+  seq_op *op = seq_append(seq);
 
-SEQLIST *seq_set_next_free(SEQLIST *tofree, SEQLIST *prev) {
+  op->myalloc_block = (unsigned char *) 0;
+  op->size = size;
+  op->tofree = 0;
 
-  SEQLIST *result = (SEQLIST *) malloc(sizeof(SEQLIST));
+  if (seq->live_count == seq->live_slots)
+    seq->live = grow(seq->live, &seq->live_slots, sizeof(uint32_t));
+  seq->live[seq->live_count++] = seq->length - 1;
 
-  if (result == (SEQLIST *) 0) {
-    fprintf(stderr, "real memory exhausted.\n");
+  return seq->length - 1;
+}
+
+size_t seq_add_free(SEQLIST *seq, size_t live_n) {
+  seq_op *op;
+
+  if (live_n >= seq->live_count) {
+    fprintf(stderr, "seq_add_free has only %zu live blocks, "
+            "but asked to free block %zu\n", seq->live_count, live_n);
     abort();
   }
 
-  result->alloc = 0;
-  result->freed = 0;
-  result->size = 0;
-  result->ref_block = (unsigned char *) 0;
-  result->myalloc_block = (unsigned char *) 0;
-  result->tofree = tofree;
-  result->next = (SEQLIST *) 0;
-  prev->next = result;
+  op = seq_append(seq);
+  op->myalloc_block = (unsigned char *) 0;
+  op->size = SEQ_FREE;
+  op->tofree = seq->live[live_n];
 
-  return result;
+  // the last live block takes the freed one's place
+  seq->live[live_n] = seq->live[--seq->live_count];
+
+  return seq->length - 1;
+}
+
+size_t seq_length(SEQLIST *seq) {
+  return seq->length;
 }
 
-int seq_alloc(SEQLIST *seq) {
-  return seq->alloc;
+seq_op *seq_at(SEQLIST *seq, size_t i) {
+  return &seq->ops[i];
 }
 
-int seq_freed(SEQLIST *seq) {
-  return seq->freed;
+int seq_alloc(seq_op *op) {
+  return op->size != SEQ_FREE;
 }
 
-void seq_free(SEQLIST *seq) {
-  seq->freed = 1;
+void seq_set_myalloc_block(seq_op *op, unsigned char *myalloc_block) {
+  op->myalloc_block = myalloc_block;
 }
 
-void seq_set_myalloc_block(SEQLIST *seq, unsigned char *myalloc_block) {
-  seq->myalloc_block = myalloc_block;
+int seq_size(seq_op *op) {
+  return op->size;
 }
 
-int seq_size(SEQLIST *seq) {
-  return seq->size;
+unsigned char * seq_myalloc_block(seq_op *op) {
+  return op->myalloc_block;
 }
 
-unsigned char * seq_ref_block(SEQLIST *seq) {
-  return seq->ref_block;
+size_t seq_tofree(seq_op *op) {
+  return op->tofree;
 }
 
-unsigned char * seq_myalloc_block(SEQLIST *seq) {
-  return seq->myalloc_block;
+size_t seq_live_count(SEQLIST *seq) {
+  return seq->live_count;
 }
 
-SEQLIST * seq_next(SEQLIST *seq) {
-  return seq->next;
+size_t seq_live(SEQLIST *seq, size_t live_n) {
+  return seq->live[live_n];
 }
 
-SEQLIST * seq_tofree(SEQLIST *seq) {
-  return seq->tofree;
+// the first state of the reference data for the allocate at index i
+//  (splitmix64, so that neighbouring indices give unrelated data)
+static uint64_t ref_state(SEQLIST *seq, size_t i) {
+  uint64_t z = seq->seed + (i + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return (z ^ (z >> 31)) | 1;
 }
 
-int seq_null(SEQLIST *seq) {
-  return (seq == (SEQLIST *) 0);
+// the next eight bytes of reference data (xorshift64*)
+static uint64_t ref_next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
 }
 
-SEQLIST * find_nth_allocated_block(SEQLIST *seq, int n) {
-  int cnt = 0;
-  SEQLIST *sptr;
+void seq_fill(SEQLIST *seq, size_t i, unsigned char *block) {
+  uint64_t state = ref_state(seq, i);
+  size_t len = seq->ops[i].size;
 
-  for (sptr = seq; !seq_null(sptr); sptr = seq_next(sptr)) {
-    if (seq_alloc(sptr) && !seq_freed(sptr)) {
-      cnt++;
-      if (cnt == n)
-        return sptr;
-    }
+  for (size_t off = 0; off < len; off += 8) {
+    uint64_t word = ref_next(&state);
+    memcpy(block + off, &word, len - off < 8 ? len - off : 8);
   }
+}
 
-  fprintf(stderr, "find_nth_allocated_block found only %d blocks, "
-          "but asked for %dth block\n", cnt, n);
-  seq_print(seq);
-  abort();
+int seq_same_data(SEQLIST *seq, size_t i, unsigned char *block) {
+  uint64_t state = ref_state(seq, i);
+  size_t len = seq->ops[i].size;
+
+  for (size_t off = 0; off < len; off += 8) {
+    uint64_t word = ref_next(&state);
+    if (memcmp(block + off, &word, len - off < 8 ? len - off : 8) != 0)
+      return 0;
+  }
+
+  return 1;
 }
 
 void seq_print(SEQLIST *seq) {
-  int cnt = 0;
-  SEQLIST *sptr;
-
-  for (sptr = seq; !seq_null(sptr); sptr = seq_next(sptr)) {
-    cnt++;
-    printf("\t");
-    if (seq_alloc(sptr)) {
-      printf("ALLOC");
-
-      if (seq_freed(sptr))
-        printf(" FREED ");
-      else
-        printf(" LIVE  ");
-
-      printf("%d r=%p m=%p ", seq_size(sptr), seq_ref_block(sptr),
-             seq_myalloc_block(sptr));
+  size_t i;
+
+  for (i = 0; i < seq->length; i++) {
+    seq_op *op = &seq->ops[i];
+    printf("\t%zu ", i);
+    if (seq_alloc(op)) {
+      printf("ALLOC %d m=%p ", seq_size(op), seq_myalloc_block(op));
     }
     else {    // dealloc
-      printf("FREE  ");
-      printf("r to free %p", seq_ref_block(seq_tofree(sptr)));
+      printf("FREE  %zu", seq_tofree(op));
     }
 
     printf("\n");
   }
 
-  printf("Length=%d\n", cnt);
+  printf("Length=%zu Live=%zu\n", seq->length, seq->live_count);
 }
 
 /* Free all of the real memory resources used by the sequence.
  * This does NOT clean up the resources held in the myalloc pool. */
 void seq_cleanup(SEQLIST *seq) {
-  SEQLIST *current = seq;
-  SEQLIST *next;
-  while (current != NULL) {
-    next = current->next;
-    free(current->ref_block);
-    free(current);
-    current = next;
-  }
+  free(seq->ops);
+  free(seq->live);
+  free(seq);
 }
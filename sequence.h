@@ -3,43 +3,59 @@
  * sequence of allocations and deallocations, so that they can be replayed to
  * the allocator and the responses analyzed.
  *
+ * A sequence is one array of operations, in order, along with a dense array
+ * of the allocations not yet freed (the live set), so that the tester can
+ * pick a random live block to free, and drop it from the live set, in
+ * constant time. The reference data an allocation's block is filled with,
+ * and checked against, is not stored but generated from the sequence's seed
+ * and the allocation's index, so a sequence costs 16 bytes per operation
+ * however large its blocks are.
+ *
  * Adapted from Andre DeHon's CS24 2004, 2006 material.
  * Copyright (C) California Institute of Technology, 2004-2009.
  * All rights reserved.
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEQ_FREE UINT32_MAX  // the size recorded for a free
+
+typedef struct seq_op {
+  unsigned char *myalloc_block; // for an allocate, the block from myalloc
+  uint32_t size;   // in bytes, or SEQ_FREE for a free
+  uint32_t tofree; // for a free, the index of the allocate to free
+} seq_op;
+
 typedef struct sequence_struct {
-  int alloc; // is this block an allocate
-             // 1=allocate; 0=free
-  int freed; // has this block been freed
-  int size; // in bytes
-  unsigned char *ref_block; // ref. block for checking data
-  unsigned char *myalloc_block; // pointer to block from myalloc
-  struct sequence_struct *tofree; // for a free, the sequence_struct
-                                  // whose allocation should be freed
-  struct sequence_struct *next;  // next pointer
+  seq_op *ops;       // the operations, in order
+  size_t length;
+  size_t ops_slots;
+  uint32_t *live;    // indices of the allocates not freed, in no order
+  size_t live_count;
+  size_t live_slots;
+  uint64_t seed;     // for the reference data
 } SEQLIST;
 
-// add to front, always an allocate
-SEQLIST *seq_add_front(int size, unsigned char *ref_block, SEQLIST *next);
-// add to tail ... allocate and free version
-SEQLIST *seq_set_next_allocate(int size, unsigned char *ref_block, SEQLIST *prev);
-SEQLIST *seq_set_next_free(SEQLIST *tofree, SEQLIST *prev);
+// create an empty sequence, whose reference data follows from seed
+SEQLIST *seq_create(uint64_t seed);
+// add to tail ... allocate and free version; both return the op's index
+size_t seq_add_allocate(SEQLIST *seq, int size);
+size_t seq_add_free(SEQLIST *seq, size_t live_n); // frees the nth live block
 // accessors
-int seq_alloc(SEQLIST *seq);
-int seq_freed(SEQLIST *seq);
-int seq_size(SEQLIST *seq);
-unsigned char *seq_ref_block(SEQLIST *seq);
-unsigned char *seq_myalloc_block(SEQLIST *seq);
-SEQLIST  *seq_next(SEQLIST *seq);
-SEQLIST  *seq_tofree(SEQLIST *seq);
-// predicate
-int seq_null(SEQLIST *seq);
+size_t seq_length(SEQLIST *seq);
+seq_op *seq_at(SEQLIST *seq, size_t i);
+int seq_alloc(seq_op *op);
+int seq_size(seq_op *op);
+unsigned char *seq_myalloc_block(seq_op *op);
+size_t seq_tofree(seq_op *op);
+size_t seq_live_count(SEQLIST *seq);
+size_t seq_live(SEQLIST *seq, size_t live_n); // index of the nth live block
 // mutators
-void seq_set_myalloc_block(SEQLIST *seq,unsigned char *myalloc_block);
-void seq_free(SEQLIST *seq);
+void seq_set_myalloc_block(seq_op *op, unsigned char *myalloc_block);
+// reference data, for the allocate at index i
+void seq_fill(SEQLIST *seq, size_t i, unsigned char *block);
+int seq_same_data(SEQLIST *seq, size_t i, unsigned char *block);
 // utilities
-SEQLIST *find_nth_allocated_block(SEQLIST *seq,int n);
 void seq_print(SEQLIST *seq);
 void seq_cleanup(SEQLIST *seq);
-
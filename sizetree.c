@@ -0,0 +1,292 @@
+/*! \file
+ * Implementation of the size-ordered tree free block index.
+ *
+ * The tree is an AA tree (a simplified red-black tree) stored entirely inside
+ * the free blocks: the prev link of a node header is its left child, the
+ * next link its right child, and the level field its AA level (leaves are at
+ * level 1, NULL counts as level 0). Nodes are ordered by size, and blocks of
+ * equal size by address, so every key is distinct and a block can always be
+ * found again from its own header.
+ *
+ * A minimum block is no bigger than its node header, whose level field is
+ * then its footer, so minimum blocks are kept on a plain list instead. Any
+ * of them fits any request one of them fits, so this loses nothing.
+ *
+ * Inserting, removing and searching all walk one root-to-leaf path, so they
+ * are O(log n) in the number of free blocks. Searching finds the smallest
+ * block that fits, which is exactly the best-fit choice of the free list scan
+ * (ties go to the lowest address rather than to the most recently freed).
+ */
+
+#include <stdlib.h>
+
+#include "myalloc.h"
+#include "sizetree.h"
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define LEFT(t) NODE_AT(heap, (t)->prev)
+#define RIGHT(t) NODE_AT(heap, (t)->next)
+#define LEVEL(t) ((t) == NULL ? 0 : (t)->level)
+#define SMALL_UNITS 1 /* size of a minimum block, in units */
+
+
+/*!
+ * Sets the left child of t. A function rather than a macro, since LINK_TO
+ * evaluates its argument twice and the child is often a recursive call.
+ */
+static void setLeft(myheap *heap, node *t, node *l)
+{
+    t->prev = LINK_TO(heap, l);
+}
+
+
+/*!
+ * Sets the right child of t, like setLeft.
+ */
+static void setRight(myheap *heap, node *t, node *r)
+{
+    t->next = LINK_TO(heap, r);
+}
+
+
+/*!
+ * Returns nonzero if block a sorts before block b.
+ */
+static int lessThan(node *a, node *b)
+{
+    unsigned int unitsA = UNITS_OF(a->tag);
+    unsigned int unitsB = UNITS_OF(b->tag);
+    return unitsA < unitsB || (unitsA == unitsB && a < b);
+}
+
+
+/*!
+ * Removes a left horizontal link by rotating right. Returns the new root of
+ * the subtree.
+ */
+static node *skew(myheap *heap, node *t)
+{
+    if (t != NULL && LEFT(t) != NULL && LEFT(t)->level == t->level)
+    {
+        node *l = LEFT(t);
+        setLeft(heap, t, RIGHT(l));
+        setRight(heap, l, t);
+        return l;
+    }
+    return t;
+}
+
+
+/*!
+ * Removes two consecutive right horizontal links by rotating left and raising
+ * the middle node a level. Returns the new root of the subtree.
+ */
+static node *split(myheap *heap, node *t)
+{
+    if (t != NULL && RIGHT(t) != NULL && RIGHT(RIGHT(t)) != NULL
+                  && RIGHT(RIGHT(t))->level == t->level)
+    {
+        node *r = RIGHT(t);
+        setRight(heap, t, LEFT(r));
+        setLeft(heap, r, t);
+        r->level++;
+        return r;
+    }
+    return t;
+}
+
+
+/*!
+ * Inserts newNode into the subtree rooted at t, returning the new root.
+ */
+static node *insert(myheap *heap, node *t, node *newNode)
+{
+    if (t == NULL)
+    {
+        setLeft(heap, newNode, NULL);
+        setRight(heap, newNode, NULL);
+        newNode->level = 1;
+        return newNode;
+    }
+    if (lessThan(newNode, t))
+    {
+        setLeft(heap, t, insert(heap, LEFT(t), newNode));
+    }
+    else
+    {
+        setRight(heap, t, insert(heap, RIGHT(t), newNode));
+    }
+    return split(heap, skew(heap, t));
+}
+
+
+/*!
+ * Removes badNode from the subtree rooted at t, returning the new root.
+ * badNode must be in the subtree.
+ */
+static node *delete(myheap *heap, node *t, node *badNode)
+{
+    if (t == badNode)
+    {
+        /*
+         * A node without a left child is at level 1 and its right child, if
+         * any, is a level 1 leaf, so that child can simply take its place.
+         */
+        if (LEFT(t) == NULL)
+        {
+            return RIGHT(t);
+        }
+        /*
+         * Otherwise both children exist. Since the blocks themselves are
+         * the nodes, the successor is moved into the deleted node's place
+         * rather than having its key copied over.
+         */
+        node *successor = RIGHT(t);
+        while (LEFT(successor) != NULL)
+        {
+            successor = LEFT(successor);
+        }
+        setRight(heap, t, delete(heap, RIGHT(t), successor));
+        successor->prev = t->prev;
+        successor->next = t->next;
+        successor->level = t->level;
+        t = successor;
+    }
+    else if (lessThan(badNode, t))
+    {
+        setLeft(heap, t, delete(heap, LEFT(t), badNode));
+    }
+    else
+    {
+        setRight(heap, t, delete(heap, RIGHT(t), badNode));
+    }
+
+    /* lower levels that are now too high, then restore the AA shape */
+    int shouldBe = MIN(LEVEL(LEFT(t)), LEVEL(RIGHT(t))) + 1;
+    if (shouldBe < t->level)
+    {
+        t->level = shouldBe;
+        if (RIGHT(t) != NULL && shouldBe < RIGHT(t)->level)
+        {
+            RIGHT(t)->level = shouldBe;
+        }
+    }
+    t = skew(heap, t);
+    setRight(heap, t, skew(heap, RIGHT(t)));
+    if (RIGHT(t) != NULL)
+    {
+        setRight(heap, RIGHT(t), skew(heap, RIGHT(RIGHT(t))));
+    }
+    t = split(heap, t);
+    setRight(heap, t, split(heap, RIGHT(t)));
+    return t;
+}
+
+
+/*!
+ * Empties the tree, used when a heap is set up.
+ */
+void treeReset(myheap *heap)
+{
+    heap->treeRoot = NULL;
+    heap->treeSmall = NULL;
+}
+
+
+/*!
+ * Adds a free block to the tree, or a minimum block to the front of the
+ * list of them. O(log n).
+ */
+void treeInsert(myheap *heap, node *newNode)
+{
+    if (UNITS_OF(newNode->tag) == SMALL_UNITS)
+    {
+        newNode->next = LINK_TO(heap, heap->treeSmall);
+        newNode->prev = 0;
+        if (heap->treeSmall != NULL)
+        {
+            heap->treeSmall->prev = LINK_TO(heap, newNode);
+        }
+        heap->treeSmall = newNode;
+        return;
+    }
+    heap->treeRoot = insert(heap, heap->treeRoot, newNode);
+}
+
+
+/*!
+ * Takes a free block out of the tree (or the list). The block's size must
+ * not have changed since it was inserted, since that is part of its key.
+ * O(log n).
+ */
+void treeRemove(myheap *heap, node *badNode)
+{
+    if (UNITS_OF(badNode->tag) == SMALL_UNITS)
+    {
+        node *prevNode = NODE_AT(heap, badNode->prev);
+        node *nextNode = NODE_AT(heap, badNode->next);
+        if (prevNode == NULL)
+        {
+            heap->treeSmall = nextNode;
+        }
+        else
+        {
+            prevNode->next = badNode->next;
+        }
+        if (nextNode != NULL)
+        {
+            nextNode->prev = badNode->prev;
+        }
+        return;
+    }
+    heap->treeRoot = delete(heap, heap->treeRoot, badNode);
+}
+
+
+/*!
+ * Lower bound search: finds the smallest free block of at least units,
+ * lowest address first among blocks of equal size (except that minimum
+ * blocks come off their list most recently freed first). O(log n).
+ */
+node *treeFind(myheap *heap, unsigned int units)
+{
+    if (units <= SMALL_UNITS && heap->treeSmall != NULL)
+    {
+        return heap->treeSmall;
+    }
+
+    node *resultptr = NULL;
+    node *t = heap->treeRoot;
+    while (t != NULL)
+    {
+        if (UNITS_OF(t->tag) >= units)
+        {
+            resultptr = t; /* fits, but a smaller one may be to the left */
+            t = LEFT(t);
+        }
+        else
+        {
+            t = RIGHT(t);
+        }
+    }
+    return resultptr;
+}
+
+
+/*!
+ * Finds the largest free block, the rightmost node of the tree (or, with an
+ * empty tree, any minimum block). O(log n).
+ */
+node *treeLargest(myheap *heap)
+{
+    node *t = heap->treeRoot;
+    if (t == NULL)
+    {
+        return heap->treeSmall;
+    }
+    while (RIGHT(t) != NULL)
+    {
+        t = RIGHT(t);
+    }
+    return t;
+}
@@ -0,0 +1,30 @@
+/*! \file
+ * Declarations for the size-ordered tree free block index. Free blocks are
+ * kept in a balanced binary search tree (an AA tree) ordered by size and then
+ * by address, so the best-fit block can be found in logarithmic time.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/* Empties the tree. */
+void treeReset(myheap *heap);
+
+
+/* Adds a free block to the tree. */
+void treeInsert(myheap *heap, node *newNode);
+
+
+/* Takes a free block out of the tree. */
+void treeRemove(myheap *heap, node *badNode);
+
+
+/*
+ * Finds the smallest free block of at least units ALIGNMENT units (lowest
+ * address among equals), or NULL if none.
+ */
+node *treeFind(myheap *heap, unsigned int units);
+
+
+/* Finds the largest free block, or NULL if there is none. */
+node *treeLargest(myheap *heap);
@@ -0,0 +1,374 @@
+/*! \file
+ * Implementation of the slab front end of a heap.
+ *
+ * Slabs: a slab is an ordinary allocated block of the heap whose payload is
+ * a SLAB_SIZE page, aligned to SLAB_SIZE, less its last four bytes, which
+ * hold the next block's header tag. The slab block's own header tag is thus
+ * the last four bytes of the page before, so slabs carved one after another
+ * tile the pool with no gaps.
+ * Inside, a slab header comes first, followed by
+ * as many objects of the slab's size class as fit. The header holds a bitmap
+ * with a set bit for every free object, so the first free object is found
+ * with a find-first-set per 64 objects, and objects carry no tags at all.
+ *
+ * Dispatch: because a slab's block is a whole aligned page that nothing else
+ * can share, an address is in a slab exactly when the page containing it is
+ * marked in the heap's page map (one byte per page of the pool). The slab
+ * header is then found by rounding the address down to the page.
+ *
+ * Slabs of each class with at least one free object are kept on a doubly
+ * linked list in the heap. A slab that becomes empty goes back to the heap,
+ * unless it is the only partially used slab of its class, in which case it is
+ * kept to avoid carving a fresh slab for the very next allocation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "myalloc.h"
+#include "slab.h"
+
+
+/*
+ * object sizes of the slab classes, all multiples of ALIGNMENT so that every
+ * object is as aligned as any other block's payload
+ */
+static const int classSizes[SLAB_CLASSES] = {16, 32, 48, 64};
+
+#define SLAB_MAP_WORDS (SLAB_SIZE / 16 / 64) /* enough bits for 16-byte objects */
+
+typedef struct slab
+{
+    struct slab *next;   /* partially used slabs of the same class */
+    struct slab *prev;
+    int sizeClass;
+    int objSize;
+    int capacity;        /* objects in the slab */
+    int used;            /* objects currently allocated */
+    unsigned long long freeMap[SLAB_MAP_WORDS]; /* bit set = object free */
+} slab;
+
+/*
+ * slabValid may read a slab's freeMap without holding whatever lock guards
+ * the heap (mtfree validates remote frees before queueing them), so the words
+ * are only ever written whole, with relaxed atomic stores.
+ */
+#define SET_MAP_WORD(s, w, value) \
+    __atomic_store_n(&(s)->freeMap[w], (value), __ATOMIC_RELAXED)
+
+/*
+ * Offsets into the page: the header is at its start, and objects follow the
+ * header, ALIGNMENT-aligned. The last int of the page is the next block's
+ * header tag.
+ */
+#define SLAB_OBJECTS_OFFSET ((int) ((sizeof(slab) + ALIGNMENT - 1) \
+                                                     & ~(ALIGNMENT - 1)))
+#define SLAB_OBJECTS_END ((int) (SLAB_SIZE - sizeof(int)))
+
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Returns the start of the page containing ptr.
+ */
+static unsigned char *pageOf(unsigned char *ptr)
+{
+    return (unsigned char *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+
+/*!
+ * Returns the slab header for an object in it.
+ */
+static slab *slabOf(unsigned char *ptr)
+{
+    return (slab *) pageOf(ptr);
+}
+
+
+/*!
+ * Returns the address of the first object of a slab.
+ */
+static unsigned char *objectsOf(slab *s)
+{
+    return (unsigned char *) s + SLAB_OBJECTS_OFFSET;
+}
+
+
+/*!
+ * Returns the index of the slab class that objects of size bytes go in.
+ */
+static int classOf(int size)
+{
+    int c = 0;
+    while (classSizes[c] < size)
+    {
+        c++;
+    }
+    return c;
+}
+
+
+static void addSlab(myheap *heap, slab *s)
+{
+    s->prev = NULL;
+    s->next = heap->partialSlabs[s->sizeClass];
+    if (s->next != NULL)
+    {
+        s->next->prev = s;
+    }
+    heap->partialSlabs[s->sizeClass] = s;
+}
+
+
+static void removeSlab(myheap *heap, slab *s)
+{
+    if (s->prev == NULL)
+    {
+        heap->partialSlabs[s->sizeClass] = s->next;
+    }
+    else
+    {
+        s->prev->next = s->next;
+    }
+    if (s->next != NULL)
+    {
+        s->next->prev = s->prev;
+    }
+}
+
+
+/*!
+ * Carves a new slab for class c out of the heap and puts it on the partial
+ * list. Returns NULL if the heap has no room for another page.
+ */
+static slab *newSlab(myheap *heap, int c)
+{
+    unsigned char *page = allocAligned(heap, SLAB_SIZE,
+                                       SLAB_SIZE - sizeof(int));
+    if (page == NULL)
+    {
+        return NULL;
+    }
+    setPageFlags(heap, page, pageFlags(heap, page) | PAGE_SLAB);
+
+    slab *s = (slab *) page;
+    s->sizeClass = c;
+    s->objSize = classSizes[c];
+    s->capacity = (SLAB_OBJECTS_END - SLAB_OBJECTS_OFFSET) / s->objSize;
+    s->used = 0;
+    for (int w = 0; w < SLAB_MAP_WORDS; w++)
+    {
+        int bits = s->capacity - 64 * w;
+        if (bits >= 64)
+        {
+            SET_MAP_WORD(s, w, ~0ULL);
+        }
+        else
+        {
+            SET_MAP_WORD(s, w, bits > 0 ? (1ULL << bits) - 1 : 0);
+        }
+    }
+    addSlab(heap, s);
+    return s;
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Slab functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Returns the page map entry for the page containing ptr, which must be in
+ * the heap's pool.
+ */
+static unsigned char *pageEntry(myheap *heap, unsigned char *ptr)
+{
+    return heap->pageMap + ((uintptr_t) ptr - (uintptr_t) heap->firstPage)
+                                                                / SLAB_SIZE;
+}
+
+
+/*!
+ * Returns the page map flags for the page containing ptr. isSlabObject reads
+ * them without holding whatever lock guards the heap (mtfree validates remote
+ * frees before queueing them), while the scavenger's flags on a slab's page
+ * may be changing, so entries are only ever read and written whole, with
+ * relaxed atomics. The PAGE_SLAB flag itself cannot change while the slab
+ * still has objects.
+ */
+int pageFlags(myheap *heap, unsigned char *ptr)
+{
+    return __atomic_load_n(pageEntry(heap, ptr), __ATOMIC_RELAXED);
+}
+
+
+/*!
+ * Sets the page map flags for the page containing ptr (see pageFlags).
+ */
+void setPageFlags(myheap *heap, unsigned char *ptr, int flags)
+{
+    __atomic_store_n(pageEntry(heap, ptr), flags, __ATOMIC_RELAXED);
+}
+
+
+/*!
+ * Sets up the page map, if the pool has room for at least SLAB_MIN_PAGES
+ * pages (smaller pools would lose too much of themselves to a single slab,
+ * and have little to give back to the system), and turns slabs on if they
+ * are enabled. A growable pool is judged by the size it can grow to, and its
+ * map covers all of that. The map comes straight from the system so the
+ * allocator never depends on malloc; untouched pages of it cost nothing.
+ */
+void slabInit(myheap *heap)
+{
+    heap->pageMap = NULL;
+    heap->useSlabs = 0;
+    for (int c = 0; c < SLAB_CLASSES; c++)
+    {
+        heap->partialSlabs[c] = NULL;
+    }
+    unsigned char *endptr = heap->reserved != 0 ? heap->buf + heap->reserved
+                                                : heap->mem + heap->size;
+    if (endptr - heap->mem < SLAB_MIN_PAGES * SLAB_SIZE)
+    {
+        return;
+    }
+
+    uintptr_t first = (uintptr_t) heap->mem & ~(uintptr_t) (SLAB_SIZE - 1);
+    uintptr_t end = (uintptr_t) endptr;
+    heap->firstPage = (unsigned char *) first;
+    heap->numPages = (end - first + SLAB_SIZE - 1) / SLAB_SIZE;
+    void *map = mmap(NULL, heap->numPages, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED)
+    {
+        heap->pageMap = (unsigned char *) map;
+        heap->useSlabs = USE_SLABS;
+    }
+}
+
+
+/*!
+ * Releases the page map. The slabs themselves are blocks of the pool.
+ */
+void slabFini(myheap *heap)
+{
+    if (heap->pageMap != NULL)
+    {
+        munmap(heap->pageMap, heap->numPages);
+        heap->pageMap = NULL;
+    }
+}
+
+
+/*!
+ * Returns nonzero if ptr lies in one of the heap's slabs. Constant time.
+ */
+int isSlabObject(myheap *heap, unsigned char *ptr)
+{
+    if (heap->pageMap == NULL || ptr < heap->mem
+                              || ptr >= heap->mem + heap->size)
+    {
+        return 0;
+    }
+    return pageFlags(heap, ptr) & PAGE_SLAB;
+}
+
+
+/*!
+ * Allocates an object of the smallest class that holds size bytes, from a
+ * partially used slab of that class or else from a new slab. Returns NULL if
+ * no slab has room and no new slab can be carved, so the caller can fall back
+ * to an ordinary block.
+ */
+unsigned char *slabAlloc(myheap *heap, int size)
+{
+    int c = classOf(size);
+    slab *s = heap->partialSlabs[c];
+    if (s == NULL)
+    {
+        s = newSlab(heap, c);
+        if (s == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    int w = 0;
+    while (s->freeMap[w] == 0)
+    {
+        w++;
+    }
+    int bit = __builtin_ctzll(s->freeMap[w]);
+    SET_MAP_WORD(s, w, s->freeMap[w] & ~(1ULL << bit));
+    if (++s->used == s->capacity)
+    {
+        removeSlab(heap, s); /* full, so no longer a candidate */
+    }
+    return objectsOf(s) + (64 * w + bit) * s->objSize;
+}
+
+
+/*!
+ * Frees a slab object, which must be allocated (see slabValid). A slab that
+ * was full becomes a candidate for allocation again, and a slab that becomes
+ * empty goes back to the heap unless it is its class's only candidate.
+ */
+void slabFree(myheap *heap, unsigned char *oldptr)
+{
+    slab *s = slabOf(oldptr);
+    int index = (oldptr - objectsOf(s)) / s->objSize;
+    int w = index / 64;
+    SET_MAP_WORD(s, w, s->freeMap[w] | 1ULL << (index % 64));
+
+    if (s->used-- == s->capacity)
+    {
+        addSlab(heap, s);
+    }
+    if (s->used == 0 && (s->prev != NULL || s->next != NULL))
+    {
+        removeSlab(heap, s);
+        setPageFlags(heap, oldptr, pageFlags(heap, oldptr) & ~PAGE_SLAB);
+        myheap_free(heap, (unsigned char *) s);
+    }
+}
+
+
+/*!
+ * Returns the object size of the slab holding ptr.
+ */
+int slabObjectSize(unsigned char *ptr)
+{
+    return slabOf(ptr)->objSize;
+}
+
+
+/*!
+ * Validity check for a slab object being freed: ptr must be the start of an
+ * object, and that object must be allocated.
+ */
+int slabValid(unsigned char *ptr)
+{
+    slab *s = slabOf(ptr);
+    int offset = ptr - objectsOf(s);
+    if (offset < 0 || offset % s->objSize != 0
+                   || offset / s->objSize >= s->capacity)
+    {
+        return 0;
+    }
+    int index = offset / s->objSize;
+    unsigned long long word = __atomic_load_n(&s->freeMap[index / 64],
+                                              __ATOMIC_RELAXED);
+    return (word & (1ULL << (index % 64))) == 0;
+}
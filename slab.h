@@ -0,0 +1,47 @@
+/*! \file
+ * Declarations for the slab front end of a heap. Tiny objects are packed into
+ * page-sized slabs carved out of the heap's memory pool, one size class per
+ * slab, with no per-object tags: a bitmap in each slab records which objects
+ * are free, and the object size is recovered from the slab.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/*
+ * Sets up the slab metadata for a heap whose pool is large enough for slabs
+ * to pay off, and leaves slabs off otherwise.
+ */
+void slabInit(myheap *heap);
+
+
+/* Releases the slab metadata of a heap. */
+void slabFini(myheap *heap);
+
+
+/* Returns the page map flags (PAGE_*) for the page of the pool holding ptr. */
+int pageFlags(myheap *heap, unsigned char *ptr);
+
+
+/* Sets the page map flags for the page of the pool holding ptr. */
+void setPageFlags(myheap *heap, unsigned char *ptr, int flags);
+
+
+/* Returns nonzero if ptr is in one of the heap's slabs. */
+int isSlabObject(myheap *heap, unsigned char *ptr);
+
+
+/* Allocates an object of at most SLAB_MAX_SIZE bytes, NULL if no room. */
+unsigned char *slabAlloc(myheap *heap, int size);
+
+
+/* Frees an object for which isSlabObject is true. */
+void slabFree(myheap *heap, unsigned char *oldptr);
+
+
+/* Returns the object size of the slab holding ptr. */
+int slabObjectSize(unsigned char *ptr);
+
+
+/* Returns 1 if ptr is a currently allocated object of its slab, else 0. */
+int slabValid(unsigned char *ptr);
@@ -0,0 +1,164 @@
+/*! \file
+ * Implementation of heap statistics.
+ *
+ * Most of the statistics cost nothing extra to keep: the byte totals are the
+ * running counters verification already relies on (see verify.c), and the
+ * rest of heap_stats is a handful of increments on the paths that split,
+ * coalesce, fail or reallocate, plus one histogram bucket per request. Only
+ * the largest free block, and with it the fragmentation index, is looked for
+ * when the statistics are taken, which the TLSF and tree indexes do in about
+ * constant and logarithmic time, and the free list by a scan.
+ *
+ * Reports come as text for people or as a single JSON object for monitoring,
+ * with the same names in both. The histogram is trimmed after its last
+ * non-empty bucket, so it stays short.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "myalloc.h"
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Appends to a report being written into buf, snprintf style: *len counts
+ * every byte of the report, whether or not it still fitted.
+ */
+static void appendf(char *buf, size_t size, size_t *len, const char *format,
+                                                         ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *at = *len < size ? buf + *len : NULL;
+    int n = vsnprintf(at, at != NULL ? size - *len : 0, format, args);
+    va_end(args);
+    if (n > 0)
+    {
+        *len += n;
+    }
+}
+
+
+/*!
+ * Returns the number of histogram buckets up to the last non-empty one.
+ */
+static int usedBuckets(const heap_stats *stats)
+{
+    int n = STATS_BUCKETS;
+    while (n > 0 && stats->requests[n - 1] == 0)
+    {
+        n--;
+    }
+    return n;
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Statistics functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Copies the counters the heap keeps, and fills in the rest.
+ */
+void myheap_stats(myheap *heap, heap_stats *stats)
+{
+    *stats = heap->stats;
+    stats->poolBytes = heap->size;
+    stats->allocBytes = heap->allocBytes;
+    stats->freeBytes = heap->freeBytes;
+    stats->largeBytes = heap->largeBytes;
+    node *largest = findLargest(heap);
+    stats->largestFree = largest == NULL ? 0
+                                         : SPACE_OF(largest->tag) + sizeof(int);
+    stats->fragmentation = stats->freeBytes == 0 ? 0.0
+                         : 1.0 - (double) stats->largestFree / stats->freeBytes;
+}
+
+
+/*!
+ * The fragmentation index is the share of free memory outside the largest
+ * free block: 0 when it is all one block (or there is none), and close to 1
+ * when the largest block is only a sliver of it, so that big requests fail
+ * even though plenty of memory is free.
+ */
+double myheap_fragmentation(myheap *heap)
+{
+    heap_stats stats;
+    myheap_stats(heap, &stats);
+    return stats.fragmentation;
+}
+
+
+/*!
+ * Histogram buckets are written as their lowest size (0, 1, 2, 4, ...), in
+ * text one per line for the non-empty ones, and in JSON as an array indexed
+ * by bucket (see STATS_BUCKET).
+ */
+int myheap_format_stats(const heap_stats *stats, int format, char *buf,
+                                                 size_t size)
+{
+    size_t len = 0;
+    int buckets = usedBuckets(stats);
+    if (size > 0)
+    {
+        buf[0] = '\0';
+    }
+
+    if (format == STATS_JSON)
+    {
+        appendf(buf, size, &len, "{\"pool_bytes\":%zu,\"alloc_bytes\":%zu,"
+                "\"alloc_blocks\":%zu,\"free_bytes\":%zu,\"free_blocks\":%zu,"
+                "\"largest_free\":%zu,\"large_bytes\":%zu,"
+                "\"fragmentation\":%.4f,\"splits\":%zu,\"coalesces\":%zu,"
+                "\"failed_requests\":%zu,\"realloc_in_place\":%zu,"
+                "\"realloc_moved\":%zu,\"requests\":[",
+                stats->poolBytes, stats->allocBytes, stats->allocBlocks,
+                stats->freeBytes, stats->freeBlocks, stats->largestFree,
+                stats->largeBytes, stats->fragmentation, stats->splits,
+                stats->coalesces, stats->failedRequests,
+                stats->reallocInPlace, stats->reallocMoved);
+        for (int i = 0; i < buckets; i++)
+        {
+            appendf(buf, size, &len, i == 0 ? "%zu" : ",%zu",
+                                              stats->requests[i]);
+        }
+        appendf(buf, size, &len, "]}\n");
+        return len;
+    }
+
+    appendf(buf, size, &len,
+            "pool_bytes        %zu\n"
+            "alloc_bytes       %zu in %zu blocks\n"
+            "free_bytes        %zu in %zu blocks, largest %zu\n"
+            "large_bytes       %zu\n"
+            "fragmentation     %.4f\n"
+            "splits            %zu\n"
+            "coalesces         %zu\n"
+            "failed_requests   %zu\n"
+            "realloc           %zu in place, %zu moved\n"
+            "requests\n",
+            stats->poolBytes, stats->allocBytes, stats->allocBlocks,
+            stats->freeBytes, stats->freeBlocks, stats->largestFree,
+            stats->largeBytes, stats->fragmentation, stats->splits,
+            stats->coalesces, stats->failedRequests, stats->reallocInPlace,
+            stats->reallocMoved);
+    for (int i = 0; i < buckets; i++)
+    {
+        if (stats->requests[i] != 0)
+        {
+            appendf(buf, size, &len, "  >= %-12zu  %zu\n",
+                    i == 0 ? 0 : (size_t) 1 << (i - 1), stats->requests[i]);
+        }
+    }
+    return len;
+}
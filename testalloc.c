@@ -10,16 +10,36 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "errno.h"
 #include "myalloc.h"
+#include "slab.h"
+#include "large.h"
+#include "mtalloc.h"
 #include "sequence.h"
+#include "dump.h"
+#include "trace.h"
+#include "perfcount.h"
 
 #define VERBOSE 0
 
 #define DEFAULT_MAX_ALLOCATION 16000
 #define DEFAULT_RANDOM_SEED 1
+#define DEFAULT_ALLOCATION_FACTOR 11
 
 // some random numbers...
 int random_int(int max) {
@@ -40,57 +60,33 @@ int random_block_size(int max_value) {
 
 }
 
-int random_byte() {
-  return random_int(256) - 1;
-}
-
-// fill in block p2 of length len with data from p1
-void fill_data(unsigned char *p1, unsigned char *p2, int len) {
-  int i;
-  unsigned char *ptr1, *ptr2;
-  ptr1 = p1;
-  ptr2 = p2;
-
-  if (VERBOSE) {   // very verbose (for debugging)
-    printf("now filling %p from %p to length %d\n", p2, p1, len);
-  }
-
-  for (i = 0; i < len; i++) {
-    *ptr2 = *ptr1;
-    if (VERBOSE) {    // very verbose
-      printf("now writing %p<-%u (from %p)\n", ptr2, *ptr2, ptr1);
-    }
-    ptr1++;
-    ptr2++;
-  }
-}
-
-
 // try applying sequence
 int try_sequence(SEQLIST *test_sequence, int mem_size) {
-  SEQLIST *sptr;
+  size_t i, length = seq_length(test_sequence);
+  seq_op *op;
   unsigned char *mblock;
 
   // reset the memory allocator being tested
   MEMORY_SIZE = mem_size;
   init_myalloc();
 
-  for (sptr = test_sequence; !seq_null(sptr); sptr = seq_next(sptr)) {
-    if (seq_alloc(sptr)) {     // allocate a block
-      mblock = myalloc(seq_size(sptr));
+  for (i = 0; i < length; i++) {
+    op = seq_at(test_sequence, i);
+    if (seq_alloc(op)) {     // allocate a block
+      mblock = myalloc(seq_size(op));
       if (mblock == 0) {
         return 0; // failed -- return indication
       }
       else {
         // keep track of address allocated (for later frees)
-        seq_set_myalloc_block(sptr, mblock);
+        seq_set_myalloc_block(op, mblock);
         // put data in the block
         //  (so we can test that it holds data w/out corruption)
-        fill_data(seq_ref_block(sptr), mblock, seq_size(sptr));
+        seq_fill(test_sequence, i, mblock);
       }
     }
     else {    // dealloc
-      myfree(seq_myalloc_block(seq_tofree(sptr)));
+      myfree(seq_myalloc_block(seq_at(test_sequence, seq_tofree(op))));
     }
   }
 
@@ -109,7 +105,7 @@ int binary_search_required_memory(SEQLIST *test_sequence, int low, int high) {
     return high;
   }
   else {
-    mid = (low + high + 1) / 2;
+    mid = low + (high - low + 1) / 2;
     if (try_sequence(test_sequence, mid)) {
       close_myalloc();
       if (VERBOSE)
@@ -128,84 +124,26 @@ int binary_search_required_memory(SEQLIST *test_sequence, int low, int high) {
 }
 
 
-// allocate (from normal malloc) a block of size blocks
-//  and put data into it
-// This supports data integrity tests.
-unsigned char *allocate_and_fill(int size) {
-  unsigned char *result;
-  unsigned char *ptr;
-
-  result = (unsigned char *) malloc(size);
-  if (result == (unsigned char *) 0) {
-    fprintf(stderr,"real memory system out of memory.\n");
-    abort();
-  }
-
-  if (VERBOSE) {
-      printf("ref fill for %p\n", result);
-  }
-
-  for (ptr = result; ptr < result + size; ptr++) {
-    *ptr = random_byte();
-    if (VERBOSE) {     // very
-      printf("\tputting %u in %p\n", *ptr, ptr);
-    }
-  }
-
-  return result;
-}
-
-
-// check if p1 and p2 contain the same data up to length len
-// This is used to check buffer has not been corrupted
-int same_data(unsigned char *p1, unsigned char *p2, int len) {
-  int i;
-  int result;
-  unsigned char *ptr1, *ptr2;
-
-  ptr1 = p1;
-  ptr2 = p2;
-
-  result = 1;
-
-  for (i = 0; i < len; i++) {
-    if (*ptr1 != *ptr2) {
-      if (VERBOSE) {
-        printf("error at %p (%d/%d): got %u expect %u (from %p base %p)\n",
-               ptr2, i, len, *ptr2, *ptr1, ptr1, p1);
-      }
-      result = 0;
-    }
-    ptr1++;
-    ptr2++;
-  }
-
-  return result;
-}
-
-
 // check all still allocated blocks in a test sequence
 //  contain the data originally placed into them
 //  i.e. have not been corrupted
 int check_data(SEQLIST *test_sequence) {
   int result;
-  SEQLIST *current;
+  size_t n, i;
 
   result = 0; // stays zero if no errors
 
-  for (current = test_sequence; !seq_null(current); current = seq_next(current)) {
-    // only check if an allocate which has not been freed
-    if (seq_alloc(current) && !seq_freed(current)) {
-      if (!same_data(seq_ref_block(current), seq_myalloc_block(current),
-                     seq_size(current))) {
-        if (VERBOSE) {
-          printf("Mismatch in sequence starting at:\n");
-          seq_print(current);
-        }
-
-        // returning a 1 means it failed
-        result = 1;
+  // only the blocks never freed are left to check
+  for (n = 0; n < seq_live_count(test_sequence); n++) {
+    i = seq_live(test_sequence, n);
+    if (!seq_same_data(test_sequence, i,
+                       seq_myalloc_block(seq_at(test_sequence, i)))) {
+      if (VERBOSE) {
+        printf("Mismatch in the block allocated at %zu\n", i);
       }
+
+      // returning a 1 means it failed
+      result = 1;
     }
   }
 
@@ -221,67 +159,46 @@ int check_data(SEQLIST *test_sequence) {
 //   and allocates a total of max_used_memory*allocation_factor
 SEQLIST *generate_sequence(int max_used_memory, int allocation_factor) {
   int used_memory = 0;
-  int total_allocated = 0;
+  long long total_allocated = 0;
   int next_block_size = 0;
-  int allocated_blocks = 0;
   int actual_max_used_memory = 0;
+  size_t tofree;
 
-  SEQLIST *test_sequence = NULL;
-  SEQLIST *tail_sequence = NULL;
-
-  unsigned char *new_block_ref;
+  // the reference data is drawn from the same random seed as the sizes
+  uint64_t seed = ((uint64_t) rand() << 31) ^ (uint64_t) rand();
+  SEQLIST *test_sequence = seq_create(seed);
 
-  while (total_allocated < allocation_factor * max_used_memory) {
+  while (total_allocated < (long long) allocation_factor * max_used_memory) {
     next_block_size = random_block_size(max_used_memory);
 
     // first see if we need to free anything in order to
     //  accommodate the new allocation
     while (used_memory + next_block_size > max_used_memory) {
       // randomly pick a block to free
-      SEQLIST *tofree =
-        find_nth_allocated_block(test_sequence, random_int(allocated_blocks));
-
-      // add the free
-      tail_sequence = seq_set_next_free(tofree, tail_sequence);
+      tofree = random_int(seq_live_count(test_sequence)) - 1;
 
       // reclaim the memory
-      used_memory -= seq_size(tofree);
-      allocated_blocks--;
+      used_memory -= seq_size(seq_at(test_sequence,
+                                     seq_live(test_sequence, tofree)));
 
-      // mark the old block as something that has been freed
-      seq_free(tofree);
+      // add the free, which takes the block out of the live set
+      seq_add_free(test_sequence, tofree);
     }
 
-    // allocate a reference buffer for the new block
-    new_block_ref = allocate_and_fill(next_block_size);
-
     // now allocate that block
-    if (seq_null(test_sequence)) {
-      // special case for first allocation
-      test_sequence = seq_add_front(next_block_size, new_block_ref, (SEQLIST *) 0);
-      tail_sequence = test_sequence;
-    }
-    else {
-      // typical case we add at the end
-      tail_sequence =
-        seq_set_next_allocate(next_block_size, new_block_ref, tail_sequence);
-    }
-
-    // debug
-    //seq_print(tail_sequence); // just prints the new one
+    seq_add_allocate(test_sequence, next_block_size);
 
     total_allocated += next_block_size;
     used_memory += next_block_size;
 
     if (used_memory > actual_max_used_memory)
       actual_max_used_memory = used_memory;
-
-    allocated_blocks++;
   }
 
   // just so can manually see this is doing something sensible
   printf("Actual maximum memory usage %d (%f)\n", actual_max_used_memory,
          ((double) actual_max_used_memory / (double) max_used_memory));
+  printf("Sequence of %zu operations\n", seq_length(test_sequence));
 
   return test_sequence;
 }
@@ -353,183 +270,2382 @@ done:
 
 }
 
-// Allocates chunks of the given size until unable to anymore, then
-// deallocates all of them - returns the number of chunks allocated.
-int uniform_chunks(int chunk_size, int memory_size) {
-  unsigned char ** pointers =
-    malloc(sizeof(unsigned char *) * memory_size / chunk_size);
-  unsigned char * p;
-  int chunks = -1;
-  do {
-    chunks++;
-    p = myalloc(chunk_size);
-    pointers[chunks] = p;
-  } while (p != NULL);
+// A basic test that separate heaps are independent: filling one heap
+// neither uses up nor corrupts the others, including one set up over a
+// caller-provided buffer.
+void heap_instance_test() {
+  static unsigned char buffer[1024];
+  myheap local;
+  myheap *heaps[3];
+  unsigned char *blocks[3][16];
+  int counts[3];
+  int failure = 0;
 
-  for (int i = 0; i < chunks; i++) {
-    myfree(pointers[i]);
+  printf("Performing a basic test of independent heaps.\n");
+
+  heaps[0] = myheap_create(1024);
+  heaps[1] = myheap_create(1024);
+  myheap_init(&local, buffer, sizeof(buffer));
+  heaps[2] = &local;
+  if (heaps[0] == NULL || heaps[1] == NULL) {
+    printf("Couldn't create two heaps of 1024 bytes.\n");
+    failure = 1;
+    goto done;
   }
 
-  free(pointers);
-  return chunks;
+  // fill the heaps in turn, each block marked with its heap's number
+  for (int h = 0; h < 3; h++) {
+    counts[h] = 0;
+    while (counts[h] < 16) {
+      unsigned char *p = myheap_alloc(heaps[h], 100);
+      if (p == NULL)
+        break;
+      for (int i = 0; i < 100; i++)
+        p[i] = h;
+      blocks[h][counts[h]++] = p;
+    }
+    if (counts[h] != counts[0]) {
+      printf("Heap %d held %d blocks, but heap 0 held %d.\n", h, counts[h],
+             counts[0]);
+      failure = 1;
+    }
+  }
+
+  for (int h = 0; h < 3; h++) {
+    for (int b = 0; b < counts[h]; b++) {
+      for (int i = 0; i < 100; i++) {
+        if (blocks[h][b][i] != h) {
+          printf("Block %d of heap %d was corrupted.\n", b, h);
+          failure = 1;
+          break;
+        }
+      }
+      myheap_free(heaps[h], blocks[h][b]);
+    }
+  }
+
+done:
+  if (!failure) {
+    printf("Passed independent heaps test.\n");
+  }
+  if (heaps[0] != NULL)
+    myheap_destroy(heaps[0]);
+  if (heaps[1] != NULL)
+    myheap_destroy(heaps[1]);
+  myheap_destroy(&local);
 }
 
-// Basic correctness test -
-// allocates a bunch of uniformly-sized chunks, deallocates all of them, and
-// repeats a few times, making sure it works every time - no leaks in the
-// user pool. This actually won't give much more information than the other
-// test, which is more rigorous.
-int uniform_chunk_test() {
-  int chunk_size = 256;
-  int repetitions = 10;
-  int chunks = 0;
+// Per-thread state for the thread-safe allocator test.
+typedef struct mt_worker {
+  int id;
+  int ops;
+  int failure;
+} MT_WORKER;
+
+#define MT_SLOTS 64
+
+// Churns through ops random allocations and frees, checking that every
+// block still holds the pattern written into it when it is freed.
+void *mt_worker_run(void *arg) {
+  MT_WORKER *worker = (MT_WORKER *) arg;
+  unsigned char *slots[MT_SLOTS] = {0};
+  int sizes[MT_SLOTS];
+  unsigned int rnd = worker->id + 1;
+
+  for (int op = 0; op < worker->ops; op++) {
+    int i = rand_r(&rnd) % MT_SLOTS;
+    if (slots[i] == NULL) {
+      sizes[i] = 1 + rand_r(&rnd) % 512;
+      slots[i] = mtalloc(sizes[i]);
+      if (slots[i] != NULL)
+        memset(slots[i], worker->id, sizes[i]);
+    }
+    else {
+      for (int b = 0; b < sizes[i]; b++) {
+        if (slots[i][b] != (unsigned char) worker->id) {
+          worker->failure = 1;
+          break;
+        }
+      }
+      mtfree(slots[i]);
+      slots[i] = NULL;
+    }
+  }
+  for (int i = 0; i < MT_SLOTS; i++) {
+    if (slots[i] != NULL)
+      mtfree(slots[i]);
+  }
+  return NULL;
+}
+
+// Runs the churn on 1, 2 and 4 threads at once against the thread-safe
+// allocator, checking for corruption and reporting throughput.
+void mt_test() {
+  int ops = 200000;
   int failure = 0;
 
-  MEMORY_SIZE = 16000;
+  printf("Performing the thread-safe allocator test.\n");
 
-  printf("Performing the basic uniform chunks test.\n");
+  for (int threads = 1; threads <= 4; threads *= 2) {
+    pthread_t tids[4];
+    MT_WORKER workers[4];
+    struct timespec start, end;
 
-  init_myalloc();
+    init_mtalloc(threads, 64 * 1024);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < threads; t++) {
+      workers[t].id = t;
+      workers[t].ops = ops;
+      workers[t].failure = 0;
+      pthread_create(&tids[t], NULL, mt_worker_run, &workers[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+      pthread_join(tids[t], NULL);
+      failure |= workers[t].failure;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close_mtalloc();
 
-  chunks = uniform_chunks(chunk_size, MEMORY_SIZE);
+    double seconds = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d thread(s): %.0f ops/second\n", threads,
+           threads * ops / seconds);
+  }
 
-  printf("Allocated %d uniform chunks on a first pass.\n"
-          "Theoretical maximum: %d\n", chunks, MEMORY_SIZE / chunk_size);
-  if (chunks < MEMORY_SIZE / (chunk_size + 64)) {
-    printf("not enough uniform chunks could be allocated.\n"
-            "Too much overhead in memory allocator.\n");
-    failure = 1;
+  if (failure)
+    printf("Data corrupted in thread-safe allocator test.\n");
+  else
+    printf("Passed thread-safe allocator test.\n");
+}
+
+// Shared state for the producer/consumer test: the producer publishes
+// blocks by bumping produced, and the consumer frees them and bumps consumed.
+#define PC_BLOCKS 100000
+#define PC_IN_FLIGHT 1000
+unsigned char *pc_blocks[PC_BLOCKS];
+volatile int pc_produced;
+volatile int pc_consumed;
+
+void *pc_consumer_run(void *arg) {
+  int *failure = (int *) arg;
+  for (int i = 0; i < PC_BLOCKS; i++) {
+    while (__atomic_load_n(&pc_produced, __ATOMIC_ACQUIRE) <= i)
+      ;
+    if (pc_blocks[i] == NULL)  // the producer gave up
+      break;
+    if (pc_blocks[i][0] != (unsigned char) i)
+      *failure = 1;
+    mtfree(pc_blocks[i]);
+    __atomic_store_n(&pc_consumed, i + 1, __ATOMIC_RELEASE);
   }
-  for (int i = 1; i < repetitions; i++) {
-    if (uniform_chunks(chunk_size, MEMORY_SIZE) != chunks) {
-      printf("Could not allocate %d chunks on round %d.\n"
-              "Uniform chunk test FAILED.\n", chunks, i);
+  return NULL;
+}
+
+// One thread allocates blocks and another frees them, so every free is a
+// remote free into the producer's arena. The arenas hold only a small part
+// of everything allocated, so the producer only keeps going if those frees
+// find their way back.
+void remote_free_test() {
+  pthread_t consumer;
+  int failure = 0;
+
+  printf("Performing the cross-thread free test.\n");
+
+  init_mtalloc(2, 1024 * 1024);
+  pc_produced = 0;
+  pc_consumed = 0;
+  pthread_create(&consumer, NULL, pc_consumer_run, &failure);
+  for (int i = 0; i < PC_BLOCKS; i++) {
+    unsigned char *p;
+    // don't get too far ahead of the consumer
+    while (i - __atomic_load_n(&pc_consumed, __ATOMIC_ACQUIRE) >= PC_IN_FLIGHT)
+      ;
+    p = mtalloc(1 + i % 400);
+    pc_blocks[i] = p;
+    if (p != NULL)
+      p[0] = i;
+    __atomic_store_n(&pc_produced, i + 1, __ATOMIC_RELEASE);
+    if (p == NULL) {
+      printf("Remote frees were not returned to the producer's arena.\n");
       failure = 1;
       break;
     }
   }
+  pthread_join(consumer, NULL);
+  close_mtalloc();
 
-  if (!failure)
-    printf("Passed uniform chunks test.\n");
-
-  close_myalloc();
-  return 0;
-
+  if (failure)
+    printf("Data corrupted in cross-thread free test.\n");
+  else
+    printf("Passed cross-thread free test.\n");
 }
 
+// Tests the slabs for tiny objects: a pool should hold more 16 byte objects
+// than it could if every object were a block with an int tag, the objects
+// must not overlap, and once they are all freed the same number should fit
+// again.
+void slab_test() {
+  int size = 16;
+  int failure = 0;
+  int counts[2];
+  myheap *heap;
 
-/* This test runs a series of random allocations and deallocations,
- * to see how much overhead is required by the allocator in question
- * for a certain number of bytes to be allocated.  During the test,
- * the allocated regions are verified to not overlap with each other,
- * and so forth.
- */
-void utilization_test(int max_allocation) {
-  int max_used_memory;
-  int allocation_factor;
-  int memory_required;
+  printf("Performing the tiny object slab test.\n");
 
-  SEQLIST *test_sequence;
+  heap = myheap_create((SLAB_MIN_PAGES + 1) * SLAB_SIZE);
+  int max_blocks = heap->size / size;
+  unsigned char **objects = malloc(max_blocks * sizeof(unsigned char *));
 
-  max_used_memory = max_allocation;
-  allocation_factor = 11;
+  for (int round = 0; round < 2; round++) {
+    int n = 0;
+    unsigned char *p;
+    while (n < max_blocks && (p = myheap_alloc(heap, size)) != NULL) {
+      memset(p, n, size);
+      objects[n++] = p;
+    }
+    counts[round] = n;
+    for (int i = 0; i < n; i++) {
+      for (int b = 0; b < size; b++) {
+        if (objects[i][b] != (unsigned char) i) {
+          failure = 1;
+          break;
+        }
+      }
+      myheap_free(heap, objects[i]);
+    }
+  }
 
-  printf("running with MAX_USED_MEMORY=%d and ALLOCATION_FACTOR=%d\n",
-    max_used_memory, allocation_factor);
+  printf("Allocated %d objects of %d bytes in a %zu byte pool.\n", counts[0],
+         size, heap->size);
+  if (failure) {
+    printf("Slab objects overlapped.\n");
+  }
+  else if (counts[0] <= heap->size / (size + (int) sizeof(int))) {
+    printf("Tiny objects are not being packed into slabs.\n");
+    failure = 1;
+  }
+  else if (counts[1] != counts[0]) {
+    printf("Only %d objects fit the second time.\n", counts[1]);
+    failure = 1;
+  }
 
-  test_sequence = generate_sequence(max_used_memory, allocation_factor);
-  if (VERBOSE)
-    seq_print(test_sequence);
+  if (!failure)
+    printf("Passed tiny object slab test.\n");
 
-  // check that allocation can actually do something.
-  // This becomes upper bound on binary search.
-  if (try_sequence(test_sequence, max_used_memory * allocation_factor * 2)) {
+  free(objects);
+  myheap_destroy(heap);
+}
 
-    // That call to try_sequence allocated a memory pool for myalloc, which
-    // is no longer in use.
-    close_myalloc();
+// Tests payload alignment: every payload must be ALIGNMENT-aligned, aligned
+// allocations must honor their alignment, and the slack trimmed off in front
+// of them must go back to the pool, so that once everything is freed the
+// whole pool can be allocated as one block again.
+void alignment_test() {
+  int failure = 0;
+  unsigned char *ptrs[64];
+  int n = 0;
+  myheap *heap;
 
-    // binary search for smallest MEMORY_SIZE which can accommodate
-    memory_required = binary_search_required_memory(test_sequence,
-      max_used_memory - 1, max_used_memory * allocation_factor * 2);
+  printf("Performing the alignment test.\n");
 
-    // run it one more time at the identified size.
-    // this makes sure that the data is set from a successful run.
-    if (try_sequence(test_sequence, memory_required)) {
-      // check if data contents are intact
-      if (check_data(test_sequence)) {
-        printf("Data integrity FAIL.\n");
-      }
-      else {
-        printf("Data integrity PASS.\n");
-      }
+  heap = myheap_create(256 * 1024);
+  int whole = heap->size - (int) sizeof(int);
 
-      // print statistics
-      printf("Memory utilization: (%d/%d)=%f\n", max_used_memory, memory_required,
-             ((double) max_used_memory / (double) memory_required));
-    }
-    else {
-      printf("Consistency problem: binary_search_required_memory "
-             "returned %d, but final test failed\n", memory_required);
-    }
+  for (int size = 1; size <= 200; size += 13) {
+    unsigned char *p = myheap_alloc(heap, size);
+    if (p == NULL || (uintptr_t) p % ALIGNMENT != 0)
+      failure = 1;
+    else
+      memset(p, 0xaa, size);
+    ptrs[n++] = p;
   }
-  else {
-    printf("Requires more memory than the no-free case.\n");
+  for (int alignment = 32; alignment <= 16384; alignment *= 2) {
+    unsigned char *p = myheap_alloc_aligned(heap, alignment, 100);
+    if (p == NULL || (uintptr_t) p % alignment != 0)
+      failure = 1;
+    else
+      memset(p, 0x55, 100);
+    ptrs[n++] = p;
   }
-  seq_cleanup(test_sequence);
-}
+  if (myheap_alloc_aligned(heap, 48, 100) != NULL)
+    failure = 1;
 
+  for (int i = 0; i < n; i++) {
+    if (ptrs[i] != NULL)
+      myheap_free(heap, ptrs[i]);
+  }
+  unsigned char *p = myheap_alloc(heap, whole);
+  if (p == NULL)
+    failure = 1;
+  else
+    myheap_free(heap, p);
+  myheap_destroy(heap);
+
+  // tiny requests come from slabs in a pool big enough to have them; take a
+  // few of each size, so that objects past the first of a slab are checked
+  heap = myheap_create((SLAB_MIN_PAGES + 1) * SLAB_SIZE);
+  for (int size = 1; size <= 24; size++) {
+    for (int k = 0; k < 3; k++) {
+      unsigned char *p = myheap_alloc_aligned(heap, 16, size);
+      if (p == NULL || (uintptr_t) p % 16 != 0
+          || (heap->useSlabs && !isSlabObject(heap, p)))
+        failure = 1;
+      else
+        memset(p, 0x33, size);
+    }
+  }
+  myheap_destroy(heap);
 
-void usage(char *program) {
-  printf("usage: %s [-s seed] [-m max_allocation]\n", program);
-  printf("\tRuns the myalloc tester.\n\n");
-  printf("\t-s seed sets the tester to use a specific random seed\n\n");
-  printf("\t-m max_allocation sets the maximum number of bytes that the\n");
-  printf("\ttester should try to allocate during utilization tests\n\n");
+  if (failure)
+    printf("Failed alignment test.\n");
+  else
+    printf("Passed alignment test.\n");
 }
 
+// Returns 1 if the first n bytes at p all have the given value.
+int check_bytes(unsigned char *p, int n, unsigned char value) {
+  for (int i = 0; i < n; i++) {
+    if (p[i] != value)
+      return 0;
+  }
+  return 1;
+}
 
-/* The main program, which calls the various tests to exercise the allocator. */
-int main(int argc, char *argv[]) {
-  unsigned int seed = DEFAULT_RANDOM_SEED;
-  int max_allocation = DEFAULT_MAX_ALLOCATION;
-  int c;
+// The library's functions, and what the nested calls of preload_test made.
+struct {
+  void *(*malloc)(size_t);
+  void (*free)(void *);
+  void *(*realloc)(void *, size_t);
+  size_t (*usable)(void *);
+  unsigned char *page;  // the protected page whose first touch makes them
+  void *freed;          // freed by a nested call
+  void *moved;          // reallocated by a nested call
+  void *boot;           // allocated by a nested call
+  size_t usable_size;   // of moved, from a nested call
+  int made;
+} nested;
+
+// Runs when the library's realloc first touches nested.page, in the middle
+// of the call, so that every call made here is a nested one.
+void preload_nested_calls(int sig, siginfo_t *info, void *context) {
+  mprotect(nested.page, SLAB_SIZE, PROT_READ | PROT_WRITE);
+  nested.usable_size = nested.usable(nested.moved);
+  nested.moved = nested.realloc(nested.moved, 100);
+  nested.free(nested.freed);
+  nested.boot = nested.malloc(10);
+  nested.made = 1;
+}
 
-  while ((c = getopt(argc, argv, "s:m:")) != -1) {
-    switch (c) {
-      case 's':    /* Random seed */
-        seed = atoi(optarg);
-        break;
+// Tests libmyalloc.so, loaded on the side so that it serves only the calls
+// made through it: everything it hands out, from malloc to memalign, must be
+// aligned for any type (16 bytes), however small the request. Calls made
+// from inside another call, here from a fault handler in the middle of a
+// realloc, must work too, and the heap blocks they free must be freed once
+// the outer call is done. Requests the library cannot serve must fail with
+// ENOMEM and print nothing, as a drop-in malloc has to.
+#define PRELOAD_LIBRARY "./libmyalloc.so"
+void preload_test() {
+  int failure = 0;
 
-      case 'p':
-        max_allocation = atoi(optarg);
-        if (max_allocation < 0)
-          printf("ERROR:  Max allocation must be nonnegative.\n");
-          usage(argv[0]);
-          return 1;
-        break;
+  printf("Performing the preload library test.\n");
 
-      case 'h':
-        usage(argv[0]);
-        return 1;
+  void *lib = dlopen(PRELOAD_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    printf("%s\nPreload library test skipped.\n", dlerror());
+    return;
+  }
+  void *(*lib_malloc)(size_t) = dlsym(lib, "malloc");
+  void (*lib_free)(void *) = dlsym(lib, "free");
+  void *(*lib_realloc)(void *, size_t) = dlsym(lib, "realloc");
+  int (*lib_posix_memalign)(void **, size_t, size_t) =
+    dlsym(lib, "posix_memalign");
+  void *(*lib_aligned_alloc)(size_t, size_t) = dlsym(lib, "aligned_alloc");
+  void *(*lib_memalign)(size_t, size_t) = dlsym(lib, "memalign");
+
+  void *ptrs[4 * 64];
+  int n = 0;
+  for (size_t size = 1; size <= 64; size++) {
+    void *p[4];
+    p[0] = lib_malloc(size);
+    if (lib_posix_memalign(&p[1], sizeof(void *) << (size % 2), size) != 0)
+      p[1] = NULL;
+    p[2] = lib_aligned_alloc(16, size);
+    p[3] = lib_realloc(lib_memalign(8, size), size + 1);
+    for (int k = 0; k < 4; k++) {
+      if (p[k] == NULL || (uintptr_t) p[k] % 16 != 0) {
+        printf("Request of %zu bytes got %p.\n", size, p[k]);
+        failure = 1;
+      }
+      ptrs[n++] = p[k];
+    }
+  }
+  for (int i = 0; i < n; i++)
+    lib_free(ptrs[i]);
+
+  // two objects of a slab, which the nested calls free and move; the slab's
+  // first two objects, so the next two allocations of the size get them back
+  nested.malloc = lib_malloc;
+  nested.free = lib_free;
+  nested.realloc = lib_realloc;
+  nested.usable = dlsym(lib, "malloc_usable_size");
+  nested.freed = lib_malloc(40);
+  nested.moved = lib_malloc(40);
+  void *old_moved = nested.moved;
+  memset(nested.moved, 0x77, 40);
+
+  // a block of the pool grown past the library's LARGE_THRESHOLD (1 MB),
+  // which always moves it to a mapping of its own, so realloc copies it
+  unsigned char *a = lib_malloc(64 * 1024);
+  memset(a, 0x5a, 64 * 1024);
+  nested.page = (unsigned char *) (((uintptr_t) a + 2 * SLAB_SIZE - 1)
+                                   & ~(uintptr_t) (SLAB_SIZE - 1));
+  struct sigaction action, old_action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = preload_nested_calls;
+  action.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &action, &old_action);
+  mprotect(nested.page, SLAB_SIZE, PROT_NONE);
+  nested.made = 0;
+  a = lib_realloc(a, 2 * 1024 * 1024);
+  sigaction(SIGSEGV, &old_action, NULL);
+
+  if (!nested.made) {
+    printf("The realloc made no nested calls.\n");
+    mprotect(nested.page, SLAB_SIZE, PROT_READ | PROT_WRITE);
+    failure = 1;
+  }
+  else {
+    if (a == NULL || !check_bytes(a, 64 * 1024, 0x5a)) {
+      printf("The outer realloc lost its data.\n");
+      failure = 1;
+    }
+    if (nested.usable_size < 40 || nested.moved == NULL
+        || !check_bytes(nested.moved, 40, 0x77) || nested.boot == NULL) {
+      printf("Nested calls failed.\n");
+      failure = 1;
+    }
+    void *again[2] = {lib_malloc(40), lib_malloc(40)};
+    if (!((again[0] == nested.freed && again[1] == old_moved)
+          || (again[0] == old_moved && again[1] == nested.freed))) {
+      printf("Blocks freed by nested calls were not freed.\n");
+      failure = 1;
+    }
+    lib_free(again[0]);
+    lib_free(again[1]);
+    nested.moved = lib_realloc(nested.moved, 200);
+    if (nested.moved == NULL || !check_bytes(nested.moved, 40, 0x77)) {
+      printf("Bootstrap memory lost its data moving to the heap.\n");
+      failure = 1;
     }
+    lib_free(nested.moved);
+    lib_free(nested.boot);
   }
+  lib_free(a);
+
+  // requests no pool or mapping can hold, with stderr caught in a pipe
+  int fds[2];
+  if (pipe(fds) == 0) {
+    int saved = dup(2);
+    dup2(fds[1], 2);
+    close(fds[1]);
+    errno = 0;
+    void *huge = lib_malloc(SIZE_MAX / 2);
+    int malloc_errno = errno;
+    void *huge_aligned = NULL;
+    int ret = lib_posix_memalign(&huge_aligned, 64, SIZE_MAX / 2);
+    dup2(saved, 2);
+    close(saved);
+    char buf[256];
+    ssize_t printed = read(fds[0], buf, sizeof(buf));
+    close(fds[0]);
+    if (huge != NULL || malloc_errno != ENOMEM || huge_aligned != NULL
+        || ret != ENOMEM) {
+      printf("Failed requests did not fail with ENOMEM.\n");
+      failure = 1;
+    }
+    if (printed != 0) {
+      printf("Failed requests wrote to stderr.\n");
+      failure = 1;
+    }
+  }
+  // the library's heap lives as long as the process, so it stays loaded
 
-  if (seed != DEFAULT_RANDOM_SEED)
-    printf("Using seed:  %u\n\n", seed);
+  if (!failure)
+    printf("Passed preload library test.\n");
+}
 
-  srand(seed);
+// Tests the compact block layout: with a header tag as the only overhead, a
+// pool must hold as many minimum (16 byte) blocks as it has room for, each
+// payload must be usable to its last byte without touching its neighbours,
+// and blocks freed in any order must coalesce back into one, backward
+// coalescing finding a free block's start by its footer alone.
+#define COMPACT_POOL 4096
+void compact_block_test() {
+  int failure = 0;
+  unsigned char *ptrs[COMPACT_POOL / ALIGNMENT];
+  int n = 0;
+  myheap *heap;
+
+  printf("Performing the compact block test.\n");
+
+  heap = myheap_create(COMPACT_POOL);
+  heap->verifyLevel = VERIFY_FULL;
+  int space = ALIGNMENT - (int) sizeof(int);
+  unsigned char *p;
+  while ((p = myheap_alloc(heap, space)) != NULL) {
+    if (payloadSize(heap, p) != space)
+      failure = 1;
+    memset(p, n, space);
+    ptrs[n++] = p;
+  }
+  printf("Allocated %d blocks of %d bytes in a %zu byte pool.\n", n, space,
+         heap->size);
+  if (n != heap->size / ALIGNMENT) {
+    printf("Minimum blocks took more than %d bytes each.\n", ALIGNMENT);
+    failure = 1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!check_bytes(ptrs[i], space, (unsigned char) i)) {
+      printf("Block %d was overwritten by its neighbours.\n", i);
+      failure = 1;
+      break;
+    }
+  }
 
-  // Do the basic test of coalescing behavior
-  coalesce_test();
-  printf("\n");
+  // every other block, then the rest from the end, so that each free
+  // coalesces both ways
+  for (int i = 0; i < n; i += 2)
+    myheap_free(heap, ptrs[i]);
+  for (int i = n % 2 == 0 ? n - 1 : n - 2; i > 0; i -= 2)
+    myheap_free(heap, ptrs[i]);
+  p = myheap_alloc(heap, heap->size - sizeof(int));
+  if (p == NULL) {
+    printf("Minimum blocks did not coalesce into one block.\n");
+    failure = 1;
+  }
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed compact block test.\n");
+}
+
+#define TLSF_SCAN_POOL 65536
+
+// Frees a block that fits a request of its own size (67 units) and then
+// others of the same bin (64 to 67 units) that do not, with every other free
+// block used up, so that only the scan of the request's own bin can find it,
+// behind the given number of blocks. Returns whether the request was served.
+int tlsf_scan_finds(int ahead) {
+  unsigned char *blocks[TLSF_SCAN_LIMIT + 1];
+  int saved = FREE_INDEX;
+  int found;
+
+  FREE_INDEX = INDEX_TLSF;
+  myheap *heap = myheap_create(TLSF_SCAN_POOL);
+  FREE_INDEX = saved;
+
+  // separators keep the freed blocks from coalescing
+  for (int i = 0; i <= ahead; i++) {
+    blocks[i] = myheap_alloc(heap, i == 0 ? 1068 : 1020);
+    myheap_alloc(heap, 12);
+  }
+  while (myheap_alloc(heap, 12) != NULL)
+    ;
+
+  // each free goes to the front of the bin, so the fitting block ends last
+  for (int i = 0; i <= ahead; i++)
+    myheap_free(heap, blocks[i]);
+  found = myheap_alloc(heap, 1068) != NULL;
+  myheap_destroy(heap);
+  return found;
+}
+
+// Tests that the TLSF index still finds a fitting block of the request's own
+// bin once nothing above it is free, but only looks at the first
+// TLSF_SCAN_LIMIT blocks of that bin.
+void tlsf_scan_test() {
+  int failure = 0;
+
+  printf("Performing the TLSF bin scan test.\n");
+
+  if (!tlsf_scan_finds(0) || !tlsf_scan_finds(TLSF_SCAN_LIMIT - 1)) {
+    printf("A fitting block of the request's own bin was not found.\n");
+    failure = 1;
+  }
+  if (tlsf_scan_finds(TLSF_SCAN_LIMIT)) {
+    printf("The bin was scanned past %d blocks.\n", TLSF_SCAN_LIMIT);
+    failure = 1;
+  }
+
+  if (!failure)
+    printf("Passed TLSF bin scan test.\n");
+}
+
+// Tests each way myheap_realloc can resize a block: growing into a free next
+// block and into a free previous block must happen in place (or move down
+// into the previous block), shrinking must give the tail back, and only a
+// block with no room around it may be copied elsewhere. The data must
+// survive every step, and a failed realloc must leave it alone.
+void realloc_test() {
+  int failure = 0;
+  myheap *heap;
+  unsigned char *a, *b, *c, *d, *p;
+
+  printf("Performing the in-place realloc test.\n");
+
+  heap = myheap_create(8192);
+  a = myheap_alloc(heap, 100);
+  b = myheap_alloc(heap, 100);
+  c = myheap_alloc(heap, 100);
+  d = myheap_alloc(heap, 100);  // keeps the rest of the pool out of reach
+  memset(b, 1, 100);
+
+  // grow into the next block
+  myheap_free(heap, c);
+  p = myheap_realloc(heap, b, 200);
+  if (p != b || !check_bytes(p, 100, 1)) {
+    printf("Realloc did not grow into the next block.\n");
+    failure = 1;
+  }
+  memset(p, 2, 200);
+
+  // grow into the previous block
+  myheap_free(heap, a);
+  p = myheap_realloc(heap, p, 320);
+  if (p != a || !check_bytes(p, 200, 2)) {
+    printf("Realloc did not grow into the previous block.\n");
+    failure = 1;
+  }
+  memset(p, 3, 320);
+
+  // shrink, after which the tail must be free for another block
+  p = myheap_realloc(heap, p, 40);
+  c = myheap_alloc(heap, 200);
+  if (p != a || !check_bytes(p, 40, 3) || c == NULL || c > d) {
+    printf("Realloc did not shrink in place.\n");
+    failure = 1;
+  }
+
+  // no room around the block, so it has to move
+  b = myheap_realloc(heap, p, 1000);
+  if (b == NULL || b == p || !check_bytes(b, 40, 3)) {
+    printf("Realloc did not move a block with no room around it.\n");
+    failure = 1;
+  }
+
+  // a request that cannot be met leaves the block untouched
+  if (b != NULL && (myheap_realloc(heap, b, 100000) != NULL
+                    || !check_bytes(b, 40, 3))) {
+    printf("Failed realloc changed the block.\n");
+    failure = 1;
+  }
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed in-place realloc test.\n");
+}
+
+// Allocates and frees BATCH_COUNT blocks of BATCH_SIZE bytes BATCH_ROUNDS
+// times, in batches if batched is nonzero and one by one if not, and returns
+// the nanoseconds per block.
+#define BATCH_COUNT 64
+#define BATCH_SIZE 100
+#define BATCH_ROUNDS 20000
+double batch_churn(myheap *heap, int batched) {
+  unsigned char *ptrs[BATCH_COUNT];
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int round = 0; round < BATCH_ROUNDS; round++) {
+    if (batched) {
+      myheap_alloc_batch(heap, BATCH_SIZE, BATCH_COUNT, ptrs);
+      myheap_free_batch(heap, ptrs, BATCH_COUNT);
+    }
+    else {
+      for (int i = 0; i < BATCH_COUNT; i++)
+        ptrs[i] = myheap_alloc(heap, BATCH_SIZE);
+      for (int i = 0; i < BATCH_COUNT; i++)
+        myheap_free(heap, ptrs[i]);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec))
+         / ((double) BATCH_ROUNDS * BATCH_COUNT);
+}
+
+// Tests batch allocation and freeing: a batch must be carved from one free
+// block back to back, each block usable to its last byte, and freeing
+// batches in any order (mixed with slab and large objects, and with blocks
+// of another batch between them) must leave the pool one free block again.
+// The time per block is reported against allocating and freeing one by one.
+void batch_test() {
+  int failure = 0;
+  unsigned char *a[BATCH_COUNT], *b[BATCH_COUNT], *ptrs[2 * BATCH_COUNT + 2];
+  unsigned char *tiny, *large;
+  unsigned int rnd = 1;
+  int n = 0;
+  size_t slab_bytes;
+  myheap *heap;
+
+  printf("Performing the batch test.\n");
+
+  // the slab object's page stays allocated once it is freed
+  heap = myheap_create(1024 * 1024);
+  heap->verifyLevel = VERIFY_FULL;
+  tiny = myheap_alloc(heap, 16);
+  large = myheap_alloc(heap, heap->largeThreshold);
+  slab_bytes = heap->allocBytes;
+  if (myheap_alloc_batch(heap, BATCH_SIZE, BATCH_COUNT, a) != BATCH_COUNT
+      || myheap_alloc_batch(heap, BATCH_SIZE, BATCH_COUNT, b) != BATCH_COUNT) {
+    printf("Batch allocation failed.\n");
+    failure = 1;
+  }
+  for (int i = 0; !failure && i < BATCH_COUNT; i++) {
+    if (i > 0 && a[i] != a[i - 1] + payloadSize(heap, a[i - 1]) + sizeof(int)) {
+      printf("Batch was not carved back to back.\n");
+      failure = 1;
+    }
+    memset(a[i], i, payloadSize(heap, a[i]));
+    memset(b[i], i, payloadSize(heap, b[i]));
+  }
+  for (int i = 0; !failure && i < BATCH_COUNT; i++) {
+    if (!check_bytes(a[i], BATCH_SIZE, (unsigned char) i)
+        || !check_bytes(b[i], BATCH_SIZE, (unsigned char) i)) {
+      printf("Batch block %d was overwritten by its neighbours.\n", i);
+      failure = 1;
+    }
+  }
+
+  if (!failure) {
+    // all of a and every other block of b, shuffled, with a slab object and
+    // a large object among them; then the rest of b
+    for (int i = 0; i < BATCH_COUNT; i++) {
+      ptrs[n++] = a[i];
+      if (i % 2 == 0)
+        ptrs[n++] = b[i];
+    }
+    ptrs[n++] = tiny;
+    ptrs[n++] = large;
+    for (int i = n - 1; i > 0; i--) {
+      int j = rand_r(&rnd) % (i + 1);
+      unsigned char *tmp = ptrs[i];
+      ptrs[i] = ptrs[j];
+      ptrs[j] = tmp;
+    }
+    myheap_free_batch(heap, ptrs, n);
+    n = 0;
+    for (int i = 1; i < BATCH_COUNT; i += 2)
+      ptrs[n++] = b[i];
+    myheap_free_batch(heap, ptrs, n);
+    if (heap->allocBytes != slab_bytes || heap->largeCount != 0) {
+      printf("Batch free left %zu bytes allocated.\n",
+             heap->allocBytes - slab_bytes);
+      failure = 1;
+    }
+  }
+  myheap_destroy(heap);
+
+  heap = myheap_create(1024 * 1024);
+  heap->verifyLevel = VERIFY_FAST;
+  double nsSingle = batch_churn(heap, 0);
+  double nsBatch = batch_churn(heap, 1);
+  printf("Batches of %d: %.1f ns per block (%.1f one by one).\n",
+         BATCH_COUNT, nsBatch, nsSingle);
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed batch test.\n");
+}
+
+// Tests heap statistics: the block counts, splits, coalesces, failures,
+// reallocs and request histogram must follow a known sequence of operations
+// (the full verification walk checks the block counts against the blocks
+// after each one), the fragmentation index must be 0 for a single free block
+// and positive with holes, and the JSON report must hold the counters and be
+// cut short snprintf style. The text report is printed.
+void stats_test() {
+  int failure = 0;
+  myheap *heap;
+  heap_stats st;
+  unsigned char *a, *b, *c;
+  char report[2048], tiny[10];
+
+  printf("Performing the statistics test.\n");
+
+  heap = myheap_create(64 * 1024);
+  heap->verifyLevel = VERIFY_FULL;
+  a = myheap_alloc(heap, 100);
+  b = myheap_alloc(heap, 100);
+  c = myheap_alloc(heap, 3000);
+  myheap_stats(heap, &st);
+  if (st.allocBlocks != 3 || st.freeBlocks != 1 || st.splits != 3
+      || st.requests[STATS_BUCKET(100)] != 2 || st.requests[12] != 1
+      || st.fragmentation != 0.0) {
+    printf("Statistics of three allocations are wrong.\n");
+    failure = 1;
+  }
+
+  myheap_alloc(heap, heap->size);  // fails
+  myheap_free(heap, b);
+  myheap_stats(heap, &st);
+  if (st.failedRequests != 1 || st.freeBlocks != 2
+      || st.largestFree != st.freeBytes - 112 || st.fragmentation <= 0.0) {
+    printf("Statistics after a failure and a hole are wrong.\n");
+    failure = 1;
+  }
+
+  a = myheap_realloc(heap, a, 50);    // shrinks in place
+  a = myheap_realloc(heap, a, 5000);  // no room around it, so it moves
+  myheap_free(heap, a);
+  myheap_free(heap, c);
+  myheap_stats(heap, &st);
+  if (st.reallocInPlace != 1 || st.reallocMoved != 1 || st.allocBlocks != 0
+      || st.freeBlocks != 1 || st.coalesces == 0
+      || st.largestFree != heap->size || myheap_fragmentation(heap) != 0.0) {
+    printf("Statistics after reallocs and frees are wrong.\n");
+    failure = 1;
+  }
+
+  int len = myheap_format_stats(&st, STATS_JSON, report, sizeof(report));
+  if (strncmp(report, "{\"pool_bytes\":", 14) != 0
+      || strstr(report, "\"realloc_moved\":1,") == NULL
+      || myheap_format_stats(&st, STATS_JSON, tiny, sizeof(tiny)) != len
+      || strlen(tiny) != sizeof(tiny) - 1) {
+    printf("JSON report is wrong: %s", report);
+    failure = 1;
+  }
+  myheap_format_stats(&st, STATS_TEXT, report, sizeof(report));
+  printf("%s", report);
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed statistics test.\n");
+}
+
+// Tests heap snapshots: a snapshot of a heap with allocated, free and slab
+// blocks must start with a valid header and have a record for every block,
+// of the right kind, adding up to the pool and ending with a 0 record.
+void dump_test() {
+  int failure = 0;
+  myheap *heap;
+  heap_stats st;
+  dump_header header;
+  uint32_t record;
+  size_t blocks[3] = {0, 0, 0}, bytes = 0;
+  unsigned char *ptrs[100];
+
+  printf("Performing the snapshot test.\n");
+
+  heap = myheap_create(1024 * 1024);
+  for (int i = 0; i < 100; i++)
+    ptrs[i] = myheap_alloc(heap, i % 3 == 0 ? 16 : 100 + 50 * i);
+  for (int i = 1; i < 100; i += 4)
+    myheap_free(heap, ptrs[i]);
+  myheap_stats(heap, &st);
+
+  FILE *f = tmpfile();
+  if (f == NULL || myheap_dump(heap, fileno(f)) != 0) {
+    printf("Snapshot could not be written.\n");
+    failure = 1;
+  }
+  else {
+    rewind(f);
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, DUMP_MAGIC, 4) != 0
+        || header.poolBytes != heap->size) {
+      printf("Snapshot header is wrong.\n");
+      failure = 1;
+    }
+    while (!failure && fread(&record, sizeof(record), 1, f) == 1
+           && DUMP_UNITS(record) != 0) {
+      blocks[DUMP_KIND(record)]++;
+      bytes += DUMP_UNITS(record) * ALIGNMENT;
+    }
+    if (!failure && (bytes != heap->size || blocks[DUMP_FREE] != st.freeBlocks
+        || blocks[DUMP_SLAB] == 0
+        || blocks[DUMP_ALLOC] + blocks[DUMP_SLAB] != st.allocBlocks)) {
+      printf("Snapshot records do not match the heap.\n");
+      failure = 1;
+    }
+  }
+  if (f != NULL)
+    fclose(f);
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed snapshot test.\n");
+}
+
+// Replays a trace recorded by librecord.so (see trace.h) on the default heap,
+// in a pool that starts small and grows as it needs to. The trace is mapped
+// and decoded straight from the mapping, and blocks are kept in an array
+// indexed by id, so the tester's own memory goes with the most blocks live at
+// once rather than with the length of the trace. The first bytes of every
+// block are stamped with its id, and checked when it is reallocated or freed.
+// Returns the number of operations replayed, or -1 if the trace is bad or a
+// block was corrupted.
+#define REPLAY_POOL_SIZE (1024 * 1024)
+#define REPLAY_RESERVE ((size_t) 8 << 30)
+typedef struct replay_block {
+  unsigned char *ptr;  // NULL if its allocation failed
+  size_t size;
+  int live;
+} replay_block;
+
+void stamp_block(unsigned char *p, size_t size, uint64_t id) {
+  for (size_t i = 0; i < size && i < sizeof(id); i++)
+    p[i] = (unsigned char) (id >> (8 * i)) ^ 0xa5;
+}
+
+int stamp_intact(unsigned char *p, size_t size, uint64_t id) {
+  for (size_t i = 0; i < size && i < sizeof(id); i++) {
+    if (p[i] != ((unsigned char) (id >> (8 * i)) ^ 0xa5))
+      return 0;
+  }
+  return 1;
+}
+
+// Returns the bytes of a request of size that land in the pool.
+size_t pool_share(size_t size) {
+  return LARGE_THRESHOLD != 0 && size >= LARGE_THRESHOLD ? 0 : size;
+}
+
+long replay_trace(char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  unsigned char *trace = MAP_FAILED;
+  if (st.st_size > 0)
+    trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (trace == MAP_FAILED || !traceValid(trace, st.st_size)) {
+    printf("%s is not an allocation trace.\n", path);
+    if (trace != MAP_FAILED)
+      munmap(trace, st.st_size);
+    return -1;
+  }
+  madvise(trace, st.st_size, MADV_SEQUENTIAL);
+
+  size_t saved_size = MEMORY_SIZE, saved_reserve = MEMORY_RESERVE;
+  MEMORY_SIZE = REPLAY_POOL_SIZE;
+  MEMORY_RESERVE = REPLAY_RESERVE;
+  init_myalloc();
+
+  replay_block *blocks = NULL;
+  uint64_t slots = 0, allocs = 0, threads = 0;
+  size_t live = 0, peak = 0, live_pool = 0, peak_pool = 0;
+  long ops = 0, failed = 0;
+  int bad = 0;
+  trace_op op = {0, 0, 0, 0};
+  struct timespec start, end;
+
+  const unsigned char *at = trace + TRACE_HEADER_SIZE;
+  const unsigned char *trace_end = trace + st.st_size;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (at < trace_end) {
+    at = traceDecode(at, trace_end, &op);
+    // ids are handed out from 0 up, so none can be past the allocations
+    if (at == NULL || op.id > allocs) {
+      printf("Trace is cut short or corrupt after %ld operations.\n", ops);
+      bad = 1;
+      break;
+    }
+    if (op.id >= slots) {
+      uint64_t more = slots == 0 ? 1024 : 2 * slots;
+      blocks = realloc(blocks, more * sizeof(replay_block));
+      if (blocks == NULL) {
+        printf("Cannot keep track of %lu blocks.\n", (unsigned long) more);
+        exit(1);
+      }
+      memset(blocks + slots, 0, (more - slots) * sizeof(replay_block));
+      slots = more;
+    }
+
+    replay_block *b = &blocks[op.id];
+    if ((op.op == TRACE_ALLOC) == b->live) {
+      printf("Operation %ld uses block %lu out of turn.\n", ops,
+             (unsigned long) op.id);
+      bad = 1;
+      break;
+    }
+    if (b->ptr != NULL && !stamp_intact(b->ptr, b->size, op.id)) {
+      printf("Block %lu was corrupted before operation %ld.\n",
+             (unsigned long) op.id, ops);
+      bad = 1;
+      break;
+    }
+    live -= b->size;
+    live_pool -= pool_share(b->size);
+    if (op.op == TRACE_FREE) {
+      if (b->ptr != NULL)
+        myfree(b->ptr);
+      b->ptr = NULL;
+      b->size = 0;
+      b->live = 0;
+    }
+    else {
+      unsigned char *p = b->ptr == NULL ? myalloc(op.size)
+                                        : myrealloc(b->ptr, op.size);
+      if (op.op == TRACE_ALLOC)
+        allocs++;
+      if (p == NULL && op.size != 0) {
+        failed++;  // a failed realloc leaves the block as it was
+        if (b->ptr == NULL)
+          b->size = 0;
+      }
+      else {
+        b->ptr = p;
+        b->size = p == NULL ? 0 : op.size;
+        if (p != NULL)
+          stamp_block(p, b->size, op.id);
+      }
+      b->live = 1;
+    }
+    live += b->size;
+    live_pool += pool_share(b->size);
+    if (live > peak)
+      peak = live;
+    if (live_pool > peak_pool)
+      peak_pool = live_pool;
+    if (op.thread > threads)
+      threads = op.thread;
+    ops++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec)
+                   + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  heap_stats hs;
+  myalloc_stats(&hs);
+  for (uint64_t id = 0; id < slots; id++) {
+    if (blocks[id].ptr == NULL)
+      continue;
+    if (!bad && !stamp_intact(blocks[id].ptr, blocks[id].size, id)) {
+      printf("Block %lu was corrupted by the end of the trace.\n",
+             (unsigned long) id);
+      bad = 1;
+    }
+    myfree(blocks[id].ptr);
+  }
+  free(blocks);
+  close_myalloc();
+  MEMORY_SIZE = saved_size;
+  MEMORY_RESERVE = saved_reserve;
+  munmap(trace, st.st_size);
+
+  printf("Replayed %ld operations from %lu threads in %.3f s "
+         "(%.1f ns per operation)\n", ops, (unsigned long) threads, seconds,
+         ops == 0 ? 0.0 : seconds * 1e9 / ops);
+  printf("Peak live bytes: %lu (%lu of them in the pool)\n",
+         (unsigned long) peak, (unsigned long) peak_pool);
+  printf("Pool grew to %lu bytes\n", (unsigned long) hs.poolBytes);
+  printf("Memory utilization: (%lu/%lu)=%f\n", (unsigned long) peak_pool,
+         (unsigned long) hs.poolBytes,
+         hs.poolBytes == 0 ? 0.0 : (double) peak_pool / hs.poolBytes);
+  printf("Failed requests: %ld\n", failed);
+  return bad ? -1 : ops;
+}
+
+// Writes a trace record to f, after one made by thread *last_thread.
+void put_record(FILE *f, int kind, uint64_t id, uint64_t size,
+                uint64_t thread, uint64_t *last_thread) {
+  unsigned char buf[TRACE_MAX_RECORD];
+  trace_op op = {kind, id, size, thread};
+  fwrite(buf, 1, traceEncode(buf, &op, last_thread), f);
+}
+
+// Tests allocation traces: records must decode to what was encoded, with the
+// thread written only when it changes and a cut short record rejected, and a
+// trace of allocations, reallocations and frees (ids reused, as the recorder
+// does) must replay in full, while one freeing a block never allocated must
+// be refused.
+#define TRACE_TEST_BLOCKS 200
+#define TRACE_TEST_ROUNDS 5
+void trace_test() {
+  int failure = 0;
+  unsigned char buf[TRACE_MAX_RECORD];
+  uint64_t last_thread = 0;
+  trace_op in = {TRACE_REALLOC, 300, 1UL << 40, 7}, out = {0, 0, 0, 0};
+
+  printf("Performing the allocation trace test.\n");
+
+  size_t n = traceEncode(buf, &in, &last_thread);
+  const unsigned char *next = traceDecode(buf, buf + n, &out);
+  if (next != buf + n || out.op != in.op || out.id != in.id
+      || out.size != in.size || out.thread != in.thread) {
+    printf("Record did not decode to what was encoded.\n");
+    failure = 1;
+  }
+  in.op = TRACE_FREE;
+  size_t again = traceEncode(buf, &in, &last_thread);
+  if (again != 3 || traceDecode(buf, buf + again, &out) != buf + again
+      || out.thread != 7 || out.size != 0) {
+    printf("Record repeated a thread that did not change.\n");
+    failure = 1;
+  }
+  if (traceDecode(buf, buf + again - 1, &out) != NULL) {
+    printf("Cut short record was not rejected.\n");
+    failure = 1;
+  }
+
+  // rounds of allocating, growing and freeing, by two threads in turn
+  char path[] = "/tmp/tracetestXXXXXX";
+  int fd = mkstemp(path);
+  FILE *f = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (f == NULL) {
+    printf("Trace could not be written.\n");
+    return;
+  }
+  traceHeader(buf);
+  fwrite(buf, 1, TRACE_HEADER_SIZE, f);
+  last_thread = 0;
+  long ops = 0;
+  for (int round = 0; round < TRACE_TEST_ROUNDS; round++) {
+    for (int i = 0; i < TRACE_TEST_BLOCKS; i++, ops++)
+      put_record(f, TRACE_ALLOC, i, 8 + 40 * i, 1 + i % 2, &last_thread);
+    for (int i = 0; i < TRACE_TEST_BLOCKS; i += 3, ops++)
+      put_record(f, TRACE_REALLOC, i, 100 + 80 * i, 1, &last_thread);
+    for (int i = TRACE_TEST_BLOCKS - 1; i >= 0; i--, ops++)
+      put_record(f, TRACE_FREE, i, 0, 2, &last_thread);
+  }
+  fclose(f);
+  long replayed = replay_trace(path);
+  if (replayed != ops) {
+    printf("Replayed %ld operations of %ld.\n", replayed, ops);
+    failure = 1;
+  }
+
+  f = fopen(path, "wb");
+  fwrite(buf, 1, TRACE_HEADER_SIZE, f);
+  last_thread = 0;
+  put_record(f, TRACE_ALLOC, 0, 100, 1, &last_thread);
+  put_record(f, TRACE_FREE, 1, 0, 1, &last_thread);
+  fclose(f);
+  if (replay_trace(path) != -1) {
+    printf("Trace freeing a block never allocated was replayed.\n");
+    failure = 1;
+  }
+  unlink(path);
+
+  if (!failure)
+    printf("Passed allocation trace test.\n");
+}
+
+// Tests hardware performance counters: where they can be opened, counted
+// allocations must add up in their totals, with the free block search inside
+// each one counted too, and nothing must be counted while paused or after
+// they are closed. Where they cannot, as in most containers, opening them
+// must fail cleanly and leave the allocator as it was.
+#define PERF_TEST_BLOCKS 100
+void perfcount_test() {
+  int failure = 0;
+  unsigned char *ptrs[PERF_TEST_BLOCKS];
+  perf_totals totals;
+  perf_mark mark;
+  myheap *heap;
+
+  printf("Performing the performance counter test.\n");
+
+  heap = myheap_create(1024 * 1024);
+  int events = perfStart();
+  if (events == 0) {
+    printf("Counters unavailable (%s), checking the fallback.\n",
+           strerror(errno));
+    if (perfActive || perfBegin(&mark)) {
+      printf("Regions were counted without counters.\n");
+      failure = 1;
+    }
+  }
+  else {
+    for (int i = 0; i < PERF_TEST_BLOCKS; i++) {
+      int counted = perfBegin(&mark);
+      ptrs[i] = myheap_alloc(heap, 100 + i);
+      if (counted)
+        perfEnd(PERF_ALLOC, &mark);
+    }
+    perfPause(1);
+    for (int i = 0; i < PERF_TEST_BLOCKS; i++)
+      myheap_free(heap, ptrs[i]);
+    perfPause(0);
+    perfStop();
+    myheap_free(heap, myheap_alloc(heap, 100));
+
+    perfTotals(PERF_ALLOC, &totals);
+    if (totals.calls != PERF_TEST_BLOCKS) {
+      printf("Counted %lu allocations of %d.\n", (unsigned long) totals.calls,
+             PERF_TEST_BLOCKS);
+      failure = 1;
+    }
+    if (totals.counted[PERF_INSTRUCTIONS]
+        && totals.values[PERF_INSTRUCTIONS] == 0) {
+      printf("Allocations took no instructions.\n");
+      failure = 1;
+    }
+    perfTotals(PERF_SEARCH, &totals);
+    if (totals.calls != PERF_TEST_BLOCKS) {
+      printf("Counted %lu searches for %d allocations.\n",
+             (unsigned long) totals.calls, PERF_TEST_BLOCKS);
+      failure = 1;
+    }
+    printf("%d of %d events counted.\n", events, PERF_EVENTS);
+  }
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed performance counter test.\n");
+}
+
+// Tests growable heaps: a heap that starts out small must grow to hold far
+// more than it started with, its new memory must coalesce back into a single
+// block once everything is freed, and it must refuse to grow past its limit.
+// Large objects are turned off, so that every request is made of the pool.
+#define GROW_BLOCKS 1000
+#define GROW_BLOCK_SIZE 20000
+void growable_test() {
+  int failure = 0;
+  unsigned char *ptrs[GROW_BLOCKS];
+  myheap *heap;
+
+  printf("Performing the growable heap test.\n");
+
+  heap = myheap_create_growable(64 * 1024, 64 * 1024 * 1024);
+  heap->verifyLevel = VERIFY_FULL;
+  heap->largeThreshold = 0;
+  for (int i = 0; i < GROW_BLOCKS; i++) {
+    ptrs[i] = myheap_alloc(heap, GROW_BLOCK_SIZE);
+    if (ptrs[i] == NULL) {
+      printf("Heap did not grow past %zu bytes.\n", heap->size);
+      failure = 1;
+      break;
+    }
+    memset(ptrs[i], i, GROW_BLOCK_SIZE);
+  }
+  printf("Grew from 64 KB to %zu bytes.\n", heap->size);
+
+  for (int i = 0; i < GROW_BLOCKS && ptrs[i] != NULL; i++) {
+    if (!check_bytes(ptrs[i], GROW_BLOCK_SIZE, (unsigned char) i))
+      failure = 1;
+    myheap_free(heap, ptrs[i]);
+  }
+  unsigned char *p = myheap_alloc(heap, heap->size - (int) sizeof(int));
+  if (p == NULL) {
+    printf("Grown heap did not coalesce into one block.\n");
+    failure = 1;
+  }
+  else {
+    myheap_free(heap, p);
+  }
+  if (myheap_alloc(heap, 65 * 1024 * 1024) != NULL) {
+    printf("Heap grew past its limit.\n");
+    failure = 1;
+  }
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed growable heap test.\n");
+}
+
+// Tests pools past 4 GB, which tags counted in bytes could not describe:
+// blocks of several GB must be handed out and freed with their sizes intact,
+// and must coalesce back into a single block of more than 4 GB. A pool past
+// the largest block a tag can describe must work too. The pools are
+// growable, so only the pages touched take up memory. Requests larger than
+// any block must fail.
+#define GB (1024UL * 1024 * 1024)
+#define WIDE_BLOCKS 7
+void wide_pool_test() {
+  int failure = 0;
+  myheap *heap;
+  unsigned char *a, *b;
+
+  printf("Performing the wide pool test.\n");
+
+  heap = myheap_create_growable(64 * 1024, 6 * GB);
+  if (heap == NULL) {
+    printf("Could not reserve a 6 GB pool, skipping.\n");
+    printf("Passed wide pool test.\n");
+    return;
+  }
+  heap->largeThreshold = 0;
+  a = myheap_alloc(heap, 3 * GB);
+  b = myheap_alloc(heap, 2 * GB + 1);
+  if (a == NULL || b == NULL || heap->size <= 4 * GB
+      || payloadSize(heap, a) < 3 * GB || payloadSize(heap, b) <= 2 * GB) {
+    printf("Blocks of several GB were not allocated.\n");
+    failure = 1;
+  }
+  else {
+    a[0] = a[3 * GB - 1] = 1;
+    b[0] = b[2 * GB] = 2;
+    if (checkMem(heap) != heap->size || a[3 * GB - 1] != 1 || b[2 * GB] != 2) {
+      printf("Blocks of several GB were not kept apart.\n");
+      failure = 1;
+    }
+    myheap_free(heap, a);
+    myheap_free(heap, b);
+    a = myheap_alloc(heap, heap->size - sizeof(int));
+    if (a == NULL) {
+      printf("Pool of %zu bytes did not coalesce into one block.\n",
+             heap->size);
+      failure = 1;
+    }
+    else {
+      myheap_free(heap, a);
+    }
+  }
+  if (myheap_alloc(heap, (size_t) -1 / 2) != NULL) {
+    printf("Impossible request was served.\n");
+    failure = 1;
+  }
+  myheap_destroy(heap);
+
+  // a pool past the largest block, made of several blocks that cannot all
+  // coalesce, must hand out and take back blocks across all of it
+  heap = myheap_create_growable(64 * 1024, WIDE_BLOCKS * 3 * GB + GB);
+  if (heap == NULL) {
+    printf("Could not reserve a %d GB pool, skipping.\n",
+           WIDE_BLOCKS * 3 + 1);
+  }
+  else {
+    unsigned char *blocks[WIDE_BLOCKS];
+    heap->largeThreshold = 0;
+    heap->verifyLevel = VERIFY_FULL;
+    for (int i = 0; i < WIDE_BLOCKS; i++) {
+      blocks[i] = myheap_alloc(heap, 3 * GB);
+      if (blocks[i] == NULL)
+        break;
+      blocks[i][0] = blocks[i][3 * GB - 1] = i;
+    }
+    size_t size = heap->size;
+    if (blocks[WIDE_BLOCKS - 1] == NULL || size <= MAX_BLOCK_SIZE) {
+      printf("Pool did not grow past the largest block.\n");
+      failure = 1;
+    }
+    else {
+      for (int i = 0; i < WIDE_BLOCKS; i++) {
+        if (blocks[i][0] != i || blocks[i][3 * GB - 1] != i)
+          failure = 1;
+      }
+      // every other block first, so the rest coalesce both ways
+      for (int i = 0; i < WIDE_BLOCKS; i += 2)
+        myheap_free(heap, blocks[i]);
+      for (int i = 1; i < WIDE_BLOCKS; i += 2)
+        myheap_free(heap, blocks[i]);
+      if (checkMem(heap) != size || heap->freeBytes != size)
+        failure = 1;
+      for (int i = 0; i < WIDE_BLOCKS; i++) {
+        if (myheap_alloc(heap, 3 * GB) == NULL)
+          failure = 1;
+      }
+      if (failure || heap->size != size) {
+        printf("Pool of %zu bytes did not reuse its blocks.\n", size);
+        failure = 1;
+      }
+    }
+    myheap_destroy(heap);
+  }
+
+  // a request just past the most a block can hold must fail, however far the
+  // pool could grow, rather than get the largest block there is
+  heap = myheap_create_growable(64 * 1024, MAX_POOL_SIZE + GB);
+  if (heap != NULL) {
+    heap->largeThreshold = 0;
+    a = myheap_alloc(heap, 100);
+    if (a == NULL || myheap_alloc(heap, MAX_SPACE + 1) != NULL
+        || myheap_alloc_aligned(heap, 4096, MAX_SPACE + 1) != NULL
+        || myheap_realloc(heap, a, MAX_SPACE + 1) != NULL) {
+      printf("Request past the largest block was served.\n");
+      failure = 1;
+    }
+    myheap_destroy(heap);
+  }
+
+  if (!failure)
+    printf("Passed wide pool test.\n");
+}
+
+// Tests large objects: a request past the threshold must be mapped outside
+// the pool, leaving the pool alone, and keep its data as it is grown (past
+// the size of the pool) and shrunk again. Growing a pool block past the
+// threshold must move it to a mapping, and the thread-safe allocator must
+// hand large objects out and take them back too. Freeing one twice must
+// abort like any other invalid free.
+#define LARGE_SIZE (4 * 1024 * 1024)
+#define LARGE_MANY 5000
+
+// Frees a large object twice, through myheap_free or, with mt set, through
+// mtfree, in a child process. Returns 1 if the child was aborted for it, as
+// for any invalid free, rather than crashing on the header, which is no
+// longer mapped the second time.
+int large_double_free_aborts(int mt) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    freopen("/dev/null", "w", stderr);
+    if (mt) {
+      init_mtalloc(1, 1024 * 1024);
+      unsigned char *p = mtalloc(LARGE_SIZE);
+      mtfree(p);
+      mtfree(p);
+    }
+    else {
+      myheap *heap = myheap_create(1024 * 1024);
+      heap->largeThreshold = 256 * 1024;
+      unsigned char *p = myheap_alloc(heap, LARGE_SIZE);
+      myheap_free(heap, p);
+      myheap_free(heap, p);
+    }
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+// Allocates and frees large objects through the thread-safe allocator, many
+// alive at a time, so that other threads sharing the arena keep changing its
+// large objects while this one frees its own. Sets the int arg points to if
+// any object's data was corrupted.
+#define LARGE_MT_THREADS 4
+#define LARGE_MT_ROUNDS 5000
+#define LARGE_MT_LIVE 256
+void *large_mt_run(void *arg) {
+  int *failure = (int *) arg;
+  unsigned char *live[LARGE_MT_LIVE] = {NULL};
+  for (int i = 0; i < LARGE_MT_ROUNDS; i++) {
+    int slot = i % LARGE_MT_LIVE;
+    if (live[slot] != NULL) {
+      if (live[slot][0] != (unsigned char) slot)
+        __atomic_store_n(failure, 1, __ATOMIC_RELAXED);
+      mtfree(live[slot]);
+    }
+    live[slot] = mtalloc(LARGE_SIZE);
+    if (live[slot] != NULL)
+      live[slot][0] = slot;
+  }
+  for (int slot = 0; slot < LARGE_MT_LIVE; slot++) {
+    if (live[slot] != NULL)
+      mtfree(live[slot]);
+  }
+  return NULL;
+}
+
+void large_test() {
+  int failure = 0;
+  myheap *heap;
+  unsigned char *p, *q;
+
+  printf("Performing the large object test.\n");
+
+  heap = myheap_create(1024 * 1024);
+  heap->largeThreshold = 256 * 1024;
+  p = myheap_alloc(heap, LARGE_SIZE);
+  if (p == NULL || (p >= heap->buf && p < heap->buf + heap->committed)
+      || heap->allocBytes != 0 || payloadSize(heap, p) < LARGE_SIZE) {
+    printf("Large request was not mapped outside the pool.\n");
+    failure = 1;
+  }
+  else {
+    memset(p, 5, LARGE_SIZE);
+    p = myheap_realloc(heap, p, 4 * LARGE_SIZE);
+    if (p == NULL || !check_bytes(p, LARGE_SIZE, 5)) {
+      printf("Large object lost its data growing.\n");
+      failure = 1;
+    }
+    else {
+      memset(p, 6, 4 * LARGE_SIZE);
+      p = myheap_realloc(heap, p, LARGE_SIZE / 2);
+      if (p == NULL || !check_bytes(p, LARGE_SIZE / 2, 6)) {
+        printf("Large object lost its data shrinking.\n");
+        failure = 1;
+      }
+      else {
+        myheap_free(heap, p);
+      }
+    }
+  }
+  if (heap->largeCount != 0 || heap->largeBytes != 0) {
+    printf("Freed large object is still mapped.\n");
+    failure = 1;
+  }
+
+  // a pool block grown past the threshold moves out of the pool
+  p = myheap_alloc(heap, 1000);
+  memset(p, 7, 1000);
+  q = myheap_realloc(heap, p, LARGE_SIZE);
+  if (q == NULL || heap->largeBytes < LARGE_SIZE || !check_bytes(q, 1000, 7)
+      || heap->allocBytes != 0) {
+    printf("Block grown past the threshold was not mapped.\n");
+    failure = 1;
+  }
+  myheap_alloc(heap, LARGE_SIZE);  // left for myheap_destroy to unmap
+  myheap_destroy(heap);
+
+  // enough large objects, of scattered sizes so that their headers collide
+  // in the set, to grow the set several times, freed in a scrambled order,
+  // must each be recognised until freed and not after
+  heap = myheap_create(1024 * 1024);
+  heap->largeThreshold = 8192;
+  unsigned char *many[LARGE_MANY];
+  for (int i = 0; i < LARGE_MANY; i++) {
+    many[i] = myheap_alloc(heap, 8192 + (i * 37 % 61) * 4096);
+    if (many[i] == NULL)
+      break;
+    many[i][0] = (unsigned char) i;
+  }
+  for (int k = 0; k < LARGE_MANY && !failure; k++) {
+    int i = (int) ((k * 7919L) % LARGE_MANY);  // a permutation
+    if (many[i] == NULL || !isLargeObject(heap, many[i])
+        || many[i][0] != (unsigned char) i) {
+      printf("Large object %d of %d was not recognised.\n", i, LARGE_MANY);
+      failure = 1;
+      break;
+    }
+    myheap_free(heap, many[i]);
+    if (isLargeObject(heap, many[i])) {
+      printf("Freed large object %d was still recognised.\n", i);
+      failure = 1;
+    }
+  }
+  if (!failure && (heap->largeCount != 0 || heap->largeBytes != 0)) {
+    printf("Freed large objects are still counted.\n");
+    failure = 1;
+  }
+  myheap_destroy(heap);
+
+  init_mtalloc(2, 1024 * 1024);
+  p = mtalloc(LARGE_SIZE);
+  if (p == NULL) {
+    printf("Thread-safe allocator did not map a large object.\n");
+    failure = 1;
+  }
+  else {
+    memset(p, 8, LARGE_SIZE);
+    p = mtrealloc(p, 2 * LARGE_SIZE);
+    if (p == NULL || !check_bytes(p, LARGE_SIZE, 8)) {
+      printf("Thread-safe realloc lost a large object's data.\n");
+      failure = 1;
+    }
+    else {
+      mtfree(p);
+    }
+  }
+  close_mtalloc();
+
+  // threads sharing one arena free large objects while the others change
+  // the arena's large objects
+  pthread_t tids[LARGE_MT_THREADS];
+  int mt_failure = 0;
+  init_mtalloc(1, 1024 * 1024);
+  for (int t = 0; t < LARGE_MT_THREADS; t++)
+    pthread_create(&tids[t], NULL, large_mt_run, &mt_failure);
+  for (int t = 0; t < LARGE_MT_THREADS; t++)
+    pthread_join(tids[t], NULL);
+  close_mtalloc();
+  if (mt_failure) {
+    printf("Large objects were corrupted by other threads' frees.\n");
+    failure = 1;
+  }
+
+  if (!large_double_free_aborts(0) || !large_double_free_aborts(1)) {
+    printf("Freeing a large object twice did not abort.\n");
+    failure = 1;
+  }
+
+  if (!failure)
+    printf("Passed large object test.\n");
+}
+
+// Fills a heap with blocks of random sizes, and then frees and reallocates
+// random ones, timing that churn. Returns the nanoseconds per operation, or
+// -1 if the heap ran out or the data was corrupted. The heap is checked at
+// VERIFY_FAST whatever MYALLOC_VERIFY says, so that timings compare like with
+// like (and a walk of the pool after every operation does not take minutes).
+#define HUGE_POOL_SIZE (64 * 1024 * 1024)
+#define HUGE_SLOTS 16384
+#define HUGE_OPS 400000
+double huge_churn(myheap *heap) {
+  static unsigned char *slots[HUGE_SLOTS];
+  static int sizes[HUGE_SLOTS];
+  struct timespec start, end;
+  unsigned int rnd = 1;
+
+  heap->verifyLevel = VERIFY_FAST;
+  for (int i = 0; i < HUGE_SLOTS; i++) {
+    sizes[i] = 16 + rand_r(&rnd) % 4096;
+    slots[i] = myheap_alloc(heap, sizes[i]);
+    if (slots[i] == NULL)
+      return -1;
+    memset(slots[i], i, sizes[i]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int op = 0; op < HUGE_OPS; op++) {
+    int i = rand_r(&rnd) % HUGE_SLOTS;
+    if (slots[i][sizes[i] - 1] != (unsigned char) i)
+      return -1;
+    myheap_free(heap, slots[i]);
+    sizes[i] = 16 + rand_r(&rnd) % 4096;
+    slots[i] = myheap_alloc(heap, sizes[i]);
+    if (slots[i] == NULL)
+      return -1;
+    slots[i][sizes[i] - 1] = (unsigned char) i;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  for (int i = 0; i < HUGE_SLOTS; i++)
+    myheap_free(heap, slots[i]);
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec))
+         / HUGE_OPS;
+}
+
+// Tests huge page backed pools: with USE_HUGE_PAGES, a pool must be aligned
+// to a huge page and committed (and grown) in whole huge pages, and must work
+// like any other. How much of it the system actually backs with huge pages
+// depends on its configuration, so that is only reported, along with the
+// churn's speed with and without them.
+void huge_page_test() {
+  int failure = 0;
+  myheap *heap;
+  double nsSmall, nsHuge;
+
+  printf("Performing the huge page test.\n");
+
+  heap = myheap_create(HUGE_POOL_SIZE);
+  nsSmall = huge_churn(heap);
+  myheap_destroy(heap);
+
+  USE_HUGE_PAGES = 1;
+  heap = myheap_create(HUGE_POOL_SIZE);
+  if (heap == NULL || !heap->hugePages
+      || (uintptr_t) heap->buf % HUGE_PAGE_SIZE != 0) {
+    printf("Pool was not set up for huge pages.\n");
+    failure = 1;
+  }
+  else {
+    nsHuge = huge_churn(heap);
+    long huge = myheap_huge_bytes(heap);
+    printf("%ld of %d bytes on huge pages, %.0f ns/op (%.0f without).\n",
+           huge, HUGE_POOL_SIZE, nsHuge, nsSmall);
+    if (nsHuge < 0 || nsSmall < 0 || huge > heap->committed) {
+      printf("Huge page pool did not work.\n");
+      failure = 1;
+    }
+    myheap_destroy(heap);
+  }
+
+  heap = myheap_create_growable(64 * 1024, HUGE_POOL_SIZE);
+  if (heap != NULL)
+    heap->largeThreshold = 0;
+  if (heap == NULL || myheap_alloc(heap, HUGE_PAGE_SIZE) == NULL
+      || heap->committed % HUGE_PAGE_SIZE != 0) {
+    printf("Growable pool did not grow by whole huge pages.\n");
+    failure = 1;
+  }
+  if (heap != NULL)
+    myheap_destroy(heap);
+  USE_HUGE_PAGES = 0;
+
+  if (!failure)
+    printf("Passed huge page test.\n");
+}
+
+// Returns the resident set size of this process in bytes, or -1 if unknown.
+long resident_bytes() {
+  long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL)
+    return -1;
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    resident = -1;
+  fclose(f);
+  return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+// Allocates SCAV_BLOCKS blocks of SCAV_BLOCK_SIZE bytes from heap and fills
+// them, frees them again, and returns 1 if they all were still intact.
+#define SCAV_BLOCKS 128
+#define SCAV_BLOCK_SIZE (64 * 1024)
+int fill_and_free(myheap *heap) {
+  unsigned char *ptrs[SCAV_BLOCKS];
+  int intact = 1;
+  for (int i = 0; i < SCAV_BLOCKS; i++) {
+    ptrs[i] = myheap_alloc(heap, SCAV_BLOCK_SIZE);
+    if (ptrs[i] == NULL)
+      return 0;
+    memset(ptrs[i], i, SCAV_BLOCK_SIZE);
+  }
+  for (int i = 0; i < SCAV_BLOCKS; i++) {
+    if (!check_bytes(ptrs[i], SCAV_BLOCK_SIZE, (unsigned char) i))
+      intact = 0;
+    myheap_free(heap, ptrs[i]);
+  }
+  return intact;
+}
+
+// Returns 1 if heap->purgedBytes counts exactly the pages flagged as given
+// back, and no block has its header, or a free block its footer, on one.
+int purged_pages_consistent(myheap *heap) {
+  size_t flagged = 0;
+  for (unsigned char *page = heap->mem; page < heap->mem + heap->size;
+       page += SLAB_SIZE) {
+    if (pageFlags(heap, page) & PAGE_PURGED)
+      flagged += SLAB_SIZE;
+  }
+  for (unsigned char *p = heap->mem; p != heap->mem + heap->size; ) {
+    unsigned int tag = *(unsigned int *) p;
+    unsigned char *footer = p + SPACE_OF(tag);
+    if ((pageFlags(heap, p) & PAGE_PURGED)
+        || (!(tag & TAG_INUSE) && (pageFlags(heap, footer) & PAGE_PURGED)))
+      return 0;
+    p = footer + sizeof(int);
+  }
+  return flagged == heap->purgedBytes;
+}
+
+// Tests the scavenger: memory freed after a peak must be given back by the
+// scavenger's own passes, and by a trim, which must bring the resident size
+// down, and pages given back must stop counting as such once allocated
+// again, so that a second trim only gives back what was used in between.
+// Aligned blocks, whose slack is split off in the middle of given back
+// memory, must keep the books right too.
+void scavenge_test() {
+  int failure = 0;
+  int used = SCAV_BLOCKS * SCAV_BLOCK_SIZE;
+  myheap *heap;
+
+  printf("Performing the scavenger test.\n");
+
+  heap = myheap_create(2 * used);
+  if (!fill_and_free(heap) || heap->purgedBytes == 0) {
+    printf("Idle memory was not given back without a trim.\n");
+    failure = 1;
+  }
+
+  if (!fill_and_free(heap))
+    failure = 1;
+  size_t decayed = heap->purgedBytes;
+  long before = resident_bytes();
+  size_t purged = decayed + myheap_trim(heap);
+  long after = resident_bytes();
+  printf("Trim gave back %zu more bytes, resident size went from %ld to %ld.\n",
+         purged - decayed, before, after);
+  if (purged < used || heap->purgedBytes != purged) {
+    printf("Trim did not give back the free memory.\n");
+    failure = 1;
+  }
+  if (before >= 0 && before - after < (long) (purged - decayed) / 2) {
+    printf("Trim did not bring the resident size down.\n");
+    failure = 1;
+  }
+  if (myheap_trim(heap) != 0) {
+    printf("A second trim gave back memory again.\n");
+    failure = 1;
+  }
+
+  if (!fill_and_free(heap))
+    failure = 1;
+  size_t again = myheap_trim(heap);
+  if (again > used + 2 * SLAB_SIZE || heap->purgedBytes != purged) {
+    printf("Reused pages were counted wrongly (%zu bytes trimmed).\n", again);
+    failure = 1;
+  }
+
+  for (size_t alignment = 2 * ALIGNMENT; alignment <= 16 * SLAB_SIZE;
+       alignment *= 2) {
+    if (myheap_alloc_aligned(heap, alignment, SLAB_SIZE) == NULL
+        || !purged_pages_consistent(heap)) {
+      printf("Aligned blocks left given back pages counted wrongly.\n");
+      failure = 1;
+      break;
+    }
+  }
+  myheap_destroy(heap);
+
+  if (!failure)
+    printf("Passed scavenger test.\n");
+}
+
+// Overruns a block by one int, onto the header of the block after it, and
+// then frees the block, in a child process with the given verification
+// level. Returns 1 if the child was aborted for it. The overrun leaves the
+// in-use bits set, so that only verification can tell.
+int overrun_aborts(int level) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    freopen("/dev/null", "w", stderr);
+    myheap *heap = myheap_create(8192);
+    heap->verifyLevel = level;
+    unsigned char *p = myheap_alloc(heap, 100);
+    memset(p, 0xff, payloadSize(heap, p) + sizeof(int));
+    myheap_free(heap, p);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+// Tests heap verification: the running byte counters must account for the
+// whole pool after a mix of operations, and a corrupted tag next to the
+// block an operation works on must be caught at every level but off.
+void verify_test() {
+  int failure = 0;
+  unsigned char *ptrs[100];
+  myheap *heap;
+
+  printf("Performing the heap verification test.\n");
+
+  heap = myheap_create(64 * 1024);
+  heap->verifyLevel = VERIFY_FULL;
+  for (int i = 0; i < 100; i++)
+    ptrs[i] = myheap_alloc(heap, 1 + rand() % 300);
+  for (int i = 0; i < 100; i += 2)
+    myheap_free(heap, ptrs[i]);
+  for (int i = 1; i < 100; i += 2)
+    ptrs[i] = myheap_realloc(heap, ptrs[i], 1 + rand() % 600);
+  if (checkMem(heap) != heap->size) {
+    printf("Byte counters add up to %zu, not %zu.\n", checkMem(heap),
+           heap->size);
+    failure = 1;
+  }
+  myheap_destroy(heap);
+
+  for (int level = VERIFY_OFF; level <= VERIFY_FULL; level++) {
+    if (overrun_aborts(level) != (level != VERIFY_OFF)) {
+      printf("Overrun handled wrongly at verification level %d.\n", level);
+      failure = 1;
+    }
+  }
+
+  if (!failure)
+    printf("Passed heap verification test.\n");
+}
+
+// Allocates chunks of the given size until unable to anymore, then
+// deallocates all of them - returns the number of chunks allocated.
+int uniform_chunks(int chunk_size, int memory_size) {
+  unsigned char ** pointers =
+    malloc(sizeof(unsigned char *) * memory_size / chunk_size);
+  unsigned char * p;
+  int chunks = -1;
+  do {
+    chunks++;
+    p = myalloc(chunk_size);
+    pointers[chunks] = p;
+  } while (p != NULL);
+
+  for (int i = 0; i < chunks; i++) {
+    myfree(pointers[i]);
+  }
+
+  free(pointers);
+  return chunks;
+}
+
+// Basic correctness test -
+// allocates a bunch of uniformly-sized chunks, deallocates all of them, and
+// repeats a few times, making sure it works every time - no leaks in the
+// user pool. This actually won't give much more information than the other
+// test, which is more rigorous.
+int uniform_chunk_test() {
+  int chunk_size = 256;
+  int repetitions = 10;
+  int chunks = 0;
+  int failure = 0;
+
+  MEMORY_SIZE = 16000;
+
+  printf("Performing the basic uniform chunks test.\n");
+
+  init_myalloc();
+
+  chunks = uniform_chunks(chunk_size, MEMORY_SIZE);
+
+  printf("Allocated %d uniform chunks on a first pass.\n"
+          "Theoretical maximum: %zu\n", chunks, MEMORY_SIZE / chunk_size);
+  if (chunks < MEMORY_SIZE / (chunk_size + 64)) {
+    printf("not enough uniform chunks could be allocated.\n"
+            "Too much overhead in memory allocator.\n");
+    failure = 1;
+  }
+  for (int i = 1; i < repetitions; i++) {
+    if (uniform_chunks(chunk_size, MEMORY_SIZE) != chunks) {
+      printf("Could not allocate %d chunks on round %d.\n"
+              "Uniform chunk test FAILED.\n", chunks, i);
+      failure = 1;
+      break;
+    }
+  }
+
+  if (!failure)
+    printf("Passed uniform chunks test.\n");
+
+  close_myalloc();
+  return 0;
+
+}
+
+
+/* This test runs a series of random allocations and deallocations,
+ * to see how much overhead is required by the allocator in question
+ * for a certain number of bytes to be allocated.  During the test,
+ * the allocated regions are verified to not overlap with each other,
+ * and so forth.
+ */
+// An allocator that a sequence can be replayed on, for comparing this one
+// with others: its allocate, free and usable size functions.
+#define MAX_BACKENDS 8
+typedef struct backend {
+  const char *name;
+  void *(*alloc)(size_t size);
+  void (*free)(void *ptr);
+  size_t (*usable)(void *ptr);
+} backend;
+
+// What replaying a sequence on a backend cost.
+typedef struct backend_result {
+  int ok;
+  double seconds;
+  long peak_rss;       // bytes resident at the peak, over those at the start
+  size_t peak_live;    // most bytes asked for at once
+  size_t peak_usable;  // most usable bytes handed out at once
+} backend_result;
+
+void *myalloc_backend(size_t size) {
+  return myalloc(size);
+}
+
+void myfree_backend(void *ptr) {
+  myfree((unsigned char *) ptr);
+}
+
+size_t myalloc_usable_backend(void *ptr) {
+  return myalloc_usable_size((unsigned char *) ptr);
+}
+
+int backend_count = 2;
+backend backends[MAX_BACKENDS] = {
+  {"myalloc", myalloc_backend, myfree_backend, myalloc_usable_backend},
+  {"glibc", malloc, free, malloc_usable_size},
+};
+
+// Adds the allocator in the shared library at path (say, libjemalloc.so) as
+// a backend, looking up its malloc, free and malloc_usable_size.
+int add_backend(char *path) {
+  void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    printf("ERROR:  %s\n", dlerror());
+    return -1;
+  }
+  backend *b = &backends[backend_count];
+  b->alloc = (void *(*)(size_t)) dlsym(lib, "malloc");
+  b->free = (void (*)(void *)) dlsym(lib, "free");
+  b->usable = (size_t (*)(void *)) dlsym(lib, "malloc_usable_size");
+  if (b->alloc == NULL || b->free == NULL || b->usable == NULL) {
+    printf("ERROR:  %s has no malloc, free or malloc_usable_size.\n", path);
+    return -1;
+  }
+  b->name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+  backend_count++;
+  return 0;
+}
+
+// Returns the most bytes this process has had resident since the peak was
+// last reset (by writing 5 to /proc/self/clear_refs), or -1 if unknown.
+long peak_resident_bytes() {
+  char line[256];
+  long peak = -1;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) {
+      peak *= 1024;
+      break;
+    }
+  }
+  fclose(f);
+  return peak;
+}
+
+// Resets the peak resident size of this process to what is resident now.
+void reset_peak_resident() {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+// Replays the sequence on backend b, copying data into each block as
+// try_sequence does and checking the blocks still live at the end, then
+// frees them. The myalloc backend gets a pool of mem_size bytes. Memory the
+// C library holds free is given back first, and the peak resident size is
+// reset, so that the peak measured is this backend's own.
+void replay_on_backend(SEQLIST *test_sequence, backend *b, int mem_size,
+                       backend_result *result) {
+  size_t live = 0, usable = 0;
+  int failed = 0;
+  struct timespec start, end;
+
+  memset(result, 0, sizeof(*result));
+  malloc_trim(0);
+  if (b->alloc == myalloc_backend) {
+    MEMORY_SIZE = mem_size;
+    init_myalloc();
+  }
+  // fault in the code the replay runs, so that it is not counted
+  b->free(b->alloc(seq_size(seq_at(test_sequence, 0))));
+  reset_peak_resident();
+  long rss_start = resident_bytes();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < seq_length(test_sequence); i++) {
+    seq_op *op = seq_at(test_sequence, i);
+    if (seq_alloc(op)) {
+      unsigned char *block = b->alloc(seq_size(op));
+      seq_set_myalloc_block(op, block);
+      if (block == NULL) {
+        failed = 1;
+        break;
+      }
+      seq_fill(test_sequence, i, block);
+      live += seq_size(op);
+      usable += b->usable(block);
+      if (live > result->peak_live)
+        result->peak_live = live;
+      if (usable > result->peak_usable)
+        result->peak_usable = usable;
+    }
+    else {
+      seq_op *freed = seq_at(test_sequence, seq_tofree(op));
+      live -= seq_size(freed);
+      usable -= b->usable(seq_myalloc_block(freed));
+      b->free(seq_myalloc_block(freed));
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result->seconds = (end.tv_sec - start.tv_sec)
+                    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  result->peak_rss = peak_resident_bytes() - rss_start;
+
+  // the blocks of a replay cut short by a failed allocation are left alone
+  result->ok = !failed;
+  for (size_t n = 0; !failed && n < seq_live_count(test_sequence); n++) {
+    size_t i = seq_live(test_sequence, n);
+    unsigned char *block = seq_myalloc_block(seq_at(test_sequence, i));
+    if (!seq_same_data(test_sequence, i, block))
+      result->ok = 0;
+    b->free(block);
+  }
+  if (b->alloc == myalloc_backend)
+    close_myalloc();
+}
+
+// Replays one sequence on every backend and prints a table of the time each
+// took (and how that compares with glibc's), the resident memory it grew by
+// at its peak, and its overhead: the usable bytes it handed out, and the
+// memory it kept resident, per byte asked for at the peak.
+void compare_backends(SEQLIST *test_sequence, int mem_size) {
+  backend_result results[MAX_BACKENDS];
+  for (int i = 0; i < backend_count; i++)
+    replay_on_backend(test_sequence, &backends[i], mem_size, &results[i]);
+
+  printf("%-16s %12s %9s %14s %12s %10s\n", "allocator", "time (s)",
+         "x glibc", "peak RSS (B)", "usable/live", "RSS/live");
+  for (int i = 0; i < backend_count; i++) {
+    backend_result *r = &results[i];
+    if (!r->ok) {
+      printf("%-16s failed\n", backends[i].name);
+      continue;
+    }
+    printf("%-16s %12.6f %9.2f %14ld %12.3f %10.3f\n", backends[i].name,
+           r->seconds, results[1].seconds > 0 ? r->seconds / results[1].seconds
+                                              : 0.0,
+           r->peak_rss, (double) r->peak_usable / r->peak_live,
+           (double) r->peak_rss / r->peak_live);
+  }
+}
+
+void utilization_test(int max_allocation, int allocation_factor) {
+  int max_used_memory;
+  int memory_required;
+  int upper_bound;
+  clock_t start;
+
+  SEQLIST *test_sequence;
+
+  max_used_memory = max_allocation;
+
+  printf("running with MAX_USED_MEMORY=%d and ALLOCATION_FACTOR=%d\n",
+    max_used_memory, allocation_factor);
+
+  test_sequence = generate_sequence(max_used_memory, allocation_factor);
+  if (VERBOSE)
+    seq_print(test_sequence);
+
+  start = clock();
+
+  // check that allocation can actually do something, doubling the pool
+  // from twice the most the sequence has live up to the no-free case
+  // (which, for a long sequence, is far more than it needs).
+  // This becomes upper bound on binary search.
+  upper_bound = max_used_memory * 2;
+  while (!try_sequence(test_sequence, upper_bound)) {
+    close_myalloc();
+    if (upper_bound >= (long long) max_used_memory * allocation_factor * 2
+        || upper_bound > INT_MAX / 2) {
+      upper_bound = 0;
+      break;
+    }
+    upper_bound *= 2;
+  }
+
+  if (upper_bound) {
+
+    // That call to try_sequence allocated a memory pool for myalloc, which
+    // is no longer in use.
+    close_myalloc();
+
+    // binary search for smallest MEMORY_SIZE which can accommodate
+    memory_required = binary_search_required_memory(test_sequence,
+      max_used_memory - 1, upper_bound);
+
+    // run it one more time at the identified size.
+    // this makes sure that the data is set from a successful run.
+    if (try_sequence(test_sequence, memory_required)) {
+      // check if data contents are intact
+      if (check_data(test_sequence)) {
+        printf("Data integrity FAIL.\n");
+      }
+      else {
+        printf("Data integrity PASS.\n");
+      }
+
+      // print statistics
+      printf("Memory utilization: (%d/%d)=%f\n", max_used_memory, memory_required,
+             ((double) max_used_memory / (double) memory_required));
+      printf("Time replaying sequences: %f seconds\n",
+             (double) (clock() - start) / CLOCKS_PER_SEC);
+
+      // the same sequence on the other allocators
+      compare_backends(test_sequence, memory_required);
+    }
+    else {
+      printf("Consistency problem: binary_search_required_memory "
+             "returned %d, but final test failed\n", memory_required);
+    }
+  }
+  else {
+    printf("Requires more memory than the no-free case.\n");
+  }
+  seq_cleanup(test_sequence);
+}
+
+
+void usage(char *program) {
+  printf("usage: %s [-s seed] [-m max_allocation] [-f factor] [-i index] "
+         "[-v level] [-t trace] [-c library]\n", program);
+  printf("\tRuns the myalloc tester.\n\n");
+  printf("\t-s seed sets the tester to use a specific random seed\n\n");
+  printf("\t-m max_allocation sets the maximum number of bytes that the\n");
+  printf("\ttester should try to allocate during utilization tests\n\n");
+  printf("\t-f factor sets how many times max_allocation the utilization\n");
+  printf("\ttest's sequence allocates in all (default %d)\n\n",
+         DEFAULT_ALLOCATION_FACTOR);
+  printf("\t-i index selects the free block index: list, tlsf or tree\n\n");
+  printf("\t-v level selects heap verification: off, fast, sampled or full\n\n");
+  printf("\t-t trace replays an allocation trace recorded by librecord.so\n");
+  printf("\tinstead of running the tests\n\n");
+  printf("\t-c library adds the malloc in a shared library to the allocators\n");
+  printf("\tthe utilization test compares (may be given more than once)\n\n");
+}
+
+
+/* The main program, which calls the various tests to exercise the allocator. */
+int main(int argc, char *argv[]) {
+  unsigned int seed = DEFAULT_RANDOM_SEED;
+  int max_allocation = DEFAULT_MAX_ALLOCATION;
+  int allocation_factor = DEFAULT_ALLOCATION_FACTOR;
+  char *trace = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "s:m:f:i:v:t:c:h")) != -1) {
+    switch (c) {
+      case 's':    /* Random seed */
+        seed = atoi(optarg);
+        break;
+
+      case 'i':    /* Free block index */
+        if (strcmp(optarg, "list") == 0)
+          FREE_INDEX = INDEX_LIST;
+        else if (strcmp(optarg, "tlsf") == 0)
+          FREE_INDEX = INDEX_TLSF;
+        else if (strcmp(optarg, "tree") == 0)
+          FREE_INDEX = INDEX_TREE;
+        else {
+          printf("ERROR:  Unknown free block index %s.\n", optarg);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'v':    /* Heap verification level */
+        if (strcmp(optarg, "off") == 0)
+          VERIFY_LEVEL = VERIFY_OFF;
+        else if (strcmp(optarg, "fast") == 0)
+          VERIFY_LEVEL = VERIFY_FAST;
+        else if (strcmp(optarg, "sampled") == 0)
+          VERIFY_LEVEL = VERIFY_SAMPLED;
+        else if (strcmp(optarg, "full") == 0)
+          VERIFY_LEVEL = VERIFY_FULL;
+        else {
+          printf("ERROR:  Unknown verification level %s.\n", optarg);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'm':
+        max_allocation = atoi(optarg);
+        if (max_allocation < 0) {
+          printf("ERROR:  Max allocation must be nonnegative.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'f':    /* Allocation factor of the utilization test */
+        allocation_factor = atoi(optarg);
+        if (allocation_factor < 1) {
+          printf("ERROR:  Allocation factor must be positive.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 't':    /* Allocation trace to replay */
+        trace = optarg;
+        break;
+
+      case 'c':    /* Another allocator to compare with */
+        if (backend_count == MAX_BACKENDS) {
+          printf("ERROR:  At most %d allocators can be compared.\n",
+                 MAX_BACKENDS);
+          return 1;
+        }
+        if (add_backend(optarg) != 0)
+          return 1;
+        break;
+
+      case 'h':
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (trace != NULL)
+    return replay_trace(trace) < 0 ? 1 : 0;
+
+  if (seed != DEFAULT_RANDOM_SEED)
+    printf("Using seed:  %u\n\n", seed);
+
+  srand(seed);
+
+  // Do the basic test of coalescing behavior
+  coalesce_test();
+  printf("\n");
 
   // Do the basic test with repeated allocation of many uniform chunks
   uniform_chunk_test();
   printf("\n");
 
+  // Test the compact block layout
+  compact_block_test();
+  printf("\n");
+
+  // Test the bounded scan of the TLSF index
+  tlsf_scan_test();
+  printf("\n");
+
+  // Do the basic test of separate heap instances
+  heap_instance_test();
+  printf("\n");
+
+  // Do the test of slabs for tiny objects
+  slab_test();
+  printf("\n");
+
+  // Do the test of payload alignment and aligned allocation
+  alignment_test();
+  printf("\n");
+
+  // Do the test of resizing blocks in place
+  realloc_test();
+  printf("\n");
+
+  // Do the test of batch allocation and freeing
+  batch_test();
+  printf("\n");
+
+  // Do the test of heap statistics
+  stats_test();
+  printf("\n");
+
+  // Do the test of heap snapshots
+  dump_test();
+  printf("\n");
+
+  // Do the test of recording and replaying allocation traces
+  trace_test();
+  printf("\n");
+
+  // Do the test of hardware performance counters
+  perfcount_test();
+  printf("\n");
+
+  // Do the test of heap verification
+  verify_test();
+  printf("\n");
+
+  // Do the test of heaps that grow on demand
+  growable_test();
+  printf("\n");
+
+  // Do the test of pools larger than 4 GB
+  wide_pool_test();
+  printf("\n");
+
+  // Do the test of large objects mapped on their own
+  large_test();
+  printf("\n");
+
+  // Do the test of pools backed by huge pages
+  huge_page_test();
+  printf("\n");
+
+  // Do the test of giving free memory back to the system
+  scavenge_test();
+  printf("\n");
+
+  // Do the test of the thread-safe allocator
+  mt_test();
+  printf("\n");
+
+  // Do the test of frees made by a thread other than the allocating one
+  remote_free_test();
+  printf("\n");
+
+  // Do the test of the LD_PRELOAD replacement for malloc
+  preload_test();
+  printf("\n");
+
   // Do the memory utilization test to see how efficient the allocator is
-  utilization_test(max_allocation);
+  utilization_test(max_allocation, allocation_factor);
 
   return 0;
 }
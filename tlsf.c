@@ -0,0 +1,210 @@
+/*! \file
+ * Implementation of the two-level segregated-fit (TLSF) free block index.
+ *
+ * Every free block lives in exactly one bin, chosen from its size in
+ * ALIGNMENT units (UNITS_OF its tag, so that no two bins of level 0 are for
+ * sizes that cannot both occur):
+ *      -- first level index (fl): which power of two range the size is in
+ *      -- second level index (sl): which of the TLSF_SL_COUNT equal slices of
+ *         that range the size is in
+ * flBitmap has bit fl set iff some bin in row fl is non-empty, and
+ * slBitmap[fl] has bit sl set iff bins[fl][sl] is non-empty (all three are
+ * fields of the heap). Each bin is a doubly linked list threaded through the
+ * next/prev links of the node headers, exactly like the single explicit free
+ * list.
+ *
+ * Inserting and removing are constant time. Searching rounds the request up
+ * to the start of the next bin, so that any block in any non-empty bin at or
+ * above the rounded bin is guaranteed to fit, and then finds that bin with two
+ * find-first-set operations, which is also constant time. This is "good fit"
+ * rather than best fit: a block in the request's own bin that happens to be
+ * large enough is skipped by the fast path. Only when the fast path finds
+ * nothing is the request's own bin scanned, so a tight pool can still use it,
+ * and then only its first TLSF_SCAN_LIMIT blocks: a search never costs more
+ * than the two find-first-sets and that many block visits, however long the
+ * bin is, at the price of missing a fitting block further down it.
+ */
+
+#include <stdlib.h>
+
+#include "myalloc.h"
+#include "tlsf.h"
+
+
+/*!
+ * Computes the bin indices for a block of the given (positive) size in units.
+ */
+static void mapping(unsigned int units, int *fl, int *sl)
+{
+    if (units < TLSF_SL_COUNT)
+    {
+        *fl = 0;
+        *sl = units;
+    }
+    else
+    {
+        int msb = 31 - __builtin_clz(units); /* index of highest set bit */
+        *fl = msb - TLSF_SL_LOG2 + 1;
+        *sl = (units >> (msb - TLSF_SL_LOG2)) - TLSF_SL_COUNT;
+    }
+}
+
+
+/*!
+ * Empties all bins and bitmaps, used when a heap is set up.
+ */
+void tlsfReset(myheap *heap)
+{
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++)
+    {
+        for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+        {
+            heap->bins[fl][sl] = NULL;
+        }
+        heap->slBitmap[fl] = 0;
+    }
+    heap->flBitmap = 0;
+}
+
+
+/*!
+ * Adds a free block to the front of the bin for its size, marking the bin
+ * (and its row) as non-empty. Constant time.
+ */
+void tlsfInsert(myheap *heap, node *newNode)
+{
+    int fl, sl;
+    mapping(UNITS_OF(newNode->tag), &fl, &sl);
+
+    node *oldFirstNode = heap->bins[fl][sl];
+    newNode->next = LINK_TO(heap, oldFirstNode);
+    newNode->prev = 0;
+    heap->bins[fl][sl] = newNode;
+    if (oldFirstNode != NULL)
+    {
+        oldFirstNode->prev = LINK_TO(heap, newNode);
+    }
+    heap->slBitmap[fl] |= 1U << sl;
+    heap->flBitmap |= 1U << fl;
+}
+
+
+/*!
+ * Unlinks a free block from its bin, clearing the bitmap bits if the bin
+ * became empty. The block's size must not have changed since it was
+ * inserted, since that is what identifies the bin. Constant time.
+ */
+void tlsfRemove(myheap *heap, node *badNode)
+{
+    int fl, sl;
+    mapping(UNITS_OF(badNode->tag), &fl, &sl);
+
+    node *prevNode = NODE_AT(heap, badNode->prev);
+    node *nextNode = NODE_AT(heap, badNode->next);
+    if (prevNode == NULL)
+    {
+        heap->bins[fl][sl] = nextNode;
+        if (nextNode == NULL)
+        {
+            heap->slBitmap[fl] &= ~(1U << sl);
+            if (heap->slBitmap[fl] == 0)
+            {
+                heap->flBitmap &= ~(1U << fl);
+            }
+        }
+    }
+    else
+    {
+        prevNode->next = badNode->next;
+    }
+    if (nextNode != NULL)
+    {
+        nextNode->prev = badNode->prev;
+    }
+}
+
+
+/*!
+ * Finds a free block of at least units, or returns NULL if there is none
+ * within reach. Constant time: see the file comment for the search strategy
+ * and its bound.
+ */
+node *tlsfFind(myheap *heap, unsigned int units)
+{
+    int fl, sl;
+    unsigned int rounded = units;
+
+    /*
+     * Round up to the next bin boundary so every block in the bin that is
+     * found is large enough. Sizes in level 0 map to exactly one size per
+     * bin and need no rounding.
+     */
+    if (rounded >= TLSF_SL_COUNT)
+    {
+        int msb = 31 - __builtin_clz(rounded);
+        rounded += (1U << (msb - TLSF_SL_LOG2)) - 1;
+    }
+    mapping(rounded, &fl, &sl);
+
+    if (fl < TLSF_FL_COUNT)
+    {
+        /* first try the bins at or above sl in the same row... */
+        unsigned int slMap = heap->slBitmap[fl] & (~0U << sl);
+        if (slMap == 0)
+        {
+            /* ...otherwise the smallest bin of the next non-empty row */
+            unsigned int flMap = heap->flBitmap & (~0U << (fl + 1));
+            if (flMap != 0)
+            {
+                fl = __builtin_ctz(flMap);
+                slMap = heap->slBitmap[fl];
+            }
+        }
+        if (slMap != 0)
+        {
+            return heap->bins[fl][__builtin_ctz(slMap)];
+        }
+    }
+
+    /*
+     * Nothing is guaranteed to fit, but a block in the request's own bin
+     * may still be large enough, if it is near the front.
+     */
+    mapping(units, &fl, &sl);
+    int visited = 0;
+    for (node *headptr = heap->bins[fl][sl];
+         headptr != NULL && visited < TLSF_SCAN_LIMIT;
+         headptr = NODE_AT(heap, headptr->next), visited++)
+    {
+        if (UNITS_OF(headptr->tag) >= units)
+        {
+            return headptr;
+        }
+    }
+    return NULL;
+}
+
+
+/*!
+ * Finds the largest free block: the biggest one in the highest non-empty bin,
+ * which has to be scanned since its blocks are not in order of size.
+ */
+node *tlsfLargest(myheap *heap)
+{
+    if (heap->flBitmap == 0)
+    {
+        return NULL;
+    }
+    int fl = 31 - __builtin_clz(heap->flBitmap);
+    int sl = 31 - __builtin_clz(heap->slBitmap[fl]);
+    node *resultptr = heap->bins[fl][sl];
+    for (node *headptr = resultptr; headptr != NULL;
+                                 headptr = NODE_AT(heap, headptr->next))
+    {
+        if (UNITS_OF(headptr->tag) > UNITS_OF(resultptr->tag))
+        {
+            resultptr = headptr;
+        }
+    }
+    return resultptr;
+}
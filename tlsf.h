@@ -0,0 +1,30 @@
+/*! \file
+ * Declarations for the two-level segregated-fit (TLSF) free block index.
+ * Free blocks are kept in per-size-class doubly linked lists ("bins"), and two
+ * levels of bitmaps record which bins are non-empty, so a suitable block can
+ * be located with a couple of find-first-set instructions instead of a walk
+ * over every free block. The bins and bitmaps live in the myheap struct, and
+ * the bin geometry is defined in myalloc.h.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/* Empties all bins and bitmaps. */
+void tlsfReset(myheap *heap);
+
+
+/* Adds a free block to the bin for its size. */
+void tlsfInsert(myheap *heap, node *newNode);
+
+
+/* Takes a free block out of its bin. */
+void tlsfRemove(myheap *heap, node *badNode);
+
+
+/* Finds a free block of at least units ALIGNMENT units, or NULL if none. */
+node *tlsfFind(myheap *heap, unsigned int units);
+
+
+/* Finds the largest free block in any bin, or NULL if all are empty. */
+node *tlsfLargest(myheap *heap);
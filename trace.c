@@ -0,0 +1,121 @@
+/*! \file
+ * Implementation of the allocation trace format (see trace.h).
+ *
+ * Varints are unsigned LEB128: seven bits to a byte, least significant
+ * first, with the top bit set on every byte but the last. Decoding checks
+ * every byte against the end of the trace and rejects varints longer than
+ * ten bytes, so a truncated or corrupt trace is reported rather than read
+ * past its end.
+ */
+
+#include <string.h>
+
+#include "trace.h"
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Writes value as a varint at p, returning the bytes written.
+ */
+static size_t putVarint(unsigned char *p, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        p[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (unsigned char) value;
+    return n;
+}
+
+
+/*!
+ * Reads a varint at p into *value, returning the byte after it, or NULL if
+ * it runs past end or is too long.
+ */
+static const unsigned char *getVarint(const unsigned char *p,
+                                      const unsigned char *end,
+                                      uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 70 && p < end; shift += 7)
+    {
+        unsigned char byte = *p++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Trace functions
+ * -------------------------------------------------------------------
+ */
+
+
+void traceHeader(unsigned char *buf)
+{
+    memcpy(buf, TRACE_MAGIC, 4);
+    buf[4] = TRACE_VERSION;
+}
+
+
+int traceValid(const unsigned char *buf, size_t len)
+{
+    return len >= TRACE_HEADER_SIZE && memcmp(buf, TRACE_MAGIC, 4) == 0
+                                    && buf[4] == TRACE_VERSION;
+}
+
+
+size_t traceEncode(unsigned char *buf, const trace_op *op, uint64_t *thread)
+{
+    int newThread = op->thread != *thread;
+    size_t n = 0;
+    buf[n++] = (unsigned char) (op->op | (newThread ? TRACE_THREAD : 0));
+    n += putVarint(buf + n, op->id);
+    if (op->op != TRACE_FREE)
+    {
+        n += putVarint(buf + n, op->size);
+    }
+    if (newThread)
+    {
+        n += putVarint(buf + n, op->thread);
+        *thread = op->thread;
+    }
+    return n;
+}
+
+
+const unsigned char *traceDecode(const unsigned char *p,
+                                 const unsigned char *end, trace_op *op)
+{
+    if (p >= end || (*p & ~(3 | TRACE_THREAD)) != 0 || (*p & 3) > TRACE_REALLOC)
+    {
+        return NULL;
+    }
+    int flags = *p++;
+    op->op = flags & 3;
+    p = getVarint(p, end, &op->id);
+    op->size = 0;
+    if (p != NULL && op->op != TRACE_FREE)
+    {
+        p = getVarint(p, end, &op->size);
+    }
+    if (p != NULL && (flags & TRACE_THREAD))
+    {
+        p = getVarint(p, end, &op->thread);
+    }
+    return p;
+}
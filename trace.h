@@ -0,0 +1,61 @@
+/*! \file
+ * Format of allocation traces, written by the recorder (record.c, built as
+ * librecord.so) and replayed by testmyalloc -t. A trace is TRACE_MAGIC and
+ * a version byte, followed by one record per operation until the end of the
+ * file. A record is a byte holding the operation (TRACE_ALLOC, TRACE_FREE or
+ * TRACE_REALLOC) and the TRACE_THREAD flag, then as unsigned LEB128 varints:
+ *      -- the id of the allocation, which stays the same through reallocs
+ *         and may be reused once it has been freed
+ *      -- for TRACE_ALLOC and TRACE_REALLOC, the size asked for
+ *      -- with TRACE_THREAD, the number of the thread making this and the
+ *         following operations, which is only written when it changes
+ * Ids are kept small by reuse, so most records take three to five bytes.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define TRACE_MAGIC "MYTR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 5
+
+#define TRACE_ALLOC 0
+#define TRACE_FREE 1
+#define TRACE_REALLOC 2
+#define TRACE_THREAD 4
+#define TRACE_MAX_RECORD (1 + 3 * 10) /* op byte and three 64-bit varints */
+
+typedef struct trace_op
+{
+    int op;          /* TRACE_ALLOC, TRACE_FREE or TRACE_REALLOC */
+    uint64_t id;
+    uint64_t size;   /* 0 for TRACE_FREE */
+    uint64_t thread;
+} trace_op;
+
+
+/* Writes the header of a trace, TRACE_HEADER_SIZE bytes, into buf. */
+void traceHeader(unsigned char *buf);
+
+
+/* Returns nonzero if the len bytes at buf start with a trace header. */
+int traceValid(const unsigned char *buf, size_t len);
+
+
+/*
+ * Encodes op into buf, which must have room for TRACE_MAX_RECORD bytes, and
+ * returns the bytes written. *thread is the thread of the record before,
+ * and is updated to op's.
+ */
+size_t traceEncode(unsigned char *buf, const trace_op *op, uint64_t *thread);
+
+
+/*
+ * Decodes the record at p, which ends no later than end, into op (whose
+ * thread is kept from the record before unless this one has a new one).
+ * Returns the start of the next record, or NULL if the record is cut short
+ * or malformed.
+ */
+const unsigned char *traceDecode(const unsigned char *p,
+                                 const unsigned char *end, trace_op *op);
@@ -0,0 +1,234 @@
+/*! \file
+ * Implementation of heap verification.
+ *
+ * The heap keeps two running counters (see myalloc.c): allocBytes, the total
+ * size of allocated blocks (headers included), updated as blocks are handed out
+ * and given back, and freeBytes, the total size of the blocks in the free
+ * index, updated by addNode and removeNode. Between operations they must add
+ * up to the size of the pool, which is a constant time stand-in for walking
+ * every block. The levels then build on that:
+ *      VERIFY_FAST -- the counters, and the block the operation left behind:
+ *          its tags must agree (a free block's header and footer, and its
+ *          TAG_INUSE and the next header's TAG_PREV_INUSE), its neighbours'
+ *          tags must agree too, and no two neighbours may both be free (they
+ *          would have coalesced, unless together they are larger than
+ *          MAX_BLOCK_SIZE)
+ *      VERIFY_SAMPLED -- as VERIFY_FAST, and every VERIFY_INTERVAL operations
+ *          a walk of every block, checking each block's tags and adding up
+ *          the allocated and free bytes (and blocks, for the block counts of
+ *          the statistics) to compare with the counters
+ *      VERIFY_FULL -- the walk after every operation
+ * Slab objects have no tags, so an operation that only touched a slab checks
+ * the counters alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "myalloc.h"
+#include "verify.h"
+
+
+/* -------------------------------------------------------------------
+ * Helper functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * Reports a corrupted heap and aborts.
+ */
+static void corrupted(myheap *heap, const char *what, void *where)
+{
+    fprintf(stderr, "myalloc: heap %p corrupted: %s at %p\n", (void *) heap,
+                                                              what, where);
+    abort();
+}
+
+
+/*!
+ * Checks that the block starting at dataptr lies within the pool, that its
+ * footer (if it is free) matches its header, and that the next header knows
+ * whether it is free, returning its total size (header included).
+ */
+static size_t checkTags(myheap *heap, unsigned char *dataptr)
+{
+    unsigned char *endptr = heap->mem + heap->size;
+    if (dataptr < heap->mem || dataptr > endptr - sizeof(node))
+    {
+        corrupted(heap, "block outside the pool", dataptr);
+    }
+    unsigned int tag = *((unsigned int *) dataptr);
+    size_t blockSize = SPACE_OF(tag) + sizeof(int);
+    if (UNITS_OF(tag) == 0 || blockSize > (size_t) (endptr - dataptr))
+    {
+        corrupted(heap, "bad block size", dataptr);
+    }
+    if (!(tag & TAG_INUSE)
+        && *((unsigned int *) (dataptr + blockSize - sizeof(int)))
+           != TAG_OF(SPACE_OF(tag)))
+    {
+        corrupted(heap, "header and footer differ", dataptr);
+    }
+    unsigned int nextTag = *((unsigned int *) (dataptr + blockSize));
+    if (!(nextTag & TAG_PREV_INUSE) != !(tag & TAG_INUSE))
+    {
+        corrupted(heap, "next header has the wrong in-use bit", dataptr);
+    }
+    return blockSize;
+}
+
+
+/*!
+ * The constant time check of one block and its two neighbours.
+ */
+static void checkBlock(myheap *heap, node *headptr)
+{
+    unsigned char *dataptr = (unsigned char *) headptr;
+    size_t blockSize = checkTags(heap, dataptr);
+    int isFree = !(headptr->tag & TAG_INUSE);
+
+    /* only a free previous block has a footer to find it by */
+    if (!(headptr->tag & TAG_PREV_INUSE))
+    {
+        unsigned int prevTag = *((unsigned int *) (dataptr) - 1);
+        unsigned char *prevDataptr = dataptr - SPACE_OF(prevTag)
+                                             - sizeof(int);
+        size_t prevSize = checkTags(heap, prevDataptr);
+        if (isFree && prevSize + blockSize <= MAX_BLOCK_SIZE)
+        {
+            corrupted(heap, "free blocks not coalesced", prevDataptr);
+        }
+    }
+
+    unsigned char *nextDataptr = dataptr + blockSize;
+    if (nextDataptr != heap->mem + heap->size)
+    {
+        size_t nextSize = checkTags(heap, nextDataptr);
+        if (isFree && !(*((unsigned int *) nextDataptr) & TAG_INUSE)
+            && blockSize + nextSize <= MAX_BLOCK_SIZE)
+        {
+            corrupted(heap, "free blocks not coalesced", dataptr);
+        }
+    }
+}
+
+
+/*!
+ * The walk over every block, which must add up to the counters. The first
+ * block must have TAG_PREV_INUSE, and the end tag TAG_INUSE, like checkBlock
+ * assumes; checkTags sees to the TAG_PREV_INUSE of every other header.
+ */
+static void walkHeap(myheap *heap)
+{
+    size_t allocMem = 0;
+    size_t freeMem = 0;
+    size_t allocBlocks = 0;
+    size_t freeBlocks = 0;
+    size_t prevFree = 0; /* size of the block before, if it is free */
+    unsigned char *endptr = heap->mem + heap->size;
+    unsigned char *dataptr = heap->mem;
+    unsigned int endTag = *((unsigned int *) endptr);
+    if (!(*((unsigned int *) dataptr) & TAG_PREV_INUSE)
+        || UNITS_OF(endTag) != 0 || !(endTag & TAG_INUSE))
+    {
+        corrupted(heap, "bad tag at an end of the pool", dataptr);
+    }
+    while (dataptr != endptr)
+    {
+        size_t blockSize = checkTags(heap, dataptr);
+        if (!(*((unsigned int *) dataptr) & TAG_INUSE))
+        {
+            if (prevFree != 0 && prevFree + blockSize <= MAX_BLOCK_SIZE)
+            {
+                corrupted(heap, "free blocks not coalesced", dataptr);
+            }
+            freeMem += blockSize;
+            freeBlocks++;
+            prevFree = blockSize;
+        }
+        else
+        {
+            allocMem += blockSize;
+            allocBlocks++;
+            prevFree = 0;
+        }
+        dataptr += blockSize;
+    }
+    if (allocMem != heap->allocBytes || freeMem != heap->freeBytes)
+    {
+        corrupted(heap, "byte counters differ from the blocks", heap->mem);
+    }
+    if (allocBlocks != heap->stats.allocBlocks
+        || freeBlocks != heap->stats.freeBlocks)
+    {
+        corrupted(heap, "block counts differ from the blocks", heap->mem);
+    }
+}
+
+
+
+/* -------------------------------------------------------------------
+ * Verification functions
+ * -------------------------------------------------------------------
+ */
+
+
+/*!
+ * MYALLOC_VERIFY may be set to off, fast, sampled or full (or 0 to 3), and
+ * is otherwise ignored.
+ */
+void verifyInit(myheap *heap)
+{
+    static const char *names[] = {"off", "fast", "sampled", "full"};
+
+    heap->verifyLevel = VERIFY_LEVEL;
+    heap->opCount = 0;
+
+    const char *env = getenv("MYALLOC_VERIFY");
+    if (env == NULL)
+    {
+        return;
+    }
+    for (int level = VERIFY_OFF; level <= VERIFY_FULL; level++)
+    {
+        if (strcmp(env, names[level]) == 0
+            || (env[0] == '0' + level && env[1] == '\0'))
+        {
+            heap->verifyLevel = level;
+        }
+    }
+}
+
+
+/*!
+ * Runs the checks the heap's verification level asks for. This is constant
+ * time except for the walks of VERIFY_SAMPLED and VERIFY_FULL.
+ */
+void verifyHeap(myheap *heap, node *headptr)
+{
+    int level = heap->verifyLevel;
+    if (level == VERIFY_OFF)
+    {
+        return;
+    }
+    if (level == VERIFY_FULL)
+    {
+        walkHeap(heap);
+        return;
+    }
+
+    if (heap->allocBytes + heap->freeBytes != heap->size)
+    {
+        corrupted(heap, "byte counters do not add up", heap->mem);
+    }
+    if (headptr != NULL)
+    {
+        checkBlock(heap, headptr);
+    }
+    if (level == VERIFY_SAMPLED && ++heap->opCount % VERIFY_INTERVAL == 0)
+    {
+        walkHeap(heap);
+    }
+}
@@ -0,0 +1,22 @@
+/*! \file
+ * Declarations for heap verification. Every heap operation ends by checking
+ * the heap's consistency, as thoroughly as the heap's verification level
+ * (one of VERIFY_*, see myalloc.h) asks for, and aborts with a report if the
+ * heap turns out to be corrupted.
+ *
+ * Include myalloc.h before this file.
+ */
+
+
+/*
+ * Sets a new heap's verification level from VERIFY_LEVEL, or from the
+ * MYALLOC_VERIFY environment variable if it names a level.
+ */
+void verifyInit(myheap *heap);
+
+
+/*
+ * Checks the heap after an operation, which left the block at headptr
+ * allocated or free (NULL if it only touched a slab).
+ */
+void verifyHeap(myheap *heap, node *headptr);